@@ -32,11 +32,18 @@
 #include <ros/ros.h>
 #include <diagnostic_updater/diagnostic_updater.h>
 
+#ifdef NARO_NODELET
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#endif
+
 #include "naro_blinkm_srvs/SetColor.h"
 #include "naro_blinkm_srvs/FadeToColor.h"
 
 using namespace naro_blinkm_srvs;
 
+namespace {
+
 double connectionRetry = 0.1;
 std::string deviceAddress = "/dev/naro/blinkm";
 double deviceTimeout = 0.1;
@@ -52,6 +59,9 @@ BlinkM::Pointer<BlinkM::Device> device;
 ros::ServiceServer setColorService;
 ros::ServiceServer fadeToColorService;
 
+ros::Timer diagnosticsTimer;
+ros::Timer connectionTimer;
+
 template <typename T> inline T clamp(const T& x,
     const T& min = std::numeric_limits<T>::min(),
     const T& max = std::numeric_limits<T>::max()) {
@@ -294,13 +304,12 @@ void tryConnect(const ros::TimerEvent& event) {
   }
 }
 
-int main(int argc, char **argv) {
-  ros::init(argc, argv, "blinkm_server");
-  ros::NodeHandle node("~");
-
-  signal(SIGINT, shutdown);
-  
-  updater.reset(new diagnostic_updater::Updater());
+/** Advertise the services and start the timers of the smart LED server under
+  * the given private node handle
+  */
+void startNode(ros::NodeHandle& node) {
+  updater.reset(new diagnostic_updater::Updater(ros::NodeHandle(), node,
+    node.getNamespace()));
   updater->setHardwareID("none");
 
   updater->add("Device", diagnoseDevice);
@@ -314,14 +323,52 @@ int main(int argc, char **argv) {
   setColorService = node.advertiseService("set_color", setColor);
   fadeToColorService = node.advertiseService("fade_to_color", fadeToColor);
 
-  ros::Timer diagnosticsTimer = node.createTimer(
+  diagnosticsTimer = node.createTimer(
     ros::Duration(1.0), updateDiagnostics);
-  ros::Timer connectionTimer = node.createTimer(
+  connectionTimer = node.createTimer(
     ros::Duration(connectionRetry), tryConnect);
+}
 
-  ros::spin();
+void stopNode() {
+  diagnosticsTimer.stop();
+  connectionTimer.stop();
 
   disconnect();
+}
+
+};
+
+#ifdef NARO_NODELET
+namespace naro_blinkm_srvs {
+  /** Nodelet running the smart LED server in the process of a nodelet manager
+    */
+  class BlinkmServerNodelet :
+    public nodelet::Nodelet {
+  public:
+    ~BlinkmServerNodelet() {
+      fadeToShutdownColor();
+      stopNode();
+    };
+
+    virtual void onInit() {
+      startNode(getPrivateNodeHandle());
+    };
+  };
+};
+
+PLUGINLIB_DECLARE_CLASS(naro_blinkm_srvs, blinkm_server,
+  naro_blinkm_srvs::BlinkmServerNodelet, nodelet::Nodelet)
+#else
+int main(int argc, char **argv) {
+  ros::init(argc, argv, "blinkm_server");
+  ros::NodeHandle node("~");
+
+  signal(SIGINT, shutdown);
+
+  startNode(node);
+  ros::spin();
+  stopNode();
 
   return 0;
 }
+#endif
@@ -18,15 +18,31 @@
  *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
  ***************************************************************************/
 
+#include <algorithm>
 #include <limits>
+#include <new>
 #include <vector>
 
+#include <stdlib.h>
+
 #include <ros/ros.h>
 #include <diagnostic_updater/diagnostic_updater.h>
 #include <diagnostic_updater/update_functions.h>
 
+#ifdef NARO_NODELET
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#endif
+
+#include <naro_fin_ctrl/Commands.h>
 #include <naro_fin_ctrl/SetCommands.h>
 
+#include <naro_shm/segment.h>
+#include <naro_shm/frames.h>
+
+#include <naro_trace/trace.h>
+#include <naro_trace/DumpTrace.h>
+
 #include "naro_cmd_srvs/GetOutputs.h"
 #include "naro_cmd_srvs/GetCoefficient.h"
 #include "naro_cmd_srvs/GetCoefficients.h"
@@ -55,17 +71,57 @@ using namespace naro_cmd_srvs;
 using namespace naro_fin_ctrl;
 using namespace sensor_msgs;
 
+#ifndef NARO_NODELET
+namespace {
+  /** Heap allocations of the calling thread, counted by the global operator
+    * new of the joystick command executable
+    */
+  __thread unsigned long numAllocations = 0;
+};
+
+void* operator new(size_t size) throw(std::bad_alloc) {
+  ++numAllocations;
+
+  void* address = malloc(size ? size : 1);
+  if (!address)
+    throw std::bad_alloc();
+
+  return address;
+}
+
+void operator delete(void* address) throw() {
+  free(address);
+}
+#endif
+
+namespace {
+
 std::string finServerName = "fin_controller";
 double connectionRetry = 0.1;
 std::string subscriberTopic = "joy";
 int subscriberQueueSize = 1;
 double subscriberFrequency = 1.0;
-
+float inputDeadband = 0.0f;
+std::vector<float> inputDeadbands;
+double outputFrequency = 25.0;
+bool outputSuppressUnchanged = true;
+bool outputAsynchronous = true;
+bool sharedMemoryEnabled = false;
+bool traceEnabled = false;
+int traceCapacity = 4096;
+std::string traceFile;
+
+/** Subscriptions, timers and clients are created through the handle of
+  * the node or nodelet, whose callback queue also serves its services
+  */
+boost::shared_ptr<ros::NodeHandle> nodeHandle;
 boost::shared_ptr<diagnostic_updater::Updater> updater;
 boost::shared_ptr<diagnostic_updater::FrequencyStatus> diagnoseFrequency;
 
 ros::ServiceClient setCommandsClient;
 
+ros::Publisher commandsPublisher;
+
 ros::ServiceServer getOutputsService;
 ros::ServiceServer getCoefficientService;
 ros::ServiceServer getCoefficientsService;
@@ -87,9 +143,16 @@ ros::ServiceServer addFinService;
 ros::ServiceServer removeFinService;
 ros::ServiceServer connectService;
 ros::ServiceServer disconnectService;
+ros::ServiceServer dumpTraceService;
 
 ros::Subscriber subscriber;
 
+ros::Timer diagnosticsTimer;
+ros::Timer connectionTimer;
+ros::Timer outputTimer;
+
+naro_shm::Segment<naro_shm::Commands> commandsSegment;
+
 class _Fin {
 public:
   class Actuator {
@@ -115,32 +178,6 @@ public:
           invertValues(invertValues) {
         };
         
-        inline float operator()(float x) const {
-          if (invertArguments)
-            x = -x;
-          
-          float y = 0.0f;
-          if (type == ramp)
-            y = (x > 0.0f) ? x : 0.0f;
-          else if (type == slope)
-            y = (x > 0.0f) ? 1.0f-x : 1.0f;
-          else if (type == step)
-            y = (x > 0.0f) ? 1.0f : 0.0f;
-          else if (type == absolute)
-            y = fabs(x);
-          else if (type == square)
-            y = x*x;
-          else if (type == exponential)
-            y = (x > 0.0f) ? x*exp(x-1.0f) : 0.0f;
-          else
-            y = x;
-            
-          if (invertValues)
-            return -y;
-          else
-            return y;
-        };
-        
         Type type;
         
         bool invertArguments;
@@ -151,15 +188,6 @@ public:
         constant(constant) {
       };
 
-      inline float operator()(const std::vector<float>& inputs) const {
-        float output = constant;
-        
-        for (int i = 0; i < coefficients.size(); ++i)
-          output *= coefficients[i](inputs[inputChannels[i]]);
-        
-        return output;
-      };
-      
       inline void connect(int inputChannel, const TransferFunction&
           coefficient = TransferFunction()) {
         inputChannels.push_back(inputChannel);
@@ -182,39 +210,10 @@ public:
       std::vector<int> inputChannels;
     };
 
-    class Commands {
-    public:
-      Commands(float frequency = 0.0f, float amplitude = 0.0f, float
-          offset = 0.0f, float phase = 0.0f) :
-        frequency(frequency),
-        amplitude(amplitude),
-        phase(phase),
-        offset(offset) {
-      };
-
-      float frequency;
-      float amplitude;
-      float phase;
-      float offset;
-    };
-    
     Actuator(int servo = -1) :
       servo(servo) {
     };
 
-    inline Commands operator()(const std::vector<float>& inputs) const {
-      Commands commands;
-      
-      if (servo >= 0) {
-        commands.frequency = frequency(inputs);
-        commands.amplitude = amplitude(inputs);
-        commands.phase = phase(inputs);
-        commands.offset = offset(inputs);
-      }
-
-      return commands;
-    };
-    
     OutputChannel& getOutputChannel(int id) {
       if (id == ::OutputChannel::AMPLITUDE)
         return amplitude;
@@ -266,7 +265,257 @@ public:
   Actuator flap;
 };
 
+/** Flat evaluation program compiled from the fin configuration
+  *
+  * The output channels of all actuators with a servo are laid out in the
+  * order of their servos, four channels per servo. Each channel refers to
+  * a contiguous range of instructions, and each instruction applies the
+  * kernel of its transfer function to a single input. Evaluation therefore
+  * walks two flat arrays without any branching on the configuration and
+  * without any allocation. The program is recompiled lazily after the
+  * configuration has changed.
+  */
+class Program {
+public:
+  enum Flags {
+    invertArguments = 0x01,
+    invertValues = 0x02
+  };
+
+  class Instruction {
+  public:
+    int input;
+    unsigned char opcode;
+    unsigned char flags;
+  };
+
+  class Channel {
+  public:
+    float constant;
+    int begin;
+    int end;
+  };
+
+  static const int numChannels = 4;
+
+  Program() :
+    valid(false) {
+  };
+
+  bool isValid() const {
+    return valid;
+  };
+
+  void invalidate() {
+    valid = false;
+  };
+
+  void compile(const std::vector<_Fin>& fins) {
+    servos.clear();
+    channels.clear();
+    instructions.clear();
+    int numInputs = 0;
+
+    for (int i = 0; i < fins.size(); ++i) {
+      compile(fins[i].pitch, numInputs);
+      compile(fins[i].flap, numInputs);
+    }
+
+    /** Invalid input channels refer to an extra input which remains zero
+      */
+    for (int i = 0; i < instructions.size(); ++i)
+      if (instructions[i].input < 0)
+        instructions[i].input = numInputs;
+
+    inputs.assign(numInputs+1, 0.0f);
+    outputs.assign(channels.size(), 0.0f);
+    valid = true;
+  };
+
+  /** Evaluate the program, missing inputs are taken to be zero
+    *
+    * Surplus inputs are ignored and never reach the extra input of invalid
+    * channels, which is the last and always zero.
+    */
+  void operator()(const std::vector<float>& inputs) {
+    size_t numInputs = std::min(inputs.size(), this->inputs.size()-1);
+
+    std::copy(inputs.begin(), inputs.begin()+numInputs,
+      this->inputs.begin());
+    std::fill(this->inputs.begin()+numInputs, this->inputs.end(), 0.0f);
+
+    for (int i = 0; i < channels.size(); ++i) {
+      float output = channels[i].constant;
+
+      for (int j = channels[i].begin; j < channels[i].end; ++j) {
+        const Instruction& instruction = instructions[j];
+
+        output *= kernels[instruction.opcode](this->inputs[
+          instruction.input]*signs[instruction.flags & invertArguments])*
+          signs[(instruction.flags & invertValues) >> 1];
+      }
+
+      outputs[i] = output;
+    }
+  };
+
+  size_t getNumServos() const {
+    return servos.size();
+  };
+
+  int getServo(int i) const {
+    return servos[i];
+  };
+
+  float getOutput(int i, int channel) const {
+    return outputs[i*numChannels+channel];
+  };
+
+private:
+  typedef float (*Kernel)(float x);
+
+  static float identity(float x) {
+    return x;
+  };
+
+  static float ramp(float x) {
+    return (x > 0.0f) ? x : 0.0f;
+  };
+
+  static float slope(float x) {
+    return (x > 0.0f) ? 1.0f-x : 1.0f;
+  };
+
+  static float step(float x) {
+    return (x > 0.0f) ? 1.0f : 0.0f;
+  };
+
+  static float absolute(float x) {
+    return fabs(x);
+  };
+
+  static float square(float x) {
+    return x*x;
+  };
+
+  static float exponential(float x) {
+    return (x > 0.0f) ? x*exp(x-1.0f) : 0.0f;
+  };
+
+  static const Kernel kernels[];
+  static const float signs[];
+
+  void compile(const _Fin::Actuator& actuator, int& numInputs) {
+    if (actuator.servo < 0)
+      return;
+
+    servos.push_back(actuator.servo);
+    for (int id = ::OutputChannel::FREQUENCY; id <= ::OutputChannel::OFFSET;
+        ++id)
+      compile(actuator.getOutputChannel(id), numInputs);
+  };
+
+  void compile(const _Fin::Actuator::OutputChannel& outputChannel, int&
+      numInputs) {
+    Channel channel;
+    channel.constant = outputChannel.constant;
+    channel.begin = instructions.size();
+
+    for (int i = 0; i < outputChannel.coefficients.size(); ++i) {
+      const _Fin::Actuator::OutputChannel::TransferFunction& coefficient =
+        outputChannel.coefficients[i];
+      Instruction instruction;
+
+      instruction.input = outputChannel.inputChannels[i];
+      instruction.opcode = ((coefficient.type >= 0) && (coefficient.type <=
+        _Fin::Actuator::OutputChannel::TransferFunction::exponential)) ?
+        coefficient.type :
+        _Fin::Actuator::OutputChannel::TransferFunction::identity;
+      instruction.flags =
+        (coefficient.invertArguments ? invertArguments : 0) |
+        (coefficient.invertValues ? invertValues : 0);
+
+      instructions.push_back(instruction);
+      numInputs = std::max(numInputs, instruction.input+1);
+    }
+
+    channel.end = instructions.size();
+    channels.push_back(channel);
+  };
+
+  bool valid;
+
+  std::vector<int> servos;
+  std::vector<Channel> channels;
+  std::vector<Instruction> instructions;
+
+  std::vector<float> inputs;
+  std::vector<float> outputs;
+};
+
+/** Kernels indexed by the transfer function type
+  */
+const Program::Kernel Program::kernels[] = {
+  Program::identity,
+  Program::ramp,
+  Program::slope,
+  Program::step,
+  Program::absolute,
+  Program::square,
+  Program::exponential
+};
+
+const float Program::signs[] = {1.0f, -1.0f};
+
 std::vector<_Fin> fins;
+Program program;
+
+/** Commands request kept across messages and resized only when the program
+  * is compiled
+  */
+SetCommands setCommands;
+
+unsigned long numMessages = 0;
+unsigned long numMessageAllocations = 0;
+
+/** Latest axes passed by the deadband, which are mapped whenever commands
+  * are due
+  */
+std::vector<float> axes;
+ros::Time axesStamp;
+bool axesPending = false;
+unsigned int commandsSequence = 0;
+uint64_t axesReceived = 0;
+uint32_t axesTrace = 0;
+uint32_t traceSequence = 0;
+bool commandsSent = false;
+ros::Time lastForward;
+
+unsigned long numReceived = 0;
+unsigned long numForwarded = 0;
+unsigned long numCoalesced = 0;
+unsigned long numSuppressed = 0;
+
+/** Spans of the input and of forwarding, ending when the commands of a
+  * traced input have been sent
+  */
+naro_trace::Tracer tracer;
+
+void compileProgram() {
+  program.compile(fins);
+
+  size_t numServos = program.getNumServos();
+  setCommands.request.servos.resize(numServos);
+  setCommands.request.frequency.resize(numServos);
+  setCommands.request.amplitude.resize(numServos);
+  setCommands.request.phase.resize(numServos);
+  setCommands.request.offset.resize(numServos);
+
+  for (int i = 0; i < numServos; ++i)
+    setCommands.request.servos[i] = program.getServo(i);
+
+  commandsSent = false;
+}
 
 void getParameters(const ros::NodeHandle& node) {
   node.param<std::string>("server/fin/name", finServerName, finServerName);
@@ -279,43 +528,54 @@ void getParameters(const ros::NodeHandle& node) {
     subscriberQueueSize);
   node.param<double>("subscriber/frequency", subscriberFrequency,
     subscriberFrequency);
+
+  XmlRpc::XmlRpcValue value;
+  if (node.getParam("input/deadband", value)) {
+    if (value.getType() == XmlRpc::XmlRpcValue::TypeArray) {
+      inputDeadbands.resize(value.size());
+      for (int i = 0; i < value.size(); ++i)
+        inputDeadbands[i] = (value[i].getType() ==
+          XmlRpc::XmlRpcValue::TypeInt) ? static_cast<int>(value[i]) :
+          static_cast<double>(value[i]);
+    }
+    else if (value.getType() == XmlRpc::XmlRpcValue::TypeInt)
+      inputDeadband = static_cast<int>(value);
+    else if (value.getType() == XmlRpc::XmlRpcValue::TypeDouble)
+      inputDeadband = static_cast<double>(value);
+    else
+      ROS_WARN("Invalid type for deadband parameter: expecting number or "
+        "array");
+  }
+
+  node.param<double>("output/frequency", outputFrequency, outputFrequency);
+  node.param<bool>("output/suppress_unchanged", outputSuppressUnchanged,
+    outputSuppressUnchanged);
+  node.param<bool>("output/asynchronous", outputAsynchronous,
+    outputAsynchronous);
+
+  node.param<bool>("shared_memory/enabled", sharedMemoryEnabled,
+    sharedMemoryEnabled);
+  node.param<bool>("trace/enabled", traceEnabled, traceEnabled);
+  node.param<int>("trace/capacity", traceCapacity, traceCapacity);
+  node.param<std::string>("trace/file", traceFile, traceFile);
 }
 
 bool getOutputs(GetOutputs::Request& request, GetOutputs::Response& response) {
-  size_t numServos = 0;
-  for (int i = 0; i < fins.size(); ++i) {
-    numServos += (fins[i].pitch.servo >= 0);
-    numServos += (fins[i].flap.servo >= 0);
+  if (!program.isValid())
+    compileProgram();
+  program(request.inputs);
+
+  response.outputs.resize(program.getNumServos());
+  for (int i = 0; i < program.getNumServos(); ++i) {
+    response.outputs[i].servo = program.getServo(i);
+    response.outputs[i].frequency = program.getOutput(i,
+      OutputChannel::FREQUENCY);
+    response.outputs[i].amplitude = program.getOutput(i,
+      OutputChannel::AMPLITUDE);
+    response.outputs[i].phase = program.getOutput(i, OutputChannel::PHASE);
+    response.outputs[i].offset = program.getOutput(i, OutputChannel::OFFSET);
   }
-  
-  int j = 0;
-  response.outputs.resize(numServos);
-  for (int i = 0; i < fins.size(); ++i) {
-    if (fins[i].pitch.servo >= 0) {
-      _Fin::Actuator::Commands commands = fins[i].pitch(request.inputs);
-      
-      response.outputs[j].servo = fins[i].pitch.servo;
-      response.outputs[j].frequency = commands.frequency;
-      response.outputs[j].amplitude = commands.amplitude;
-      response.outputs[j].phase = commands.phase;
-      response.outputs[j].offset = commands.offset;
-      
-      ++j;
-    }
 
-    if (fins[i].flap.servo >= 0) {
-      _Fin::Actuator::Commands commands = fins[i].flap(request.inputs);
-      
-      response.outputs[j].servo = fins[i].flap.servo;
-      response.outputs[j].frequency = commands.frequency;
-      response.outputs[j].amplitude = commands.amplitude;
-      response.outputs[j].phase = commands.phase;
-      response.outputs[j].offset = commands.offset;
-      
-      ++j;
-    }    
-  }
-  
   return true;
 }
 
@@ -632,6 +892,7 @@ bool setCoefficient(SetCoefficient::Request& request,
     request.coefficient.invert_arguments;
   outputChannel.coefficients[request.id].invertValues =
     request.coefficient.invert_values;
+  program.invalidate();
   
   return true;
 }
@@ -666,6 +927,7 @@ bool setCoefficients(SetCoefficients::Request& request,
     request.output_channel);
   outputChannel.coefficients.resize(request.coefficients.size());
   outputChannel.inputChannels.resize(request.coefficients.size());
+  program.invalidate();
   for (int i = 0; i < request.coefficients.size(); ++i) {
     SetCoefficient::Request setCoefficientRequest;
     SetCoefficient::Response setCoefficientResponse;
@@ -710,6 +972,7 @@ bool setOutputChannel(SetOutputChannel::Request& request,
   SetCoefficients::Response setCoefficientsResponse;
   
   outputChannel.constant = request.output_channel.constant;
+  program.invalidate();
   setCoefficientsRequest.fin = request.fin;
   setCoefficientsRequest.actuator = request.actuator;
   setCoefficientsRequest.output_channel = request.id;
@@ -783,6 +1046,7 @@ bool setActuator(SetActuator::Request& request, SetActuator::Response&
   SetOutputChannel::Response setOutputChannelResponse;
 
   actuator.servo = request.actuator.servo;
+  program.invalidate();
   setOutputChannelRequest.fin = request.fin;
   setOutputChannelRequest.actuator = request.id;
   setOutputChannelRequest.id = OutputChannel::FREQUENCY;
@@ -849,6 +1113,7 @@ bool setFins(SetFins::Request& request, SetFins::Response& response) {
   bool result = true;
   
   fins.resize(request.fins.size());
+  program.invalidate();
   for (int i = 0; i < request.fins.size(); ++i) {
     SetFin::Request setFinRequest;
     SetFin::Response setFinResponse;
@@ -868,6 +1133,7 @@ bool addFin(AddFin::Request& request, AddFin::Response& response) {
   setFinRequest.id = fins.size();
   setFinRequest.fin = request.fin;
   fins.resize(fins.size()+1);
+  program.invalidate();
   response.id = setFinRequest.id;
 
   return setFin(setFinRequest, setFinResponse);
@@ -880,6 +1146,7 @@ bool removeFin(RemoveFin::Request& request, RemoveFin::Response& response) {
   }
   
   fins.erase(fins.begin()+request.id);
+  program.invalidate();
   
   return true;
 }
@@ -913,6 +1180,7 @@ bool connect(Connect::Request& request, Connect::Response& response) {
     request.invert_values);
   outputChannel.coefficients.push_back(coefficient);
   outputChannel.inputChannels.push_back(request.input_channel);
+  program.invalidate();
   
   response.coefficient = outputChannel.coefficients.size()-1;
   
@@ -954,87 +1222,272 @@ bool disconnect(Disconnect::Request& request, Disconnect::Response&
     request.coefficient);
   outputChannel.inputChannels.erase(outputChannel.inputChannels.begin()+
     request.coefficient);
+  program.invalidate();
   
   return true;
 }
 
-void receiveJoy(const Joy::ConstPtr& message) {
-  size_t numServos = 0;
-  for (int i = 0; i < fins.size(); ++i) {
-    numServos += (fins[i].pitch.servo >= 0);
-    numServos += (fins[i].flap.servo >= 0);
+/** Map the latest axes and send the resulting commands unless they are
+  * unchanged since the last commands sent
+  */
+void forwardCommands() {
+  if (!program.isValid())
+    compileProgram();
+
+  axesPending = false;
+  lastForward = ros::Time::now();
+
+  size_t numServos = program.getNumServos();
+  if (!numServos)
+    return;
+
+  /** Asynchronous commands are published as sequenced frames stamped with
+    * the input they were mapped from. The message is reused unless a
+    * subscriber in this process still holds the previous one, a new one is
+    * sized before mapping.
+    */
+  bool synchronous = !commandsSegment.isOpen() && !outputAsynchronous;
+  static naro_fin_ctrl::Commands::Ptr commands;
+  if (!commandsSegment.isOpen() && !synchronous &&
+      (!commands || !commands.unique())) {
+    commands.reset(new naro_fin_ctrl::Commands());
+
+    commands->servos.reserve(numServos);
+    commands->frequency.reserve(numServos);
+    commands->amplitude.reserve(numServos);
+    commands->phase.reserve(numServos);
+    commands->offset.reserve(numServos);
   }
-  
-  if (!numServos) {
-    diagnoseFrequency->tick();
+
+  /** Mapping the inputs into the persistent request and message must not
+    * allocate, which is verified for all but their transport
+    */
+#ifndef NARO_NODELET
+  unsigned long allocations = numAllocations;
+#endif
+
+  program(axes);
+
+  bool changed = !commandsSent;
+  for (int i = 0; i < numServos; ++i) {
+    float frequency = program.getOutput(i, OutputChannel::FREQUENCY);
+    float amplitude = program.getOutput(i, OutputChannel::AMPLITUDE);
+    float phase = program.getOutput(i, OutputChannel::PHASE);
+    float offset = program.getOutput(i, OutputChannel::OFFSET);
+
+    changed |= (frequency != setCommands.request.frequency[i]) ||
+      (amplitude != setCommands.request.amplitude[i]) ||
+      (phase != setCommands.request.phase[i]) ||
+      (offset != setCommands.request.offset[i]);
+
+    setCommands.request.frequency[i] = frequency;
+    setCommands.request.amplitude[i] = amplitude;
+    setCommands.request.phase[i] = phase;
+    setCommands.request.offset[i] = offset;
+  }
+
+  if (!changed && outputSuppressUnchanged) {
+    ++numSuppressed;
     return;
   }
 
-  SetCommands setCommands;
-  setCommands.request.servos.resize(numServos);
-  setCommands.request.frequency.resize(numServos);
-  setCommands.request.amplitude.resize(numServos);
-  setCommands.request.phase.resize(numServos);
-  setCommands.request.offset.resize(numServos);
-  
-  int j = 0;
-  for (int i = 0; i < fins.size(); ++i) {
-    if (fins[i].pitch.servo >= 0) {
-      _Fin::Actuator::Commands commands = fins[i].pitch(message->axes);
-      
-      setCommands.request.servos[j] = fins[i].pitch.servo;
-      setCommands.request.frequency[j] = commands.frequency;
-      setCommands.request.amplitude[j] = commands.amplitude;
-      setCommands.request.phase[j] = commands.phase;
-      setCommands.request.offset[j] = commands.offset;
-      
-      ++j;
+  /** Write the commands into the shared memory segment of the fin
+    * controller if present, and fall back to its commands topic or its
+    * service otherwise
+    */
+  if (commandsSegment.isOpen()) {
+    static naro_shm::Commands frame;
+
+    frame.stamp = axesStamp.toNSec();
+    frame.trace = axesTrace;
+    frame.numServos = std::min(numServos, (size_t)naro_shm::maxServos);
+    for (int i = 0; i < frame.numServos; ++i) {
+      frame.servos[i] = setCommands.request.servos[i];
+      frame.frequency[i] = setCommands.request.frequency[i];
+      frame.amplitude[i] = setCommands.request.amplitude[i];
+      frame.phase[i] = setCommands.request.phase[i];
+      frame.offset[i] = setCommands.request.offset[i];
     }
 
-    if (fins[i].flap.servo >= 0) {
-      _Fin::Actuator::Commands commands = fins[i].flap(message->axes);
-      
-      setCommands.request.servos[j] = fins[i].flap.servo;
-      setCommands.request.frequency[j] = commands.frequency;
-      setCommands.request.amplitude[j] = commands.amplitude;
-      setCommands.request.phase[j] = commands.phase;
-      setCommands.request.offset[j] = commands.offset;
-      
-      ++j;
-    }    
+    commandsSegment.write(frame);
   }
-  
-  if (setCommandsClient.call(setCommands))
-    diagnoseFrequency->tick();
+  else if (!synchronous) {
+    commands->header.stamp = axesStamp;
+    commands->sequence = ++commandsSequence;
+    commands->trace = axesTrace;
+    commands->servos = setCommands.request.servos;
+    commands->frequency = setCommands.request.frequency;
+    commands->amplitude = setCommands.request.amplitude;
+    commands->phase = setCommands.request.phase;
+    commands->offset = setCommands.request.offset;
+  }
+
+#ifndef NARO_NODELET
+  numMessageAllocations += numAllocations-allocations;
+#endif
+  ++numMessages;
+
+  if (commandsSegment.isOpen())
+    commandsSent = true;
+  else if (!synchronous) {
+    commandsPublisher.publish(commands);
+    commandsSent = true;
+  }
+  else
+    commandsSent = setCommandsClient.call(setCommands);
+
+  numForwarded += commandsSent;
+  if (commandsSent)
+    tracer.record(axesTrace, naro_trace::stageJoyCommand, axesReceived,
+      naro_trace::now());
+}
+
+/** Pass the axes of a joystick message through the deadband and forward
+  * the commands if they are due at the output rate, otherwise leave them
+  * pending such that the latest axes win
+  */
+void receiveJoy(const Joy::ConstPtr& message) {
+  diagnoseFrequency->tick();
+  ++numReceived;
+
+  axesStamp = message->header.stamp.isZero() ? ros::Time::now() :
+    message->header.stamp;
+
+  /** The input span starts at the stamp of the joystick driver, which is
+    * taken to the monotonic clock by the age of the message
+    */
+  if (tracer.isEnabled()) {
+    axesReceived = naro_trace::now();
+    if (!++traceSequence)
+      ++traceSequence;
+    axesTrace = traceSequence;
+
+    int64_t age = (ros::Time::now()-axesStamp).toNSec();
+    age = std::max<int64_t>(0, std::min<int64_t>(age, axesReceived));
+    tracer.record(axesTrace, naro_trace::stageInput, axesReceived-age,
+      axesReceived);
+  }
+
+  /** Axes returning to their center are always passed, such that the
+    * deadband never holds a stick off its rest position
+    */
+  if (axes.size() != message->axes.size())
+    axes = message->axes;
+  else for (int i = 0; i < axes.size(); ++i) {
+    float deadband = (i < inputDeadbands.size()) ? inputDeadbands[i] :
+      inputDeadband;
+
+    if ((message->axes[i] == 0.0f) || (fabs(message->axes[i]-axes[i]) >
+        deadband))
+      axes[i] = message->axes[i];
+  }
+
+  if (axesPending)
+    ++numCoalesced;
+  axesPending = true;
+
+  if ((outputFrequency <= 0.0) || ((ros::Time::now()-lastForward).toSec() >=
+      1.0/outputFrequency))
+    forwardCommands();
+}
+
+/** Forward the commands left pending by the most recent joystick messages
+  */
+void updateOutput(const ros::TimerEvent& event) {
+  if (axesPending && ((ros::Time::now()-lastForward).toSec() >=
+      1.0/outputFrequency))
+    forwardCommands();
+}
+
+bool dumpTrace(naro_trace::DumpTrace::Request& request,
+    naro_trace::DumpTrace::Response& response) {
+  int numSpans = tracer.dump(request.file.empty() ? traceFile :
+    request.file);
+
+  if (numSpans < 0)
+    return false;
+  response.spans = numSpans;
+
+  return true;
 }
 
 void diagnoseConnections(diagnostic_updater::DiagnosticStatusWrapper &status) {
-  if (!setCommandsClient)
+  if (!setCommandsClient && !commandsSegment.isOpen())
     status.summaryf(diagnostic_msgs::DiagnosticStatus::ERROR,
       "Not all required services are connected.");
+  else if (outputAsynchronous && !commandsSegment.isOpen() &&
+      !commandsPublisher.getNumSubscribers())
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::WARN,
+      "No subscriber for commands frames.");
   else
     status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
       "All required services are connected.");
 }
 
+void diagnoseAllocations(diagnostic_updater::DiagnosticStatusWrapper
+    &status) {
+#ifndef NARO_NODELET
+  if (!numMessageAllocations)
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "No allocations while mapping %lu message(s).", numMessages);
+  else
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::WARN,
+      "%lu allocation(s) while mapping %lu message(s).",
+      numMessageAllocations, numMessages);
+
+  status.addf("Messages", "%lu", numMessages);
+  status.addf("Allocations", "%lu", numMessageAllocations);
+  status.addf("Allocations per message", "%.2f", numMessages ?
+    (double)numMessageAllocations/numMessages : 0.0);
+#else
+  status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+    "Allocations are not counted in a nodelet.");
+#endif
+
+  numMessages = 0;
+  numMessageAllocations = 0;
+}
+
+void diagnoseOutput(diagnostic_updater::DiagnosticStatusWrapper &status) {
+  if (outputFrequency > 0.0)
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "Commands coalesced to %.1f Hz.", outputFrequency);
+  else
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "Commands forwarded for every message.");
+
+  status.addf("Received", "%lu", numReceived);
+  status.addf("Forwarded", "%lu", numForwarded);
+  status.addf("Coalesced", "%lu", numCoalesced);
+  status.addf("Suppressed", "%lu", numSuppressed);
+}
+
 void updateDiagnostics(const ros::TimerEvent& event) {
   updater->update();
 }
 
 void tryConnect(const ros::TimerEvent& event = ros::TimerEvent()) {
   if (!setCommandsClient)
-    setCommandsClient = ros::NodeHandle("~").serviceClient<SetCommands>(
+    setCommandsClient = nodeHandle->serviceClient<SetCommands>(
       "/"+finServerName+"/set_commands", true);
-}
 
-int main(int argc, char **argv) {
-  ros::init(argc, argv, "joy_command");
-  ros::NodeHandle node("~");
+  if (sharedMemoryEnabled)
+    commandsSegment.reconnect(naro_shm::getSegmentName("/"+finServerName,
+      "commands"));
+}
 
-  updater.reset(new diagnostic_updater::Updater());
+/** Advertise the services and start the timers of the joystick command under
+  * the given private node handle
+  */
+void startNode(ros::NodeHandle& node) {
+  nodeHandle.reset(new ros::NodeHandle(node));
+  updater.reset(new diagnostic_updater::Updater(ros::NodeHandle(), node,
+    node.getNamespace()));
   updater->setHardwareID("none");
 
   updater->add("Connections", diagnoseConnections);
+  updater->add("Allocations", diagnoseAllocations);
+  updater->add("Output", diagnoseOutput);
   diagnoseFrequency.reset(new diagnostic_updater::FrequencyStatus(
     diagnostic_updater::FrequencyStatusParam(&subscriberFrequency,
     &subscriberFrequency)));
@@ -1043,6 +1496,7 @@ int main(int argc, char **argv) {
   updater->force_update();
 
   getParameters(node);
+  tracer.enable(traceEnabled ? traceCapacity : 0);
 
   getOutputsService = node.advertiseService("get_outputs", getOutputs);
   getCoefficientService = node.advertiseService("get_coefficient",
@@ -1073,18 +1527,65 @@ int main(int argc, char **argv) {
   removeFinService = node.advertiseService("remove_fin", removeFin);
   connectService = node.advertiseService("connect", connect);
   disconnectService = node.advertiseService("disconnect", disconnect);
+  dumpTraceService = node.advertiseService("dump_trace", dumpTrace);
 
-  ros::Timer diagnosticsTimer = node.createTimer(
+  diagnosticsTimer = node.createTimer(
     ros::Duration(1.0), updateDiagnostics);
-  ros::Timer connectionTimer = node.createTimer(
+  connectionTimer = node.createTimer(
     ros::Duration(connectionRetry), tryConnect);
 
-  subscriber = ros::NodeHandle("~").subscribe("/"+subscriberTopic,
+  if (outputAsynchronous)
+    commandsPublisher = node.advertise<naro_fin_ctrl::Commands>(
+      "/"+finServerName+"/commands", 1);
+
+  subscriber = node.subscribe("/"+subscriberTopic,
     subscriberQueueSize, receiveJoy);
+  if (outputFrequency > 0.0)
+    outputTimer = node.createTimer(
+      ros::Duration(1.0/outputFrequency), updateOutput);
   
   tryConnect();
+}
+
+void stopNode() {
+  diagnosticsTimer.stop();
+  connectionTimer.stop();
+  outputTimer.stop();
+
+  if (tracer.isEnabled() && !traceFile.empty())
+    tracer.dump(traceFile);
+}
+
+};
+
+#ifdef NARO_NODELET
+namespace naro_cmd_srvs {
+  /** Nodelet running the joystick command in the process of a nodelet manager
+    */
+  class JoyCommandNodelet :
+    public nodelet::Nodelet {
+  public:
+    ~JoyCommandNodelet() {
+      stopNode();
+    };
+
+    virtual void onInit() {
+      startNode(getPrivateNodeHandle());
+    };
+  };
+};
+
+PLUGINLIB_DECLARE_CLASS(naro_cmd_srvs, joy_command,
+  naro_cmd_srvs::JoyCommandNodelet, nodelet::Nodelet)
+#else
+int main(int argc, char **argv) {
+  ros::init(argc, argv, "joy_command");
+  ros::NodeHandle node("~");
 
+  startNode(node);
   ros::spin();
+  stopNode();
 
   return 0;
 }
+#endif
@@ -19,15 +19,27 @@
  ***************************************************************************/
 
 #include <limits>
+#include <vector>
+#include <algorithm>
+
+#include <boost/thread.hpp>
 
 #include <ros/ros.h>
 #include <diagnostic_updater/diagnostic_updater.h>
 #include <diagnostic_updater/update_functions.h>
 
+#ifdef NARO_NODELET
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#endif
+
 #include <naro_smc_srvs/GetLimits.h>
 #include <naro_smc_srvs/SetSpeed.h>
 #include <naro_sensor_srvs/GetDepth.h>
 
+#include <naro_shm/segment.h>
+#include <naro_shm/frames.h>
+
 #include "naro_dive_ctrl/GetEnabled.h"
 #include "naro_dive_ctrl/GetGains.h"
 #include "naro_dive_ctrl/GetCommand.h"
@@ -39,37 +51,54 @@
 #include "naro_dive_ctrl/Disable.h"
 #include "naro_dive_ctrl/Emerge.h"
 
+#include "naro_dive_ctrl/platform_model.h"
+#include "naro_dive_ctrl/estimator.h"
+#include "naro_dive_ctrl/trajectory.h"
+#include "naro_dive_ctrl/predictive_controller.h"
+
 using namespace naro_dive_ctrl;
 using namespace naro_smc_srvs;
 using namespace naro_sensor_srvs;
 
+namespace {
+
 std::string smcServerName = "smc_server";
 std::string sensorServerName = "depth_sensor";
 double connectionRetry = 0.1;
-float modelGravitationalAcceleration = 9.80665f;  // [m/s^2]
-float modelFluidDensity = 1000.0f;                // [kg/m^3]
-float modelPlatformMass = 10.0f;                  // [kg]
-float modelPlatformArea = 0.1f;                   // [m^2]
-float modelPlatformVolume = 0.012f;               // [m^3]
-float modelPlatformDragCoefficient = 1.0f;
-float modelActuatorMaxFlowRate = 20e-6f;          // [m^3/s]
+PlatformModel model;
 int actuatorLimitsMinInputChannel = 128;
 int actuatorLimitsMaxInputChannel = 256;
 bool actuatorInverted = true;
-double controllerFrequency = 5.0;
+double controllerFrequency = 20.0;
 float controllerToleranceDepth = 0.1f;             // [m]
 float controllerToleranceVelocity = 0.0f;          // [m/s]
-float controllerGainProportional = 1e-2f;
-float controllerGainIntegral = 1e-1f;
-float controllerGainDifferential = 0.0f;
+float controllerGainProportional = 1.2e-4f;
+float controllerGainIntegral = 8e-6f;
+float controllerGainDifferential = 6e-4f;
+bool plannerEnabled = true;
+float plannerMaxAcceleration = 0.05f;              // [m/s^2]
+float plannerFlowFraction = 0.5f;
+float plannerGainDepth = 0.1f;                     // [1/s]
+bool mpcEnabled = false;
+bool estimatorEnabled = true;
+double estimatorFrequency = 50.0;
+std::string estimatorMeasurement = "raw";
+double estimatorTimeout = 1.0;
+double limitsFrequency = 50.0;
+double limitsTimeout = 0.25;
+bool sharedMemoryEnabled = false;
 
 boost::shared_ptr<diagnostic_updater::Updater> updater;
+boost::shared_ptr<ros::NodeHandle> nodeHandle;
 boost::shared_ptr<diagnostic_updater::FrequencyStatus> diagnoseFrequency;
 
 ros::ServiceClient getLimitsClient;
 ros::ServiceClient setSpeedClient;
 ros::ServiceClient getDepthClient;
 
+naro_shm::Segment<naro_shm::Depth> depthSegment;
+uint32_t depthSequence = 0;
+
 ros::ServiceServer getEnabledService;
 ros::ServiceServer getGainsService;
 ros::ServiceServer getCommandService;
@@ -81,29 +110,43 @@ ros::ServiceServer enableService;
 ros::ServiceServer disableService;
 ros::ServiceServer emergeService;
 
+ros::Timer diagnosticsTimer;
+ros::Timer connectionTimer;
+ros::Timer controllerTimer;
+ros::Timer estimatorTimer;
+
+volatile bool running = false;
+boost::thread limitsThread;
+boost::thread actuationThread;
+
 class Controller {
 public:
   class Parameters {
   public:
-    Parameters(float depth = 0.0f, float velocity = 0.0f) :
+    Parameters(float depth = 0.0f, float velocity = 0.0f, float
+        acceleration = 0.0f) :
       depth(depth),
-      velocity(velocity) {
+      velocity(velocity),
+      acceleration(acceleration) {
     };
 
     float depth;
     float velocity;
+    float acceleration;
   };
 
   Controller(float lastError = std::numeric_limits<float>::quiet_NaN(),
       float integralError = 0.0f) :
     lastError(lastError),
     integralError(integralError),
-    enabled(false) {
+    enabled(false),
+    planned(false) {
   };
   
   void reset() {
     integralError = 0.0f;
     lastError = std::numeric_limits<float>::quiet_NaN();
+    planned = false;
   };
 
   bool enabled;
@@ -111,6 +154,12 @@ public:
   float integralError;
   Parameters command;
   Parameters actual;
+
+  /** Command the current trajectory was planned for and its start
+    */
+  bool planned;
+  Parameters plan;
+  ros::Time planTime;
 };
 
 Controller controller;
@@ -120,34 +169,160 @@ template <typename T> inline T clamp(T x, T min, T max) {
   return x < min ? min : (x > max ? max : x);
 }
 
-/** Calculate the net force [N] acting on the platform for a given platform
-  * velocity [m/s]
-  */
-inline float velocityToForce(float velocity) {
-  float gravitationalForce = modelPlatformMass*
-    modelGravitationalAcceleration;
-  float buoyancyForce = modelPlatformVolume*modelFluidDensity*
-    modelGravitationalAcceleration;
-  float dragForce = 0.5f*velocity*velocity*modelFluidDensity*
-    modelPlatformArea*modelPlatformDragCoefficient;
-
-  if (velocity > 0.0f)
-    return gravitationalForce-buoyancyForce-dragForce;
-  else
-    return gravitationalForce-buoyancyForce+dragForce;
+inline float outputToSpeed(float output) {
+  float sign = actuatorInverted ? -1.0f : 1.0f;
+  return clamp(sign*output/model.actuatorMaxFlowRate, -1.0f, 1.0f);
 }
 
-/** Calculate the platform acceleration [m/s^2] for a given platform
-  * velocity [m/s]
+/** The estimator runs on its own timer which may be served concurrently
+  * with the controller's in a nodelet manager
   */
-inline float velocityToAcceleration(float velocity) {
-  return velocityToForce(velocity)/modelPlatformMass;
-}
+Estimator estimator;
+boost::mutex estimatorMutex;
+ros::Time estimatorTime;
+ros::Time estimatorMeasurementTime;
+ros::Time estimatorLastStamp;
 
-inline float outputToSpeed(float output) {
-  float sign = actuatorInverted ? -1.0f : 1.0f;
-  return clamp(sign*output/modelActuatorMaxFlowRate, -1.0f, 1.0f);
-}
+/** The planner is guarded against the diagnostics, which may be updated
+  * concurrently in a nodelet manager
+  */
+TrajectoryPlanner planner;
+boost::mutex plannerMutex;
+unsigned long numPlans = 0;
+double planningTime = 0.0;
+
+/** Solve times [s] of the predictive controller between diagnostics
+  */
+class Distribution {
+public:
+  Distribution() {
+    reset();
+  };
+
+  void reset() {
+    samples.clear();
+    maximum = 0.0;
+  };
+
+  void add(double sample) {
+    samples.push_back(sample);
+    maximum = std::max(maximum, sample);
+  };
+
+  /** Quantile of the samples, sorting them in place
+    */
+  double getQuantile(double probability) {
+    if (samples.empty())
+      return 0.0;
+
+    std::sort(samples.begin(), samples.end());
+    return samples[std::min(samples.size()-1,
+      (size_t)(probability*samples.size()))];
+  };
+
+  /** Number of samples below the given bound
+    */
+  size_t count(double bound) const {
+    size_t count = 0;
+    for (size_t i = 0; i < samples.size(); ++i)
+      if (samples[i] < bound)
+        ++count;
+
+    return count;
+  };
+
+  std::vector<double> samples;
+  double maximum;
+};
+
+PredictiveController mpc;
+boost::mutex mpcMutex;
+Distribution solveTimes;
+unsigned long numIterations = 0;
+int maxIterations = 0;
+unsigned long numUnconverged = 0;
+
+/** Limit switch state polled from the motor controller in the background,
+  * stamped with the midpoint of the request
+  */
+class Limits {
+public:
+  Limits() :
+    limits(0),
+    latency(0.0),
+    sequence(0) {
+  };
+
+  int limits;
+  ros::WallTime stamp;
+  double latency;
+  uint32_t sequence;
+};
+
+Limits limits;
+boost::mutex limitsMutex;
+unsigned long numLimitsFailures = 0;
+
+/** Latest speed command of the controller, waiting to be sent by the
+  * actuation thread. Commands superseded before sending are dropped.
+  */
+class Actuation {
+public:
+  Actuation() :
+    pending(false),
+    speed(0.0f),
+    flow(0.0f) {
+  };
+
+  bool pending;
+  float speed;
+  float flow;
+  ros::WallTime stamp;
+};
+
+Actuation actuation;
+boost::mutex actuationMutex;
+boost::condition_variable actuationCondition;
+boost::mutex actuatorMutex;
+unsigned long numActuationFailures = 0;
+unsigned long numActuationsDropped = 0;
+
+/** Running mean and maximum of the pipeline delays [s] between two
+  * diagnostics updates
+  */
+class Delay {
+public:
+  Delay() {
+    reset();
+  };
+
+  void reset() {
+    sum = 0.0;
+    maximum = 0.0;
+    count = 0;
+  };
+
+  void add(double delay) {
+    sum += delay;
+    maximum = std::max(maximum, delay);
+    ++count;
+  };
+
+  double getMean() const {
+    return count ? sum/count : 0.0;
+  };
+
+  double sum;
+  double maximum;
+  size_t count;
+};
+
+Delay depthAge;
+Delay limitsAge;
+Delay limitsLatency;
+Delay actuationDelay;
+boost::mutex delayMutex;
+unsigned long numStaleTicks = 0;
 
 void getParameters(const ros::NodeHandle& node) {
   node.param<std::string>("server/smc/name", smcServerName, smcServerName);
@@ -156,34 +331,34 @@ void getParameters(const ros::NodeHandle& node) {
   node.param<double>("server/connection/retry", connectionRetry,
     connectionRetry);
 
-  double modelGravitationalAcceleration = ::modelGravitationalAcceleration;
+  double modelGravitationalAcceleration = model.gravitationalAcceleration;
   node.param<double>("model/gravitational_acceleration",
     modelGravitationalAcceleration, modelGravitationalAcceleration);
-  ::modelGravitationalAcceleration = modelGravitationalAcceleration;
-  double modelFluidDensity = ::modelFluidDensity;
+  model.gravitationalAcceleration = modelGravitationalAcceleration;
+  double modelFluidDensity = model.fluidDensity;
   node.param<double>("model/fluid/density",
     modelFluidDensity, modelFluidDensity);
-  ::modelFluidDensity = modelFluidDensity;
-  double modelPlatformMass = ::modelPlatformMass;
+  model.fluidDensity = modelFluidDensity;
+  double modelPlatformMass = model.platformMass;
   node.param<double>("model/platform/mass",
     modelPlatformMass, modelPlatformMass);
-  ::modelPlatformMass = modelPlatformMass;
-  double modelPlatformArea = ::modelPlatformArea;
+  model.platformMass = modelPlatformMass;
+  double modelPlatformArea = model.platformArea;
   node.param<double>("model/platform/area",
     modelPlatformArea, modelPlatformArea);
-  ::modelPlatformArea = modelPlatformArea;
-  double modelPlatformVolume = ::modelPlatformVolume;
+  model.platformArea = modelPlatformArea;
+  double modelPlatformVolume = model.platformVolume;
   node.param<double>("model/platform/volume",
     modelPlatformVolume, modelPlatformVolume);
-  ::modelPlatformVolume = modelPlatformVolume;
-  double modelPlatformDragCoefficient = ::modelPlatformDragCoefficient;
+  model.platformVolume = modelPlatformVolume;
+  double modelPlatformDragCoefficient = model.platformDragCoefficient;
   node.param<double>("model/platform/drag_coefficient",
     modelPlatformDragCoefficient, modelPlatformDragCoefficient);
-  ::modelPlatformDragCoefficient = modelPlatformDragCoefficient;
-  double modelActuatorMaxFlowRate = ::modelActuatorMaxFlowRate;
+  model.platformDragCoefficient = modelPlatformDragCoefficient;
+  double modelActuatorMaxFlowRate = model.actuatorMaxFlowRate;
   node.param<double>("model/actuator/max_flow_rate",
     modelActuatorMaxFlowRate, modelActuatorMaxFlowRate);
-  ::modelActuatorMaxFlowRate = modelActuatorMaxFlowRate;
+  model.actuatorMaxFlowRate = modelActuatorMaxFlowRate;
 
   node.param<int>("actuator/limits/minimum/input_channel",
     actuatorLimitsMinInputChannel, actuatorLimitsMinInputChannel);
@@ -214,6 +389,82 @@ void getParameters(const ros::NodeHandle& node) {
   node.param<double>("controller/gain/differential",
     controllerGainDifferential, controllerGainDifferential);
   ::controllerGainDifferential = controllerGainDifferential;
+
+  node.param<bool>("estimator/enabled", estimatorEnabled, estimatorEnabled);
+  node.param<double>("estimator/frequency", estimatorFrequency,
+    estimatorFrequency);
+  node.param<std::string>("estimator/measurement", estimatorMeasurement,
+    estimatorMeasurement);
+  node.param<double>("estimator/timeout", estimatorTimeout,
+    estimatorTimeout);
+  double estimatorNoiseAcceleration = estimator.noiseAcceleration;
+  node.param<double>("estimator/noise/acceleration",
+    estimatorNoiseAcceleration, estimatorNoiseAcceleration);
+  estimator.noiseAcceleration = estimatorNoiseAcceleration;
+  double estimatorNoiseBias = estimator.noiseBias;
+  node.param<double>("estimator/noise/bias",
+    estimatorNoiseBias, estimatorNoiseBias);
+  estimator.noiseBias = estimatorNoiseBias;
+  double estimatorNoiseMeasurement = estimator.noiseMeasurement;
+  node.param<double>("estimator/noise/measurement",
+    estimatorNoiseMeasurement, estimatorNoiseMeasurement);
+  estimator.noiseMeasurement = estimatorNoiseMeasurement;
+
+  node.param<bool>("planner/enabled", plannerEnabled, plannerEnabled);
+  double plannerMaxAcceleration = ::plannerMaxAcceleration;
+  node.param<double>("planner/max_acceleration",
+    plannerMaxAcceleration, plannerMaxAcceleration);
+  ::plannerMaxAcceleration = plannerMaxAcceleration;
+  double plannerFlowFraction = ::plannerFlowFraction;
+  node.param<double>("planner/flow_fraction",
+    plannerFlowFraction, plannerFlowFraction);
+  ::plannerFlowFraction = plannerFlowFraction;
+  double plannerGainDepth = ::plannerGainDepth;
+  node.param<double>("planner/gain/depth",
+    plannerGainDepth, plannerGainDepth);
+  ::plannerGainDepth = plannerGainDepth;
+
+  node.param<bool>("mpc/enabled", mpcEnabled, mpcEnabled);
+  int mpcHorizon = mpc.horizon;
+  node.param<int>("mpc/horizon", mpcHorizon, mpcHorizon);
+  mpc.horizon = std::max(mpcHorizon, 1);
+  double mpcStep = mpc.step;
+  node.param<double>("mpc/step", mpcStep, mpcStep);
+  mpc.step = mpcStep;
+  double mpcWeightDepth = mpc.weightDepth;
+  node.param<double>("mpc/weight/depth", mpcWeightDepth, mpcWeightDepth);
+  mpc.weightDepth = mpcWeightDepth;
+  double mpcWeightVelocity = mpc.weightVelocity;
+  node.param<double>("mpc/weight/velocity",
+    mpcWeightVelocity, mpcWeightVelocity);
+  mpc.weightVelocity = mpcWeightVelocity;
+  double mpcWeightFlow = mpc.weightFlow;
+  node.param<double>("mpc/weight/flow", mpcWeightFlow, mpcWeightFlow);
+  mpc.weightFlow = mpcWeightFlow;
+  double mpcWeightFlowRate = mpc.weightFlowRate;
+  node.param<double>("mpc/weight/flow_rate",
+    mpcWeightFlowRate, mpcWeightFlowRate);
+  mpc.weightFlowRate = mpcWeightFlowRate;
+  node.param<int>("mpc/max_iterations", mpc.solver.maxIterations,
+    mpc.solver.maxIterations);
+
+  /** The prediction starts from the estimated buoyancy acceleration
+    */
+  if (mpcEnabled && !estimatorEnabled) {
+    ROS_WARN("MPC requires the estimator, falling back to PID control.");
+    mpcEnabled = false;
+  }
+
+  estimator.model = model;
+  planner.model = model;
+  planner.flowFraction = plannerFlowFraction;
+  mpc.model = model;
+
+  node.param<double>("limits/frequency", limitsFrequency, limitsFrequency);
+  node.param<double>("limits/timeout", limitsTimeout, limitsTimeout);
+
+  node.param<bool>("shared_memory/enabled", sharedMemoryEnabled,
+    sharedMemoryEnabled);
 }
 
 bool getEnabled(GetEnabled::Request& request, GetEnabled::Response& response) {
@@ -270,10 +521,27 @@ bool enable(Enable::Request& request, Enable::Response& response) {
   return true;
 }
 
+/** Ballast moved while the controller is disabled is not modeled, the
+  * estimator's buoyancy random walk absorbs it instead
+  */
+void resetFlow() {
+  boost::mutex::scoped_lock lock(estimatorMutex);
+  estimator.flow = 0.0f;
+}
+
+/** Discard a speed command of the controller not yet sent
+  */
+void cancelActuation() {
+  boost::mutex::scoped_lock lock(actuationMutex);
+  actuation.pending = false;
+}
+
 bool disable(Disable::Request& request, Disable::Response& response) {
   controller.enabled = false;
   controller.reset();
   lastTime.fromSec(0.0);
+  resetFlow();
+  cancelActuation();
   
   return true;
 }
@@ -281,6 +549,13 @@ bool disable(Disable::Request& request, Disable::Response& response) {
 bool emerge(Emerge::Request& request, Emerge::Response& response) {
   controller.enabled = false;
   controller.reset();
+  resetFlow();
+
+  /** Holding the actuator orders the emerge command after any controller
+    * command in flight
+    */
+  boost::mutex::scoped_lock lock(actuatorMutex);
+  cancelActuation();
 
   GetLimits getLimits;
   if (!getLimitsClient.call(getLimits))
@@ -300,7 +575,8 @@ bool emerge(Emerge::Request& request, Emerge::Response& response) {
 }
 
 void diagnoseConnections(diagnostic_updater::DiagnosticStatusWrapper &status) {
-  if (!getLimitsClient || !setSpeedClient || !getDepthClient)
+  if (!getLimitsClient || !setSpeedClient ||
+      (!getDepthClient && !depthSegment.isOpen()))
     status.summaryf(diagnostic_msgs::DiagnosticStatus::ERROR,
       "Not all required services are connected.");
   else
@@ -308,58 +584,592 @@ void diagnoseConnections(diagnostic_updater::DiagnosticStatusWrapper &status) {
       "All required services are connected.");
 }
 
+void diagnoseEstimator(diagnostic_updater::DiagnosticStatusWrapper &status) {
+  boost::mutex::scoped_lock lock(estimatorMutex);
+
+  if (!estimatorEnabled)
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "Estimator is disabled, velocity is differentiated.");
+  else if (!estimator.initialized)
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::WARN,
+      "Estimator is waiting for a depth measurement.");
+  else
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "Estimator is fusing %s depth measurements at %.1f Hz.",
+      estimatorMeasurement.c_str(), estimatorFrequency);
+
+  if (estimatorEnabled && estimator.initialized) {
+    status.addf("Depth", "%f m", estimator.depth);
+    status.addf("Velocity", "%f m/s", estimator.velocity);
+    status.addf("Buoyancy acceleration", "%f m/s^2", estimator.bias);
+    status.addf("Ballast flow", "%e m^3/s", estimator.flow);
+    status.addf("Depth deviation", "%f m",
+      sqrtf(estimator.covariance[0][0]));
+    status.addf("Velocity deviation", "%f m/s",
+      sqrtf(estimator.covariance[1][1]));
+    status.addf("Normalized innovation", "%f",
+      estimator.innovation/sqrtf(estimator.innovationVariance));
+  }
+}
+
+void diagnosePlanner(diagnostic_updater::DiagnosticStatusWrapper &status) {
+  boost::mutex::scoped_lock lock(plannerMutex);
+
+  if (!plannerEnabled)
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "Planner is disabled, depth is controlled on-off.");
+  else if (!controller.planned)
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "Planner is waiting for the controller.");
+  else if (planner.getScale() < 1.0f)
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "Trajectory limits are shrunk to %.1f %% by the ballast flow.",
+      planner.getScale()*1e2f);
+  else
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "Trajectory is within the acceleration limit.");
+
+  if (plannerEnabled && controller.planned) {
+    const Trajectory& trajectory = planner.getTrajectory();
+    float time = (ros::Time::now()-controller.planTime).toSec();
+    
+    status.addf("Start depth", "%f m", trajectory.getStart());
+    status.addf("Goal depth", "%f m", trajectory.getGoal());
+    status.addf("Duration", "%f s", trajectory.getDuration());
+    status.addf("Remaining", "%f s",
+      std::max(trajectory.getDuration()-time, 0.0f));
+    status.addf("Maximum feedforward flow", "%e m^3/s",
+      planner.getMaxFlow());
+  }
+  status.addf("Plans", "%lu", numPlans);
+  status.addf("Planning time", "%.1f us", planningTime*1e6);
+}
+
+void diagnoseMpc(diagnostic_updater::DiagnosticStatusWrapper &status) {
+  boost::mutex::scoped_lock lock(mpcMutex);
+
+  if (!mpcEnabled)
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "MPC is disabled, velocity is controlled by PID.");
+  else if (numUnconverged)
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::WARN,
+      "%lu solves stopped at %d iterations.", numUnconverged,
+      mpc.solver.maxIterations);
+  else if (solveTimes.samples.empty())
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "No solves.");
+  else
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "Solved in %.1f us median, %.1f us max.",
+      solveTimes.getQuantile(0.5)*1e6, solveTimes.maximum*1e6);
+
+  if (mpcEnabled) {
+    size_t numSolves = solveTimes.samples.size();
+    
+    status.addf("Horizon", "%lu steps of %f s",
+      (unsigned long)mpc.horizon, mpc.step);
+    status.addf("Solves", "%lu", (unsigned long)numSolves);
+    status.addf("Solve time", "%.1f us median, %.1f us 90 %%, "
+      "%.1f us 99 %%, %.1f us max", solveTimes.getQuantile(0.5)*1e6,
+      solveTimes.getQuantile(0.9)*1e6, solveTimes.getQuantile(0.99)*1e6,
+      solveTimes.maximum*1e6);
+    status.addf("Solve time histogram", "%lu < 50 us, %lu < 200 us, "
+      "%lu < 1 ms, %lu < 5 ms, %lu >= 5 ms",
+      (unsigned long)solveTimes.count(50e-6),
+      (unsigned long)(solveTimes.count(200e-6)-solveTimes.count(50e-6)),
+      (unsigned long)(solveTimes.count(1e-3)-solveTimes.count(200e-6)),
+      (unsigned long)(solveTimes.count(5e-3)-solveTimes.count(1e-3)),
+      (unsigned long)(numSolves-solveTimes.count(5e-3)));
+    status.addf("Over budget", "%lu",
+      (unsigned long)(numSolves-solveTimes.count(1.0/controllerFrequency)));
+    status.addf("Iterations", "%.2f mean, %d max", numSolves ?
+      (double)numIterations/numSolves : 0.0, maxIterations);
+    status.addf("Unconverged", "%lu", numUnconverged);
+  }
+
+  solveTimes.reset();
+  numIterations = 0;
+  maxIterations = 0;
+  numUnconverged = 0;
+}
+
+void diagnosePipeline(diagnostic_updater::DiagnosticStatusWrapper &status) {
+  boost::mutex::scoped_lock lock(delayMutex);
+
+  if (numStaleTicks)
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::WARN,
+      "%lu ticks skipped on stale limits.", numStaleTicks);
+  else if (limitsAge.count)
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "Ticks ran on limits at most %.1f ms old.",
+      limitsAge.maximum*1e3);
+  else
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "No controller ticks.");
+
+  status.addf("Depth age", "%.1f ms mean, %.1f ms max",
+    depthAge.getMean()*1e3, depthAge.maximum*1e3);
+  status.addf("Limits age", "%.1f ms mean, %.1f ms max",
+    limitsAge.getMean()*1e3, limitsAge.maximum*1e3);
+  status.addf("Limits round trip", "%.1f ms mean, %.1f ms max",
+    limitsLatency.getMean()*1e3, limitsLatency.maximum*1e3);
+  status.addf("Tick to actuation", "%.1f ms mean, %.1f ms max",
+    actuationDelay.getMean()*1e3, actuationDelay.maximum*1e3);
+  status.addf("Stale ticks", "%lu", numStaleTicks);
+  status.addf("Limits failures", "%lu", numLimitsFailures);
+  status.addf("Actuation failures", "%lu", numActuationFailures);
+  status.addf("Actuations dropped", "%lu", numActuationsDropped);
+
+  depthAge.reset();
+  limitsAge.reset();
+  limitsLatency.reset();
+  actuationDelay.reset();
+  numStaleTicks = 0;
+}
+
 void updateDiagnostics(const ros::TimerEvent& event) {
   updater->update();
 }
 
+/** Read a new depth frame from shared memory, or call the depth sensor's
+  * service while the segment is closed
+  *
+  * An open segment without a new frame yields no measurement rather than a
+  * blocking service call.
+  */
+bool readDepth(GetDepth& getDepth) {
+  if (depthSegment.isOpen()) {
+    if (depthSegment.getSequence() == depthSequence)
+      return false;
+
+    naro_shm::Depth frame;
+    uint32_t sequence = depthSegment.read(frame);
+    if (!sequence)
+      return false;
+    depthSequence = sequence;
+
+    getDepth.response.raw = frame.raw;
+    getDepth.response.filtered = frame.filtered;
+    getDepth.response.velocity = frame.velocity;
+    getDepth.response.stamp.fromNSec(frame.stamp);
+
+    return true;
+  }
+
+  return getDepthClient.call(getDepth);
+}
+
+/** Predict the state up to the current time and fuse any new depth
+  * measurement
+  */
+void updateEstimator(const ros::TimerEvent& event) {
+  GetDepth getDepth;
+  bool measured = readDepth(getDepth);
+
+  /** The service repeats the last reading when polled faster than the
+    * depth sensor converts, a reading is new only if its stamp is, however
+    * close its value to the previous one
+    */
+  if (measured && (getDepth.response.stamp.isZero() ||
+      (getDepth.response.stamp == estimatorLastStamp)))
+    measured = false;
+  if (measured)
+    estimatorLastStamp = getDepth.response.stamp;
+
+  float measurement = (estimatorMeasurement == "filtered") ?
+    getDepth.response.filtered : getDepth.response.raw;
+  if (measurement != measurement)
+    measured = false;
+
+  boost::mutex::scoped_lock lock(estimatorMutex);
+  ros::Time now = ros::Time::now();
+
+  if (!estimator.initialized) {
+    if (measured) {
+      estimator.initialize(measurement);
+      estimatorTime = now;
+      estimatorMeasurementTime = now;
+    }
+
+    return;
+  }
+
+  float dt = (now-estimatorTime).toSec();
+  estimatorTime = now;
+  if (dt > 0.0f)
+    estimator.predict(dt);
+
+  if (measured) {
+    estimator.correct(measurement);
+    estimatorMeasurementTime = now;
+  }
+  else if ((now-estimatorMeasurementTime).toSec() > estimatorTimeout) {
+    /** Without any new reading within the timeout, the depth sensor is
+      * unreachable or has stopped converting
+      */
+    estimator.reset();
+  }
+}
+
+/** Update the actual depth [m], velocity [m/s], and acceleration [m/s^2]
+  * of the controller, either from the estimator or by differentiating the
+  * filtered depth
+  */
+bool updateActual(float& dt, double& age) {
+  ros::Time now = ros::Time::now();
+
+  if (estimatorEnabled) {
+    boost::mutex::scoped_lock lock(estimatorMutex);
+    if (!estimator.initialized)
+      return false;
+
+    controller.actual.depth = estimator.depth;
+    controller.actual.velocity = estimator.velocity;
+    controller.actual.acceleration = estimator.model.velocityToAcceleration(
+      estimator.velocity)+estimator.bias;
+    age = (now-estimatorMeasurementTime).toSec();
+  }
+  else {
+    GetDepth getDepth;
+    if (!readDepth(getDepth))
+      return false;
+    age = (now-getDepth.response.stamp).toSec();
+
+    if (getDepth.response.filtered != getDepth.response.filtered)
+      return false;
+
+    if (!lastTime.isZero())
+      controller.actual.velocity = (getDepth.response.filtered-
+        controller.actual.depth)/(now-lastTime).toSec();
+    controller.actual.depth = getDepth.response.filtered;
+  }
+
+  if (lastTime.isZero()) {
+    lastTime = now;
+    return false;
+  }
+
+  dt = (now-lastTime).toSec();
+  lastTime = now;
+
+  return true;
+}
+
+/** Poll the limit switches back to back or at the limits frequency, such
+  * that control ticks never wait for the USB transfer in the motor
+  * controller
+  */
+void pollLimits() {
+  ros::WallDuration retry(connectionRetry);
+  ros::WallDuration period(limitsFrequency > 0.0 ?
+    1.0/limitsFrequency : 0.0);
+  ros::WallTime nextTime = ros::WallTime::now();
+  ros::ServiceClient client;
+
+  while (running && ros::ok()) {
+    if (!client)
+      client = nodeHandle->serviceClient<GetLimits>(
+        "/"+smcServerName+"/get_limits", true);
+
+    GetLimits getLimits;
+    ros::WallTime startTime = ros::WallTime::now();
+
+    if (!client.call(getLimits)) {
+      ++numLimitsFailures;
+      retry.sleep();
+
+      nextTime = ros::WallTime::now();
+      continue;
+    }
+
+    ros::WallTime endTime = ros::WallTime::now();
+    double latency = (endTime-startTime).toSec();
+    {
+      boost::mutex::scoped_lock lock(limitsMutex);
+
+      limits.limits = getLimits.response.limits;
+      limits.stamp = startTime+ros::WallDuration(0.5*latency);
+      limits.latency = latency;
+      ++limits.sequence;
+    }
+    {
+      boost::mutex::scoped_lock lock(delayMutex);
+      limitsLatency.add(latency);
+    }
+
+    if (limitsFrequency > 0.0) {
+      nextTime = nextTime+period;
+      ros::WallTime now = ros::WallTime::now();
+      if (nextTime > now)
+        (nextTime-now).sleep();
+      else
+        nextTime = now;
+    }
+  }
+}
+
+/** Send the latest speed command of the controller to the motor controller
+  */
+void actuate() {
+  ros::WallDuration retry(connectionRetry);
+  ros::ServiceClient client;
+
+  while (running && ros::ok()) {
+    {
+      boost::mutex::scoped_lock lock(actuationMutex);
+      if (!actuation.pending) {
+        actuationCondition.timed_wait(lock,
+          boost::posix_time::milliseconds(100));
+        continue;
+      }
+    }
+
+    boost::mutex::scoped_lock actuatorLock(actuatorMutex);
+    Actuation request;
+    {
+      boost::mutex::scoped_lock lock(actuationMutex);
+      if (!actuation.pending || !controller.enabled)
+        continue;
+
+      request = actuation;
+      actuation.pending = false;
+    }
+
+    if (!client)
+      client = nodeHandle->serviceClient<SetSpeed>(
+        "/"+smcServerName+"/set_speed", true);
+
+    SetSpeed setSpeed;
+    setSpeed.request.speed = request.speed;
+    setSpeed.request.start = true;
+
+    if (client.call(setSpeed)) {
+      {
+        boost::mutex::scoped_lock lock(estimatorMutex);
+        estimator.flow = request.flow;
+      }
+
+      boost::mutex::scoped_lock lock(delayMutex);
+      actuationDelay.add((ros::WallTime::now()-request.stamp).toSec());
+    }
+    else {
+      ++numActuationFailures;
+      actuatorLock.unlock();
+      retry.sleep();
+    }
+  }
+}
+
+/** Plan a trajectory from the actual depth to the commanded depth, using
+  * the commanded velocity as velocity limit
+  */
+void replan() {
+  ros::WallTime startTime = ros::WallTime::now();
+  
+  planner.plan(controller.actual.depth, controller.command.depth,
+    fabsf(controller.command.velocity), plannerMaxAcceleration);
+
+  controller.planned = true;
+  controller.plan = controller.command;
+  controller.planTime = ros::Time::now();
+  
+  ++numPlans;
+  planningTime = (ros::WallTime::now()-startTime).toSec();
+}
+
+/** Replan whenever the command changes
+  */
+void updatePlan() {
+  if (!controller.planned ||
+      (controller.plan.depth != controller.command.depth) ||
+      (controller.plan.velocity != controller.command.velocity))
+    replan();
+}
+
+/** Queue a speed command of the controller for the actuation thread
+  */
+void requestActuation(float output, const ros::WallTime& stamp) {
+  {
+    boost::mutex::scoped_lock lock(actuationMutex);
+    if (actuation.pending)
+      ++numActuationsDropped;
+
+    actuation.pending = true;
+    actuation.speed = outputToSpeed(output);
+    actuation.flow = clamp(output, -model.actuatorMaxFlowRate,
+      model.actuatorMaxFlowRate);
+    actuation.stamp = stamp;
+  }
+  actuationCondition.notify_one();
+}
+
+/** Predict the ballast flow [m^3/s] over the horizon, constrained by the
+  * actuator and the given limit switches, tracking the planned trajectory
+  * or else approaching the commanded depth at the commanded velocity
+  */
+float predictControl(int limits) {
+  float minFlow = -model.actuatorMaxFlowRate;
+  float maxFlow = model.actuatorMaxFlowRate;
+  if (limits & actuatorLimitsMinInputChannel)
+    minFlow = 0.0f;
+  if (limits & actuatorLimitsMaxInputChannel)
+    maxFlow = 0.0f;
+
+  float bias, flow;
+  {
+    boost::mutex::scoped_lock lock(estimatorMutex);
+    bias = estimator.bias;
+    flow = estimator.flow;
+  }
+
+  std::vector<float> depthReferences(mpc.horizon);
+  std::vector<float> velocityReferences(mpc.horizon);
+  if (plannerEnabled) {
+    boost::mutex::scoped_lock lock(plannerMutex);
+    updatePlan();
+
+    float time = (ros::Time::now()-controller.planTime).toSec();
+    for (size_t i = 0; i < mpc.horizon; ++i) {
+      float acceleration, jerk;
+      planner.getTrajectory().evaluate(time+(i+1)*mpc.step,
+        depthReferences[i], velocityReferences[i], acceleration, jerk);
+    }
+  }
+  else {
+    float distance = controller.command.depth-controller.actual.depth;
+    float velocity = (distance > 0.0f) ?
+      fabsf(controller.command.velocity) :
+      -fabsf(controller.command.velocity);
+
+    for (size_t i = 0; i < mpc.horizon; ++i) {
+      float time = (i+1)*mpc.step;
+      if (fabsf(distance) > fabsf(velocity)*time) {
+        depthReferences[i] = controller.actual.depth+velocity*time;
+        velocityReferences[i] = velocity;
+      }
+      else {
+        depthReferences[i] = controller.command.depth;
+        velocityReferences[i] = 0.0f;
+      }
+    }
+  }
+
+  ros::WallTime startTime = ros::WallTime::now();
+  float output = mpc.control(controller.actual.depth,
+    controller.actual.velocity, bias, flow, depthReferences,
+    velocityReferences, minFlow, maxFlow);
+  double solveTime = (ros::WallTime::now()-startTime).toSec();
+
+  boost::mutex::scoped_lock lock(mpcMutex);
+  solveTimes.add(solveTime);
+  numIterations += mpc.getIterations();
+  maxIterations = std::max(maxIterations, mpc.getIterations());
+  if (!mpc.isConverged())
+    ++numUnconverged;
+
+  return output;
+}
+
 void updateControl(const ros::TimerEvent& event) {
   if (!controller.enabled)
     return;
   
-  GetDepth getDepth;
-  GetLimits getLimits;
+  ros::WallTime tickTime = ros::WallTime::now();
+  Limits snapshot;
+  float dt;
+  double age;
 
-  if (!getDepthClient.call(getDepth) ||
-      (getDepth.response.filtered != getDepth.response.filtered))
+  if (!updateActual(dt, age))
     return;
 
-  if (lastTime.isZero()) {
-    controller.actual.depth = getDepth.response.filtered;
-    lastTime = ros::Time::now();
-    
-    return;
+  {
+    boost::mutex::scoped_lock lock(limitsMutex);
+    snapshot = limits;
   }
-  
-  float dt = (ros::Time::now()-lastTime).toSec();
-  lastTime = ros::Time::now();
 
-  controller.actual.velocity = (getDepth.response.filtered-
-    controller.actual.depth)/dt;
-  controller.actual.depth = getDepth.response.filtered;
+  /** Hold the actuator on limit switches older than the timeout, as for
+    * a failed limits request
+    */
+  double staleness = (tickTime-snapshot.stamp).toSec();
+  if (!snapshot.sequence || (staleness > limitsTimeout)) {
+    boost::mutex::scoped_lock lock(delayMutex);
+    ++numStaleTicks;
 
-  if (!getLimitsClient.call(getLimits))
     return;
+  }
+  {
+    boost::mutex::scoped_lock lock(delayMutex);
+    depthAge.add(age);
+    limitsAge.add(staleness);
+  }
+  
+  /** The predictive controller respects the actuator and limit switch
+    * constraints itself
+    */
+  if (mpcEnabled) {
+    requestActuation(predictControl(snapshot.limits), tickTime);
+    diagnoseFrequency->tick();
+    
+    return;
+  }
   
-  /** On-off depth control with tolerances
-    */ 
   float commandVelocity = 0.0f;
-  if (controller.actual.depth > controller.command.depth+
-      controllerToleranceDepth)
-    commandVelocity = -controller.command.velocity;
-  else if (controller.actual.depth < controller.command.depth-
-      controllerToleranceDepth)
-    commandVelocity = controller.command.velocity;
+  float commandAcceleration = 0.0f;
+  float feedforward = 0.0f;
+  
+  if (plannerEnabled) {
+    /** Track a jerk-limited depth trajectory with ballast feedforward
+      */
+    boost::mutex::scoped_lock lock(plannerMutex);
+    updatePlan();
+
+    float time = (ros::Time::now()-controller.planTime).toSec();
+    float depth, velocity, acceleration, jerk;
+    planner.getTrajectory().evaluate(time, depth, velocity, acceleration,
+      jerk);
+    
+    commandVelocity = velocity+plannerGainDepth*
+      (depth-controller.actual.depth);
+    commandAcceleration = acceleration+plannerGainDepth*
+      (velocity-controller.actual.velocity);
+    feedforward = planner.getFlow(time);
+  }
+  else {
+    /** On-off depth control with tolerances
+      */ 
+    if (controller.actual.depth > controller.command.depth+
+        controllerToleranceDepth)
+      commandVelocity = -controller.command.velocity;
+    else if (controller.actual.depth < controller.command.depth-
+        controllerToleranceDepth)
+      commandVelocity = controller.command.velocity;
+  }
   
   float error = commandVelocity-controller.actual.velocity;
   controller.integralError += error*dt;
+  
+  /** Bound the integral term to the flow the actuator can deliver
+    */
+  if (controllerGainIntegral > 0.0f) {
+    float maxIntegralError = model.actuatorMaxFlowRate/
+      controllerGainIntegral;
+    controller.integralError = clamp(controller.integralError,
+      -maxIntegralError, maxIntegralError);
+  }
+  
+  /** The estimated acceleration avoids differentiating the noise of the
+    * velocity estimate
+    */
   float derivativeError = 0.0f;
-  if (!(controller.lastError != controller.lastError))
+  if (estimatorEnabled)
+    derivativeError = commandAcceleration-controller.actual.acceleration;
+  else if (!(controller.lastError != controller.lastError))
     derivativeError = (error-controller.lastError)/dt;
   controller.lastError = error;
   
   /** PID velocity control with tolerances
     */ 
-  float output =
+  float output = feedforward+
     controllerGainProportional*error+
     controllerGainIntegral*controller.integralError+
     controllerGainDifferential*derivativeError;
@@ -367,8 +1177,8 @@ void updateControl(const ros::TimerEvent& event) {
   /** Check limits to saturate control output
     */ 
   bool saturate = true;
-  bool minLimit = (getLimits.response.limits & actuatorLimitsMinInputChannel);
-  bool maxLimit = (getLimits.response.limits & actuatorLimitsMaxInputChannel);
+  bool minLimit = (snapshot.limits & actuatorLimitsMinInputChannel);
+  bool maxLimit = (snapshot.limits & actuatorLimitsMaxInputChannel);
   
   if (fabsf(error) > controllerToleranceVelocity) {
     if (minLimit) {
@@ -385,34 +1195,47 @@ void updateControl(const ros::TimerEvent& event) {
   }
   
   if (!saturate) {
-    SetSpeed setSpeed;
-    setSpeed.request.speed = outputToSpeed(output);
-    setSpeed.request.start = true;
-
-    if (setSpeedClient.call(setSpeed))
-      diagnoseFrequency->tick();
+    requestActuation(output, tickTime);
+    diagnoseFrequency->tick();
   }
-  else
+  else {
+    cancelActuation();
+
+    /** A saturated actuator keeps its last speed until it hits the limit
+      * in the direction of flow
+      */
+    boost::mutex::scoped_lock lock(estimatorMutex);
+    if ((minLimit && (estimator.flow < 0.0f)) ||
+        (maxLimit && (estimator.flow > 0.0f)))
+      estimator.flow = 0.0f;
+    
     diagnoseFrequency->tick();
+  }
 }
 
 void tryConnect(const ros::TimerEvent& event = ros::TimerEvent()) {
   if (!getLimitsClient)
-    getLimitsClient = ros::NodeHandle("~").serviceClient<GetLimits>(
+    getLimitsClient = nodeHandle->serviceClient<GetLimits>(
       "/"+smcServerName+"/get_limits", true);
   if (!setSpeedClient)
-    setSpeedClient = ros::NodeHandle("~").serviceClient<SetSpeed>(
+    setSpeedClient = nodeHandle->serviceClient<SetSpeed>(
       "/"+smcServerName+"/set_speed", true);
   if (!getDepthClient)
-    getDepthClient = ros::NodeHandle("~").serviceClient<GetDepth>(
+    getDepthClient = nodeHandle->serviceClient<GetDepth>(
       "/"+sensorServerName+"/get_depth", true);
-}
 
-int main(int argc, char **argv) {
-  ros::init(argc, argv, "dive_controller");
-  ros::NodeHandle node("~");
+  if (sharedMemoryEnabled)
+    depthSegment.reconnect(naro_shm::getSegmentName("/"+sensorServerName,
+      "depth"));
+}
 
-  updater.reset(new diagnostic_updater::Updater());
+/** Advertise the services and start the timers of the dive controller under
+  * the given private node handle
+  */
+void startNode(ros::NodeHandle& node) {
+  nodeHandle.reset(new ros::NodeHandle(node));
+  updater.reset(new diagnostic_updater::Updater(ros::NodeHandle(), node,
+    node.getNamespace()));
   updater->setHardwareID("none");
 
   updater->add("Connections", diagnoseConnections);
@@ -421,6 +1244,10 @@ int main(int argc, char **argv) {
     &controllerFrequency)));
   updater->add("Frequency", &*diagnoseFrequency,
     &diagnostic_updater::FrequencyStatus::run);
+  updater->add("Estimator", diagnoseEstimator);
+  updater->add("Planner", diagnosePlanner);
+  updater->add("MPC", diagnoseMpc);
+  updater->add("Pipeline", diagnosePipeline);
   updater->force_update();
 
   getParameters(node);
@@ -436,16 +1263,67 @@ int main(int argc, char **argv) {
   disableService = node.advertiseService("disable", disable);
   emergeService = node.advertiseService("emerge", emerge);
 
-  ros::Timer diagnosticsTimer = node.createTimer(
+  diagnosticsTimer = node.createTimer(
     ros::Duration(1.0), updateDiagnostics);
-  ros::Timer connectionTimer = node.createTimer(
+  connectionTimer = node.createTimer(
     ros::Duration(connectionRetry), tryConnect);
-  ros::Timer controllerTimer = node.createTimer(
+  controllerTimer = node.createTimer(
     ros::Duration(1.0/controllerFrequency), updateControl);
+  if (estimatorEnabled)
+    estimatorTimer = node.createTimer(
+      ros::Duration(1.0/estimatorFrequency), updateEstimator);
 
   tryConnect();
 
+  running = true;
+  limitsThread = boost::thread(pollLimits);
+  actuationThread = boost::thread(actuate);
+}
+
+void stopNode() {
+  diagnosticsTimer.stop();
+  connectionTimer.stop();
+  controllerTimer.stop();
+  estimatorTimer.stop();
+
+  running = false;
+  actuationCondition.notify_all();
+  if (limitsThread.joinable())
+    limitsThread.join();
+  if (actuationThread.joinable())
+    actuationThread.join();
+}
+
+};
+
+#ifdef NARO_NODELET
+namespace naro_dive_ctrl {
+  /** Nodelet running the dive controller in the process of a nodelet manager
+    */
+  class DiveControllerNodelet :
+    public nodelet::Nodelet {
+  public:
+    ~DiveControllerNodelet() {
+      stopNode();
+    };
+
+    virtual void onInit() {
+      startNode(getPrivateNodeHandle());
+    };
+  };
+};
+
+PLUGINLIB_DECLARE_CLASS(naro_dive_ctrl, dive_controller,
+  naro_dive_ctrl::DiveControllerNodelet, nodelet::Nodelet)
+#else
+int main(int argc, char **argv) {
+  ros::init(argc, argv, "dive_controller");
+  ros::NodeHandle node("~");
+
+  startNode(node);
   ros::spin();
+  stopNode();
 
   return 0;
 }
+#endif
@@ -0,0 +1,354 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Ralf Kaestner                                   *
+ *   ralf.kaestner@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#include <vector>
+#include <algorithm>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "naro_dive_ctrl/platform_model.h"
+#include "naro_dive_ctrl/estimator.h"
+#include "naro_dive_ctrl/trajectory.h"
+#include "naro_dive_ctrl/predictive_controller.h"
+
+using namespace naro_dive_ctrl;
+
+/** Replay benchmark of the dive controller's depth modes
+  *
+  * Replays a mission of depth commands against a simulated platform whose
+  * mass and drag deviate from the controller's model, with on-off velocity
+  * setpoints, tracking planned trajectories and predicting the planned
+  * trajectories, using the same estimator, gains and weights as the node's
+  * defaults. Reports the
+  * depth error, also after the platform had time to settle, the volume
+  * pumped through the ballast, the hydrostatic work of the pump and the
+  * number of flow reversals, both across half of the maximum flow and
+  * across the small flows dithering around a depth, and the distribution
+  * of the predictive controller's solve times. A mission file may be given with one command
+  * per line, consisting of the time [s], depth [m] and velocity [m/s].
+  */
+
+class Command {
+public:
+  Command(double time = 0.0, float depth = 0.0f, float velocity = 0.0f) :
+    time(time),
+    depth(depth),
+    velocity(velocity) {
+  };
+
+  double time;
+  float depth;
+  float velocity;
+};
+
+class Result {
+public:
+  Result() :
+    error(0.0),
+    settledError(0.0),
+    volume(0.0),
+    work(0.0),
+    numReversals(0),
+    numDitherReversals(0),
+    numIterations(0),
+    maxIterations(0) {
+  };
+
+  double error;
+  double settledError;
+  double volume;
+  double work;
+  int numReversals;
+  int numDitherReversals;
+  std::vector<double> solveTimes;
+  long numIterations;
+  int maxIterations;
+};
+
+enum Mode {
+  onOff,
+  planned,
+  predictive
+};
+
+const char* modeNames[] = {"on-off", "planner", "mpc"};
+
+const double simulationPeriod = 1e-3;
+const double controllerPeriod = 0.05;
+const double estimatorPeriod = 0.02;
+const double measurementPeriod = 0.04;
+const double settlingTime = 100.0;
+const double missionEnd = 150.0;
+const float startDepth = 0.5f;
+
+const float controllerToleranceDepth = 0.1f;
+const float controllerGainProportional = 1.2e-4f;
+const float controllerGainIntegral = 8e-6f;
+const float controllerGainDifferential = 6e-4f;
+const float plannerMaxAcceleration = 0.05f;
+const float plannerFlowFraction = 0.5f;
+const float plannerGainDepth = 0.1f;
+const size_t predictionHorizon = 20;
+const float predictionStep = 0.5f;
+
+/** Flow reversals are counted between opposite thresholds relative to
+  * the maximum flow, such that noise around zero flow does not count
+  */
+const float reversalThreshold = 0.5f;
+const float ditherThreshold = 0.05f;
+
+double getTime() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+
+  return time.tv_sec+time.tv_nsec*1e-9;
+}
+
+/** Standard normal deviate by the Box-Muller transform
+  */
+double getNoise() {
+  double u = (rand()+1.0)/(RAND_MAX+2.0);
+  double v = (rand()+1.0)/(RAND_MAX+2.0);
+
+  return sqrt(-2.0*log(u))*cos(2.0*M_PI*v);
+}
+
+/** Count a reversal of the flow beyond the threshold [m^3/s] against the
+  * last direction beyond it
+  */
+int countReversal(float flow, float threshold, int& direction) {
+  int flowDirection = (flow > threshold) ? 1 :
+    ((flow < -threshold) ? -1 : 0);
+  int reversal = (flowDirection && direction &&
+    (flowDirection != direction)) ? 1 : 0;
+
+  if (flowDirection)
+    direction = flowDirection;
+
+  return reversal;
+}
+
+Result replay(const std::vector<Command>& mission, Mode mode) {
+  PlatformModel model, plant;
+  plant.platformMass = 1.03f*model.platformMass;
+  plant.platformDragCoefficient = 1.2f*model.platformDragCoefficient;
+
+  Estimator estimator;
+  estimator.model = model;
+  TrajectoryPlanner planner(plannerFlowFraction);
+  planner.model = model;
+  PredictiveController predictor(predictionHorizon, predictionStep);
+  predictor.model = model;
+  std::vector<float> depthReferences(predictionHorizon);
+  std::vector<float> velocityReferences(predictionHorizon);
+
+  /** The platform starts at rest, trimmed to neutral buoyancy
+    */
+  double depth = startDepth, velocity = 0.0;
+  double volume = plant.platformMass/plant.fluidDensity;
+  float flow = 0.0f, integralError = 0.0f;
+  double planTime = 0.0;
+  int direction = 0, ditherDirection = 0;
+  size_t numSamples = 0, numSettledSamples = 0;
+  Result result;
+
+  srand(0);
+  estimator.initialize(depth+estimator.noiseMeasurement*getNoise());
+
+  size_t command = 0, plan = mission.size();
+  double duration = mission.back().time+missionEnd;
+  long controllerSteps = lround(controllerPeriod/simulationPeriod);
+  long estimatorSteps = lround(estimatorPeriod/simulationPeriod);
+  long measurementSteps = lround(measurementPeriod/simulationPeriod);
+
+  for (long k = 0; k*simulationPeriod < duration; ++k) {
+    double time = k*simulationPeriod;
+    while ((command+1 < mission.size()) &&
+        (mission[command+1].time <= time))
+      ++command;
+
+    if (!(k % controllerSteps)) {
+      float commandVelocity = 0.0f;
+      float commandAcceleration = 0.0f;
+      float feedforward = 0.0f;
+
+      if (mode != onOff) {
+        if (plan != command) {
+          planner.plan(estimator.depth, mission[command].depth,
+            mission[command].velocity, plannerMaxAcceleration);
+          plan = command;
+          planTime = time;
+        }
+
+        float planDepth, planVelocity, planAcceleration, planJerk;
+        planner.getTrajectory().evaluate(time-planTime, planDepth,
+          planVelocity, planAcceleration, planJerk);
+
+        commandVelocity = planVelocity+plannerGainDepth*
+          (planDepth-estimator.depth);
+        commandAcceleration = planAcceleration+plannerGainDepth*
+          (planVelocity-estimator.velocity);
+        feedforward = planner.getFlow(time-planTime);
+      }
+      else {
+        if (estimator.depth > mission[command].depth+
+            controllerToleranceDepth)
+          commandVelocity = -mission[command].velocity;
+        else if (estimator.depth < mission[command].depth-
+            controllerToleranceDepth)
+          commandVelocity = mission[command].velocity;
+      }
+
+      float error = commandVelocity-estimator.velocity;
+      float maxIntegralError = model.actuatorMaxFlowRate/
+        controllerGainIntegral;
+      integralError = std::max(-maxIntegralError, std::min(
+        maxIntegralError, integralError+error*(float)controllerPeriod));
+      float derivativeError = commandAcceleration-
+        (model.velocityToAcceleration(estimator.velocity)+estimator.bias);
+
+      float output = feedforward+
+        controllerGainProportional*error+
+        controllerGainIntegral*integralError+
+        controllerGainDifferential*derivativeError;
+
+      if (mode == predictive) {
+        for (size_t i = 0; i < predictionHorizon; ++i) {
+          float planDepth, planVelocity, planAcceleration, planJerk;
+          planner.getTrajectory().evaluate(time-planTime+(i+1)*
+            predictionStep, planDepth, planVelocity, planAcceleration,
+            planJerk);
+
+          depthReferences[i] = planDepth;
+          velocityReferences[i] = planVelocity;
+        }
+
+        double startTime = getTime();
+        output = predictor.control(estimator.depth, estimator.velocity,
+          estimator.bias, flow, depthReferences, velocityReferences,
+          -model.actuatorMaxFlowRate, model.actuatorMaxFlowRate);
+        result.solveTimes.push_back(getTime()-startTime);
+
+        result.numIterations += predictor.getIterations();
+        result.maxIterations = std::max(result.maxIterations,
+          predictor.getIterations());
+      }
+      flow = std::max(-model.actuatorMaxFlowRate, std::min(
+        model.actuatorMaxFlowRate, output));
+
+      result.numReversals += countReversal(flow,
+        reversalThreshold*model.actuatorMaxFlowRate, direction);
+      result.numDitherReversals += countReversal(flow,
+        ditherThreshold*model.actuatorMaxFlowRate, ditherDirection);
+    }
+
+    if (!(k % measurementSteps))
+      estimator.correct(depth+estimator.noiseMeasurement*getNoise());
+    if (!(k % estimatorSteps)) {
+      estimator.flow = flow;
+      estimator.predict(estimatorPeriod);
+    }
+
+    /** The plant integrates the same model in double precision with its
+      * own parameters and the ballast volume
+      */
+    double force = plant.platformMass*plant.gravitationalAcceleration-
+      volume*plant.fluidDensity*plant.gravitationalAcceleration-
+      ((velocity > 0.0) ? 1.0 : -1.0)*0.5*velocity*velocity*
+      plant.fluidDensity*plant.platformArea*
+      plant.platformDragCoefficient;
+    velocity += force/plant.platformMass*simulationPeriod;
+    depth += velocity*simulationPeriod;
+    volume -= flow*simulationPeriod;
+
+    result.volume += fabs(flow)*simulationPeriod;
+    result.work += fabs(flow)*simulationPeriod*plant.fluidDensity*
+      plant.gravitationalAcceleration*std::max(depth, 0.0);
+
+    double error = depth-mission[command].depth;
+    result.error += error*error;
+    ++numSamples;
+    if (time-mission[command].time > settlingTime) {
+      result.settledError += error*error;
+      ++numSettledSamples;
+    }
+  }
+
+  result.error = sqrt(result.error/numSamples);
+  result.settledError = numSettledSamples ?
+    sqrt(result.settledError/numSettledSamples) : 0.0;
+
+  return result;
+}
+
+int main(int argc, char** argv) {
+  std::vector<Command> mission;
+
+  if (argc > 1) {
+    FILE* file = fopen(argv[1], "r");
+    if (!file) {
+      fprintf(stderr, "Failed to open mission file %s\n", argv[1]);
+      return 1;
+    }
+
+    double time;
+    float depth, velocity;
+    while (fscanf(file, "%lf %f %f", &time, &depth, &velocity) == 3)
+      mission.push_back(Command(time, depth, velocity));
+    fclose(file);
+
+    if (mission.empty()) {
+      fprintf(stderr, "Mission file %s contains no commands\n", argv[1]);
+      return 1;
+    }
+  }
+  else {
+    mission.push_back(Command(0.0, 3.0f, 0.1f));
+    mission.push_back(Command(150.0, 1.5f, 0.1f));
+    mission.push_back(Command(300.0, 4.0f, 0.1f));
+  }
+
+  printf("%-10s %10s %12s %12s %10s %10s %10s\n", "Mode", "Error [m]",
+    "Settled [m]", "Pumped [l]", "Work [J]", "Reversals", "Dither");
+
+  Result result;
+  for (int i = onOff; i <= predictive; ++i) {
+    result = replay(mission, (Mode)i);
+    printf("%-10s %10.3f %12.3f %12.2f %10.1f %10d %10d\n",
+      modeNames[i], result.error, result.settledError,
+      result.volume*1e3, result.work, result.numReversals,
+      result.numDitherReversals);
+  }
+
+  std::vector<double>& times = result.solveTimes;
+  std::sort(times.begin(), times.end());
+  printf("\nMPC solve time: %.1f us median, %.1f us 99th percentile, "
+    "%.1f us max over %lu solves\n", times[times.size()/2]*1e6,
+    times[times.size()*99/100]*1e6, times.back()*1e6,
+    (unsigned long)times.size());
+  printf("MPC iterations: %.2f mean, %d max\n",
+    (double)result.numIterations/times.size(), result.maxIterations);
+
+  return 0;
+}
@@ -0,0 +1,158 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Ralf Kaestner                                   *
+ *   ralf.kaestner@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#ifndef NARO_DIVE_CTRL_ESTIMATOR_H
+#define NARO_DIVE_CTRL_ESTIMATOR_H
+
+#include <limits>
+
+#include <math.h>
+
+#include "naro_dive_ctrl/platform_model.h"
+
+namespace naro_dive_ctrl {
+  /** Extended Kalman filter estimating the platform depth [m], velocity
+    * [m/s] and the buoyancy acceleration [m/s^2] not explained by the
+    * platform model from depth measurements and the ballast flow [m^3/s]
+    * applied by the actuator
+    */
+  class Estimator {
+  public:
+    Estimator() :
+      noiseAcceleration(0.02f),
+      noiseBias(0.003f),
+      noiseMeasurement(0.05f) {
+      reset();
+    };
+
+    void reset() {
+      initialized = false;
+      depth = 0.0f;
+      velocity = 0.0f;
+      bias = 0.0f;
+      flow = 0.0f;
+      innovation = std::numeric_limits<float>::quiet_NaN();
+      innovationVariance = std::numeric_limits<float>::quiet_NaN();
+
+      for (int i = 0; i < 3; ++i)
+        for (int j = 0; j < 3; ++j)
+          covariance[i][j] = 0.0f;
+    };
+
+    /** Start from the given depth at rest, assuming the platform to be
+      * trimmed to neutral buoyancy with an uncertainty of the full model
+      * buoyancy
+      */
+    void initialize(float depth) {
+      reset();
+
+      this->depth = depth;
+      bias = -model.velocityToAcceleration(0.0f);
+
+      covariance[0][0] = noiseMeasurement*noiseMeasurement;
+      covariance[1][1] = 0.1f*0.1f;
+      covariance[2][2] = bias*bias;
+      initialized = true;
+    };
+
+    /** Propagate the state by dt [s] through the drag and buoyancy model,
+      * integrating the applied ballast flow into the buoyancy acceleration
+      */
+    void predict(float dt) {
+      float acceleration = model.velocityToAcceleration(velocity)+bias;
+      float drag = model.getDragDerivative(velocity);
+
+      depth += velocity*dt+0.5f*acceleration*dt*dt;
+      velocity += acceleration*dt;
+      bias += model.getFlowGain()*flow*dt;
+
+      float transition[3][3] = {
+        {1.0f, dt, 0.5f*dt*dt},
+        {0.0f, 1.0f+drag*dt, dt},
+        {0.0f, 0.0f, 1.0f}};
+      float product[3][3];
+
+      for (int i = 0; i < 3; ++i)
+        for (int j = 0; j < 3; ++j) {
+          product[i][j] = 0.0f;
+          for (int k = 0; k < 3; ++k)
+            product[i][j] += transition[i][k]*covariance[k][j];
+        }
+      for (int i = 0; i < 3; ++i)
+        for (int j = 0; j < 3; ++j) {
+          covariance[i][j] = 0.0f;
+          for (int k = 0; k < 3; ++k)
+            covariance[i][j] += product[i][k]*transition[j][k];
+        }
+
+      /** White noise acceleration on the velocity and a random walk of the
+        * buoyancy acceleration
+        */
+      float accelerationVariance = noiseAcceleration*noiseAcceleration;
+      covariance[0][0] += accelerationVariance*dt*dt*dt/3.0f;
+      covariance[0][1] += accelerationVariance*dt*dt/2.0f;
+      covariance[1][0] += accelerationVariance*dt*dt/2.0f;
+      covariance[1][1] += accelerationVariance*dt;
+      covariance[2][2] += noiseBias*noiseBias*dt;
+    };
+
+    /** Fuse a depth measurement [m]
+      */
+    void correct(float measurement) {
+      innovation = measurement-depth;
+      innovationVariance = covariance[0][0]+
+        noiseMeasurement*noiseMeasurement;
+
+      float gain[3];
+      for (int i = 0; i < 3; ++i)
+        gain[i] = covariance[i][0]/innovationVariance;
+
+      depth += gain[0]*innovation;
+      velocity += gain[1]*innovation;
+      bias += gain[2]*innovation;
+
+      float row[3] = {covariance[0][0], covariance[0][1], covariance[0][2]};
+      for (int i = 0; i < 3; ++i)
+        for (int j = 0; j < 3; ++j)
+          covariance[i][j] -= gain[i]*row[j];
+      for (int i = 0; i < 3; ++i)
+        for (int j = 0; j < i; ++j)
+          covariance[i][j] = covariance[j][i] = 0.5f*(covariance[i][j]+
+            covariance[j][i]);
+    };
+
+    PlatformModel model;
+    float noiseAcceleration;            // [m/s^2]
+    float noiseBias;                    // [m/s^2]
+    float noiseMeasurement;             // [m]
+
+    bool initialized;
+    float depth;
+    float velocity;
+    float bias;
+    float flow;
+    float innovation;
+    float innovationVariance;
+    float covariance[3][3];
+  };
+};
+
+#endif
@@ -0,0 +1,94 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Ralf Kaestner                                   *
+ *   ralf.kaestner@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#ifndef NARO_DIVE_CTRL_PLATFORM_MODEL_H
+#define NARO_DIVE_CTRL_PLATFORM_MODEL_H
+
+#include <math.h>
+
+namespace naro_dive_ctrl {
+  /** Vertical motion of the platform under gravity, buoyancy and quadratic
+    * drag, with depth and velocity positive downwards
+    *
+    * The ballast actuator pumps water into the platform at a flow [m^3/s],
+    * which changes its buoyancy acceleration at the rate of the flow gain
+    * times the flow.
+    */
+  class PlatformModel {
+  public:
+    PlatformModel() :
+      gravitationalAcceleration(9.80665f),
+      fluidDensity(1000.0f),
+      platformMass(10.0f),
+      platformArea(0.1f),
+      platformVolume(0.012f),
+      platformDragCoefficient(1.0f),
+      actuatorMaxFlowRate(20e-6f) {
+    };
+
+    /** Calculate the net force [N] acting on the platform for a given
+      * platform velocity [m/s]
+      */
+    float velocityToForce(float velocity) const {
+      float gravitationalForce = platformMass*gravitationalAcceleration;
+      float buoyancyForce = platformVolume*fluidDensity*
+        gravitationalAcceleration;
+      float dragForce = 0.5f*velocity*velocity*fluidDensity*
+        platformArea*platformDragCoefficient;
+
+      if (velocity > 0.0f)
+        return gravitationalForce-buoyancyForce-dragForce;
+      else
+        return gravitationalForce-buoyancyForce+dragForce;
+    };
+
+    /** Calculate the platform acceleration [m/s^2] for a given platform
+      * velocity [m/s]
+      */
+    float velocityToAcceleration(float velocity) const {
+      return velocityToForce(velocity)/platformMass;
+    };
+
+    /** Derivative of the platform acceleration by its velocity [1/s]
+      */
+    float getDragDerivative(float velocity) const {
+      return -fluidDensity*platformArea*platformDragCoefficient*
+        fabsf(velocity)/platformMass;
+    };
+
+    /** Change of the buoyancy acceleration [m/s^3] per ballast flow
+      * [m^3/s]
+      */
+    float getFlowGain() const {
+      return fluidDensity*gravitationalAcceleration/platformMass;
+    };
+
+    float gravitationalAcceleration;    // [m/s^2]
+    float fluidDensity;                 // [kg/m^3]
+    float platformMass;                 // [kg]
+    float platformArea;                 // [m^2]
+    float platformVolume;               // [m^3]
+    float platformDragCoefficient;
+    float actuatorMaxFlowRate;          // [m^3/s]
+  };
+};
+
+#endif
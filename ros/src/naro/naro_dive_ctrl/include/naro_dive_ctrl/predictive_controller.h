@@ -0,0 +1,358 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Ralf Kaestner                                   *
+ *   ralf.kaestner@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#ifndef NARO_DIVE_CTRL_PREDICTIVE_CONTROLLER_H
+#define NARO_DIVE_CTRL_PREDICTIVE_CONTROLLER_H
+
+#include <vector>
+#include <algorithm>
+
+#include <math.h>
+
+#include "naro_dive_ctrl/platform_model.h"
+
+namespace naro_dive_ctrl {
+  /** Dense solver of the box-constrained quadratic program
+    *
+    *   minimize x'*H*x/2+g'*x subject to l <= x <= u
+    *
+    * for a positive definite H, by a primal active-set method. Each
+    * iteration solves the unconstrained problem in the free variables by
+    * a Cholesky factorization, then either steps onto the first bound in
+    * its way or releases the bound with the most negative multiplier. The
+    * solution passed in warm-starts the solver, such that a solution of a
+    * slightly changed problem usually converges within a few iterations.
+    */
+  class BoxQpSolver {
+  public:
+    BoxQpSolver(int maxIterations = 50, double tolerance = 1e-9) :
+      maxIterations(maxIterations),
+      tolerance(tolerance),
+      converged(false) {
+    };
+
+    /** Solve for the given row-major Hessian, gradient and bounds, starting
+      * from the given solution, and return the number of iterations
+      */
+    int solve(const std::vector<double>& hessian, const std::vector<double>&
+        gradient, const std::vector<double>& lower, const
+        std::vector<double>& upper, std::vector<double>& solution) {
+      size_t n = gradient.size();
+      solution.resize(n, 0.0);
+      active.resize(n);
+      converged = false;
+
+      for (size_t i = 0; i < n; ++i) {
+        solution[i] = std::max(lower[i], std::min(upper[i], solution[i]));
+        active[i] = (solution[i] <= lower[i]) ? -1 :
+          ((solution[i] >= upper[i]) ? 1 : 0);
+      }
+
+      for (int iteration = 0; iteration < maxIterations; ++iteration) {
+        free.clear();
+        for (size_t i = 0; i < n; ++i)
+          if (!active[i])
+            free.push_back(i);
+
+        size_t m = free.size();
+        factor.resize(m*m);
+        step.resize(m);
+
+        for (size_t a = 0; a < m; ++a) {
+          step[a] = -gradient[free[a]];
+          for (size_t j = 0; j < n; ++j)
+            if (active[j])
+              step[a] -= hessian[free[a]*n+j]*solution[j];
+          for (size_t b = 0; b <= a; ++b)
+            factor[a*m+b] = hessian[free[a]*n+free[b]];
+        }
+
+        if (!decompose(m))
+          return iteration;
+        substitute(m);
+
+        /** Step towards the minimizer in the free variables, stopping at
+          * the first bound in the way
+          */
+        double alpha = 1.0;
+        size_t blocking = n;
+        int side = 0;
+        for (size_t a = 0; a < m; ++a) {
+          size_t i = free[a];
+          double delta = step[a]-solution[i];
+
+          if ((delta < 0.0) && (solution[i]+delta*alpha < lower[i])) {
+            alpha = (lower[i]-solution[i])/delta;
+            blocking = i;
+            side = -1;
+          }
+          else if ((delta > 0.0) && (solution[i]+delta*alpha > upper[i])) {
+            alpha = (upper[i]-solution[i])/delta;
+            blocking = i;
+            side = 1;
+          }
+        }
+
+        for (size_t a = 0; a < m; ++a)
+          solution[free[a]] += alpha*(step[a]-solution[free[a]]);
+
+        if (blocking < n) {
+          solution[blocking] = (side < 0) ? lower[blocking] :
+            upper[blocking];
+          active[blocking] = side;
+
+          continue;
+        }
+
+        /** Release the bound whose multiplier violates optimality most
+          */
+        size_t release = n;
+        double minMultiplier = -tolerance;
+        for (size_t i = 0; i < n; ++i) {
+          if (!active[i])
+            continue;
+
+          double multiplier = gradient[i];
+          for (size_t j = 0; j < n; ++j)
+            multiplier += hessian[i*n+j]*solution[j];
+          if (active[i] > 0)
+            multiplier = -multiplier;
+
+          if (multiplier < minMultiplier) {
+            minMultiplier = multiplier;
+            release = i;
+          }
+        }
+
+        if (release == n) {
+          converged = true;
+          return iteration+1;
+        }
+        active[release] = 0;
+      }
+
+      return maxIterations;
+    };
+
+    /** Whether the last solution satisfies the optimality conditions
+      */
+    bool isConverged() const {
+      return converged;
+    };
+
+    int maxIterations;
+    double tolerance;
+
+  private:
+    /** Cholesky decomposition of the lower triangle in place
+      */
+    bool decompose(size_t m) {
+      for (size_t j = 0; j < m; ++j) {
+        double diagonal = factor[j*m+j];
+        for (size_t k = 0; k < j; ++k)
+          diagonal -= factor[j*m+k]*factor[j*m+k];
+        if (!(diagonal > 0.0))
+          return false;
+        factor[j*m+j] = sqrt(diagonal);
+
+        for (size_t i = j+1; i < m; ++i) {
+          double value = factor[i*m+j];
+          for (size_t k = 0; k < j; ++k)
+            value -= factor[i*m+k]*factor[j*m+k];
+          factor[i*m+j] = value/factor[j*m+j];
+        }
+      }
+
+      return true;
+    };
+
+    /** Solve by forward and backward substitution in place
+      */
+    void substitute(size_t m) {
+      for (size_t i = 0; i < m; ++i) {
+        for (size_t k = 0; k < i; ++k)
+          step[i] -= factor[i*m+k]*step[k];
+        step[i] /= factor[i*m+i];
+      }
+      for (size_t i = m; i-- > 0; ) {
+        for (size_t k = i+1; k < m; ++k)
+          step[i] -= factor[k*m+i]*step[k];
+        step[i] /= factor[i*m+i];
+      }
+    };
+
+    bool converged;
+    std::vector<int> active;
+    std::vector<size_t> free;
+    std::vector<double> factor;
+    std::vector<double> step;
+  };
+
+  /** Model predictive depth controller
+    *
+    * Predicts depth and velocity over a horizon of steps of constant
+    * ballast flow, linearizing the drag of the platform model around the
+    * current velocity and holding the buoyancy acceleration estimated
+    * beyond the model. The flows minimize the weighted squared deviations
+    * from the depth and velocity references at the end of each step, plus
+    * the weighted squared flows and flow changes, all relative to the
+    * maximum flow rate. The flows are bounded by the actuator for the
+    * entire horizon, which also holds a limit switch since the ballast
+    * volume is not measured. The previous solution warm-starts the solver
+    * as the horizon moves by a fraction of a step per control period.
+    */
+  class PredictiveController {
+  public:
+    static const int numSubsteps = 10;
+
+    PredictiveController(size_t horizon = 20, float step = 0.5f) :
+      horizon(horizon),
+      step(step),
+      weightDepth(1.0f),
+      weightVelocity(10.0f),
+      weightFlow(1e-2f),
+      weightFlowRate(30.0f),
+      iterations(0) {
+    };
+
+    /** Clear the warm start
+      */
+    void reset() {
+      solution.clear();
+    };
+
+    /** Compute the ballast flow [m^3/s] within the given bounds [m^3/s]
+      * from the estimated depth [m], velocity [m/s], buoyancy acceleration
+      * [m/s^2] beyond the model and last flow [m^3/s], and the depth [m]
+      * and velocity [m/s] references at the end of each step
+      */
+    float control(float depth, float velocity, float bias, float lastFlow,
+        const std::vector<float>& depthReferences, const std::vector<float>&
+        velocityReferences, float minFlow, float maxFlow) {
+      size_t n = horizon;
+      double maxFlowRate = model.actuatorMaxFlowRate;
+
+      predict(depth, velocity, bias, velocity, 0.0, freeDepths,
+        freeVelocities);
+      predict(0.0, 0.0, 0.0, velocity, 1.0, responseDepths,
+        responseVelocities);
+
+      /** The flow of step j moves the state at the end of step k >= j by
+        * the response after k-j steps
+        */
+      hessian.assign(n*n, 0.0);
+      gradient.assign(n, 0.0);
+      for (size_t k = 0; k < n; ++k) {
+        double depthError = freeDepths[k]-depthReferences[k];
+        double velocityError = freeVelocities[k]-velocityReferences[k];
+
+        for (size_t i = 0; i <= k; ++i) {
+          double depthResponse = responseDepths[k-i];
+          double velocityResponse = responseVelocities[k-i];
+
+          gradient[i] += weightDepth*depthResponse*depthError+
+            weightVelocity*velocityResponse*velocityError;
+          for (size_t j = 0; j <= i; ++j)
+            hessian[i*n+j] += weightDepth*depthResponse*
+              responseDepths[k-j]+weightVelocity*velocityResponse*
+              responseVelocities[k-j];
+        }
+      }
+
+      for (size_t i = 0; i < n; ++i) {
+        hessian[i*n+i] += weightFlow+weightFlowRate*((i+1 < n) ? 2.0 : 1.0);
+        if (i > 0)
+          hessian[i*n+i-1] -= weightFlowRate;
+      }
+      gradient[0] -= weightFlowRate*lastFlow/maxFlowRate;
+
+      for (size_t i = 0; i < n; ++i)
+        for (size_t j = 0; j < i; ++j)
+          hessian[j*n+i] = hessian[i*n+j];
+
+      lower.assign(n, std::max(minFlow/maxFlowRate, -1.0));
+      upper.assign(n, std::min(maxFlow/maxFlowRate, 1.0));
+
+      iterations = solver.solve(hessian, gradient, lower, upper, solution);
+
+      return solution[0]*maxFlowRate;
+    };
+
+    /** Iterations of the last solution
+      */
+    int getIterations() const {
+      return iterations;
+    };
+
+    bool isConverged() const {
+      return solver.isConverged();
+    };
+
+    PlatformModel model;
+    BoxQpSolver solver;
+    size_t horizon;
+    float step;                         // [s]
+    float weightDepth;                  // [1/m^2]
+    float weightVelocity;               // [s^2/m^2]
+    float weightFlow;
+    float weightFlowRate;
+
+  private:
+    /** Predict depths and velocities at the end of each step with the
+      * drag linearized around the given velocity, either of the affine
+      * model without flow or of its linear part for a unit flow fraction
+      * in the first step
+      */
+    void predict(double depth, double velocity, double bias, double
+        linearization, double flow, std::vector<double>& depths,
+        std::vector<double>& velocities) const {
+      double derivative = model.getDragDerivative(linearization);
+      double offset = (flow != 0.0) ? 0.0 :
+        model.velocityToAcceleration(linearization)-
+        derivative*linearization;
+      double flowGain = model.getFlowGain()*model.actuatorMaxFlowRate;
+      double dt = step/numSubsteps;
+
+      depths.resize(horizon);
+      velocities.resize(horizon);
+      for (size_t k = 0; k < horizon; ++k) {
+        for (int i = 0; i < numSubsteps; ++i) {
+          double acceleration = offset+derivative*velocity+bias;
+
+          depth += velocity*dt+0.5*acceleration*dt*dt;
+          velocity += acceleration*dt;
+          bias += flowGain*flow*dt;
+        }
+
+        depths[k] = depth;
+        velocities[k] = velocity;
+        flow = 0.0;
+      }
+    };
+
+    int iterations;
+    std::vector<double> freeDepths, freeVelocities;
+    std::vector<double> responseDepths, responseVelocities;
+    std::vector<double> hessian, gradient, lower, upper, solution;
+  };
+};
+
+#endif
@@ -0,0 +1,288 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Ralf Kaestner                                   *
+ *   ralf.kaestner@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#ifndef NARO_DIVE_CTRL_TRAJECTORY_H
+#define NARO_DIVE_CTRL_TRAJECTORY_H
+
+#include <algorithm>
+
+#include <math.h>
+
+#include "naro_dive_ctrl/platform_model.h"
+
+namespace naro_dive_ctrl {
+  /** Jerk-limited depth trajectory between two depths at rest
+    *
+    * The trajectory consists of seven segments of constant jerk, ramping
+    * the acceleration up and down towards the cruise velocity and again
+    * towards the goal. Segments shrink or vanish where the distance is too
+    * short to reach the velocity or acceleration limit.
+    */
+  class Trajectory {
+  public:
+    static const int numSegments = 7;
+
+    Trajectory() {
+      reset(0.0f);
+    };
+
+    /** Rest at the given depth [m]
+      */
+    void reset(float depth) {
+      start = depth;
+      goal = depth;
+
+      for (int i = 0; i < numSegments; ++i) {
+        durations[i] = 0.0f;
+        jerks[i] = 0.0f;
+      }
+    };
+
+    /** Plan from the start to the goal depth [m] within the maximum
+      * velocity [m/s], acceleration [m/s^2] and jerk [m/s^3]
+      */
+    void plan(float start, float goal, float maxVelocity, float
+        maxAcceleration, float maxJerk) {
+      reset(start);
+      this->goal = goal;
+
+      float distance = fabsf(goal-start);
+      if (!(distance > 0.0f) || !(maxVelocity > 0.0f) ||
+          !(maxAcceleration > 0.0f) || !(maxJerk > 0.0f)) {
+        this->goal = start;
+        return;
+      }
+
+      float jerkTime, accelerationTime, cruiseTime;
+      if (maxVelocity*maxJerk >= maxAcceleration*maxAcceleration) {
+        jerkTime = maxAcceleration/maxJerk;
+        accelerationTime = jerkTime+maxVelocity/maxAcceleration;
+      }
+      else {
+        jerkTime = sqrtf(maxVelocity/maxJerk);
+        accelerationTime = 2.0f*jerkTime;
+      }
+      cruiseTime = distance/maxVelocity-accelerationTime;
+
+      /** Without cruising, the platform accelerates until half way
+        */
+      if (cruiseTime < 0.0f) {
+        cruiseTime = 0.0f;
+        jerkTime = maxAcceleration/maxJerk;
+        accelerationTime = 0.5f*(jerkTime+sqrtf(jerkTime*jerkTime+
+          4.0f*distance/maxAcceleration));
+
+        if (accelerationTime < 2.0f*jerkTime) {
+          jerkTime = powf(0.5f*distance/maxJerk, 1.0f/3.0f);
+          accelerationTime = 2.0f*jerkTime;
+        }
+      }
+
+      float jerk = (goal > start) ? maxJerk : -maxJerk;
+      float durations[numSegments] = {jerkTime, accelerationTime-
+        2.0f*jerkTime, jerkTime, cruiseTime, jerkTime, accelerationTime-
+        2.0f*jerkTime, jerkTime};
+      float jerks[numSegments] = {jerk, 0.0f, -jerk, 0.0f, -jerk, 0.0f,
+        jerk};
+
+      for (int i = 0; i < numSegments; ++i) {
+        this->durations[i] = std::max(durations[i], 0.0f);
+        this->jerks[i] = jerks[i];
+      }
+    };
+
+    float getStart() const {
+      return start;
+    };
+
+    float getGoal() const {
+      return goal;
+    };
+
+    float getSegmentDuration(int segment) const {
+      return durations[segment];
+    };
+
+    float getSegmentJerk(int segment) const {
+      return jerks[segment];
+    };
+
+    float getDuration() const {
+      float duration = 0.0f;
+      for (int i = 0; i < numSegments; ++i)
+        duration += durations[i];
+
+      return duration;
+    };
+
+    /** Evaluate depth [m], velocity [m/s], acceleration [m/s^2] and jerk
+      * [m/s^3] at the given time [s] since the start
+      */
+    void evaluate(float time, float& depth, float& velocity, float&
+        acceleration, float& jerk) const {
+      depth = start;
+      velocity = 0.0f;
+      acceleration = 0.0f;
+      jerk = 0.0f;
+
+      if (time >= getDuration()) {
+        depth = goal;
+        return;
+      }
+
+      for (int i = 0; (i < numSegments) && (time > 0.0f); ++i) {
+        float dt = std::min(time, durations[i]);
+        jerk = jerks[i];
+
+        depth += velocity*dt+acceleration*dt*dt/2.0f+jerk*dt*dt*dt/6.0f;
+        velocity += acceleration*dt+jerk*dt*dt/2.0f;
+        acceleration += jerk*dt;
+        time -= durations[i];
+      }
+    };
+
+  private:
+    float start;
+    float goal;
+    float durations[numSegments];
+    float jerks[numSegments];
+  };
+
+  /** Planner of depth trajectories the ballast actuator can follow
+    *
+    * Following a trajectory requires the buoyancy acceleration b = a-A(v),
+    * where A(v) is the model acceleration of the neutrally trimmed platform
+    * at velocity v, mainly drag. The ballast changes it at the rate
+    *
+    *   db/dt = j-A'(v)*a = k*Q,
+    *
+    * where k is the flow gain of the model and Q the ballast flow. The
+    * planner starts from the jerk at the maximum flow rate and shrinks the
+    * acceleration and jerk limits by a common factor until the feedforward
+    * flow of the trajectory stays within the given fraction of the maximum
+    * flow rate, leaving the rest to the feedback. While cruising, the
+    * feedforward flow vanishes, such that the velocity limit holds.
+    */
+  class TrajectoryPlanner {
+  public:
+    static const int numSamples = 16;
+    static const int numIterations = 16;
+
+    TrajectoryPlanner(float flowFraction = 0.5f) :
+      flowFraction(flowFraction),
+      scale(1.0f) {
+    };
+
+    /** Plan from the start to the goal depth [m] within the maximum
+      * velocity [m/s] and acceleration [m/s^2]
+      */
+    const Trajectory& plan(float start, float goal, float maxVelocity,
+        float maxAcceleration) {
+      float maxFlow = flowFraction*model.actuatorMaxFlowRate;
+      float maxJerk = model.getFlowGain()*model.actuatorMaxFlowRate;
+
+      scale = 1.0f;
+      trajectory.plan(start, goal, maxVelocity, maxAcceleration, maxJerk);
+      if (getMaxFlow() <= maxFlow)
+        return trajectory;
+
+      /** The flow grows with the common factor, which bisection narrows
+        * down to the largest feasible one
+        */
+      float minScale = 0.0f, maxScale = 1.0f;
+      for (int i = 0; i < numIterations; ++i) {
+        scale = 0.5f*(minScale+maxScale);
+        trajectory.plan(start, goal, maxVelocity, scale*maxAcceleration,
+          scale*maxJerk);
+
+        if (getMaxFlow() <= maxFlow)
+          minScale = scale;
+        else
+          maxScale = scale;
+      }
+
+      scale = minScale;
+      trajectory.plan(start, goal, maxVelocity, scale*maxAcceleration,
+        scale*maxJerk);
+
+      return trajectory;
+    };
+
+    const Trajectory& getTrajectory() const {
+      return trajectory;
+    };
+
+    /** Common factor of the limits the last plan was shrunk by
+      */
+    float getScale() const {
+      return scale;
+    };
+
+    /** Feedforward ballast flow [m^3/s] at the given time [s] since the
+      * start
+      */
+    float getFlow(float time) const {
+      float depth, velocity, acceleration, jerk;
+      trajectory.evaluate(time, depth, velocity, acceleration, jerk);
+
+      return getFlow(velocity, acceleration, jerk);
+    };
+
+    /** Ballast flow [m^3/s] of the given trajectory state
+      */
+    float getFlow(float velocity, float acceleration, float jerk) const {
+      return (jerk-model.getDragDerivative(velocity)*acceleration)/
+        model.getFlowGain();
+    };
+
+    /** Maximum feedforward flow [m^3/s] of the trajectory, sampled across
+      * each segment of constant jerk including both of its ends
+      */
+    float getMaxFlow() const {
+      float velocity = 0.0f, acceleration = 0.0f, maxFlow = 0.0f;
+
+      for (int i = 0; i < Trajectory::numSegments; ++i) {
+        float duration = trajectory.getSegmentDuration(i);
+        float jerk = trajectory.getSegmentJerk(i);
+
+        for (int j = 0; (duration > 0.0f) && (j <= numSamples); ++j) {
+          float dt = duration*j/numSamples;
+          maxFlow = std::max(maxFlow, fabsf(getFlow(velocity+
+            acceleration*dt+jerk*dt*dt/2.0f, acceleration+jerk*dt, jerk)));
+        }
+
+        velocity += acceleration*duration+jerk*duration*duration/2.0f;
+        acceleration += jerk*duration;
+      }
+
+      return maxFlow;
+    };
+
+    PlatformModel model;
+    float flowFraction;
+
+  private:
+    Trajectory trajectory;
+    float scale;
+  };
+};
+
+#endif
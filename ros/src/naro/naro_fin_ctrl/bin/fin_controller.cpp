@@ -21,14 +21,41 @@
 #include <vector>
 #include <limits>
 
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <errno.h>
+#include <string.h>
+
+#include <boost/thread.hpp>
+
 #include <ros/ros.h>
 #include <diagnostic_updater/diagnostic_updater.h>
 #include <diagnostic_updater/update_functions.h>
 
+#ifdef NARO_NODELET
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#endif
+
 #include <naro_usc_srvs/GetChannels.h>
 #include <naro_usc_srvs/GetPositions.h>
 #include <naro_usc_srvs/SetProfiles.h>
+#include <naro_usc_srvs/Profiles.h>
+#include <naro_usc_srvs/ProfilesStatus.h>
+
+#include <naro_shm/segment.h>
+#include <naro_shm/frames.h>
 
+#include <naro_trace/trace.h>
+#include <naro_trace/DumpTrace.h>
+
+#include "naro_fin_ctrl/oscillator_bank.h"
+#include "naro_fin_ctrl/oscillator_network.h"
+
+#include "naro_fin_ctrl/Commands.h"
 #include "naro_fin_ctrl/GetServos.h"
 #include "naro_fin_ctrl/GetEnabled.h"
 #include "naro_fin_ctrl/GetHomes.h"
@@ -52,6 +79,8 @@
 using namespace naro_fin_ctrl;
 using namespace naro_usc_srvs;
 
+namespace {
+
 std::string uscServerName = "usc_server";
 double connectionRetry = 0.1;
 float servoHomingSpeed = 10.0f*M_PI/180.0f;
@@ -62,14 +91,31 @@ float controllerFrequencyGain = 0.9f;
 float controllerAmplitudeGain = 0.9f;
 float controllerPhaseGain = 0.9f;
 float controllerOffsetGain = 0.9f;
+bool controllerRealtimeEnabled = false;
+int controllerRealtimePriority = 50;
+bool controllerRealtimeLockMemory = true;
+bool controllerAsynchronous = true;
+std::string controllerMode = "sine";
+float controllerCpgConvergence = 10.0f;
+float controllerCpgCoupling = 4.0f;
+double commandsMaxAge = 0.5;
+bool sharedMemoryEnabled = false;
+bool traceEnabled = false;
+int traceCapacity = 4096;
+std::string traceFile;
 
 boost::shared_ptr<diagnostic_updater::Updater> updater;
+boost::shared_ptr<ros::NodeHandle> nodeHandle;
 boost::shared_ptr<diagnostic_updater::FrequencyStatus> diagnoseFrequency;
 
 ros::ServiceClient getChannelsClient;
 ros::ServiceClient getPositionsClient;
 ros::ServiceClient setProfilesClient;
 
+ros::Publisher profilesPublisher;
+ros::Subscriber profilesStatusSubscriber;
+ros::Subscriber commandsSubscriber;
+
 ros::ServiceServer getServosService;
 ros::ServiceServer getEnabledService;
 ros::ServiceServer getHomesService;
@@ -89,6 +135,12 @@ ros::ServiceServer setOffsetsService;
 ros::ServiceServer setCommandsService;
 ros::ServiceServer enableService;
 ros::ServiceServer disableService;
+ros::ServiceServer dumpTraceService;
+
+ros::Timer diagnosticsTimer;
+ros::Timer connectionTimer;
+ros::Timer controllerTimer;
+ros::Timer commandsTimer;
 
 const float pi2 = M_PI*2.0f;
 
@@ -116,26 +168,214 @@ public:
     home(0.0f) {
   };
 
-  void reset() {
-    actual.frequency = 0.0f;
-    actual.amplitude = 0.0f;
-    actual.offset = 0.0f;
-    actual.phase = 0.0f;
-  };
-  
   int channel;
 
   bool enabled;
   float home;
   Parameters gain;
   Parameters command;
-  Parameters actual;
+};
+
+/** Sequence lock for values with a single writer and any number of
+  * readers
+  *
+  * The writer never blocks. Readers retry their copy if it overlapped
+  * with a write, which is detected by an odd or changed sequence number.
+  * A real-time reader must not wait for a writer of lower priority, and
+  * therefore only tries a bounded number of copies. Values must be
+  * copyable without any allocation.
+  */
+template <typename T> class SeqLock {
+public:
+  SeqLock() :
+    sequence(0) {
+  };
+
+  void write(const T& value) {
+    ++sequence;
+    __sync_synchronize();
+    this->value = value;
+    __sync_synchronize();
+    ++sequence;
+  };
+
+  T read() const {
+    T value;
+    unsigned int before;
+
+    do {
+      while ((before = sequence) & 1)
+        sched_yield();
+      __sync_synchronize();
+      value = this->value;
+      __sync_synchronize();
+    }
+    while (before != sequence);
+
+    return value;
+  };
+
+  /** Try to copy the value without ever waiting for the writer, leaving
+    * the given value untouched if every attempt overlapped with a write
+    */
+  bool tryRead(T& value, int maxAttempts = 3) const {
+    for (int i = 0; i < maxAttempts; ++i) {
+      unsigned int before = sequence;
+      if (before & 1)
+        continue;
+
+      __sync_synchronize();
+      copy = this->value;
+      __sync_synchronize();
+
+      if (before == sequence) {
+        value = copy;
+        return true;
+      }
+    }
+
+    return false;
+  };
+
+private:
+  T value;
+  volatile unsigned int sequence;
+
+  /** Scratch copy of the single real-time reader, such that no attempt
+    * costs stack space of the size of the value
+    */
+  mutable T copy;
+};
+
+/** Controller setpoints handed from the service handlers to the control
+  * loop
+  */
+class Setpoints {
+public:
+  static const int maxServos = 32;
+
+  class Servo {
+  public:
+    Servo() :
+      channel(-1),
+      enabled(false),
+      home(0.0f) {
+    };
+
+    int channel;
+    bool enabled;
+    float home;
+    Controller::Parameters gain;
+    Controller::Parameters command;
+  };
+
+  Setpoints() :
+    trace(0),
+    numServos(0) {
+  };
+
+  /** Stamp and trace identifier of the input of the most recent commands
+    * frame, if any
+    */
+  ros::Time stamp;
+  uint32_t trace;
+  int numServos;
+  Servo servos[maxServos];
+};
+
+/** Actual controller parameters handed from the control loop to the
+  * service handlers
+  */
+class Actuals {
+public:
+  Actuals() :
+    numServos(0) {
+  };
+
+  int numServos;
+  Controller::Parameters servos[Setpoints::maxServos];
+};
+
+/** Timing statistics of the control loop
+  */
+class LoopStatistics {
+public:
+  LoopStatistics() :
+    numTicks(0),
+    numOverruns(0),
+    sumJitter(0.0),
+    maxJitter(0.0) {
+  };
+
+  unsigned long numTicks;
+  unsigned long numOverruns;
+  double sumJitter;
+  double maxJitter;
+};
+
+/** Latency from the input stamp of a commands frame to the first servo
+  * profiles computed from it
+  */
+class LatencyStatistics {
+public:
+  LatencyStatistics() :
+    numSamples(0),
+    last(0.0),
+    sum(0.0),
+    max(0.0) {
+  };
+
+  unsigned long numSamples;
+  double last;
+  double sum;
+  double max;
 };
 
 std::vector<Controller> controllers;
+SeqLock<Setpoints> setpointBuffer;
+SeqLock<Actuals> actualBuffer;
+SeqLock<LoopStatistics> loopStatisticsBuffer;
+SeqLock<LatencyStatistics> latencyStatisticsBuffer;
+boost::thread controlThread;
+
+/** Profiles computed by the real-time control loop are handed to a thread
+  * sending them, which the loop wakes by posting a semaphore
+  */
+SeqLock<naro_shm::Profiles> profilesBuffer;
+sem_t profilesSemaphore;
+boost::thread outputThread;
+
+/** Profiles are sent under the output lock and discarded if stamped before
+  * the last servos were disabled, such that no frame computed from their
+  * former setpoints follows their homing
+  */
+boost::mutex outputMutex;
+ros::Time disableStamp;
+volatile unsigned int profilesSequence = 0;
+ProfilesStatus::ConstPtr profilesStatus;
 ros::Time timeOffset;
 ros::Time lastTime;
 
+naro_shm::Segment<naro_shm::Commands> commandsSegment;
+naro_shm::Segment<naro_shm::Profiles> profilesSegment;
+uint32_t commandsSequence = 0;
+ros::Time commandsStamp;
+uint32_t commandsTrace = 0;
+uint32_t commandsFrameSequence = 0;
+unsigned long numCommandsApplied = 0;
+unsigned long numCommandsRejected = 0;
+unsigned long numCommandsDropped = 0;
+volatile bool running = false;
+volatile unsigned long numSetpointsStale = 0;
+
+OscillatorNetwork network(Setpoints::maxServos);
+volatile float networkCoherence = 0.0f;
+
+/** Spans of applying commands and of the first control tick computing
+  * profiles from them, recorded by the spinner and the control thread
+  */
+naro_trace::Tracer tracer;
+
 void getParameters(const ros::NodeHandle& node) {
   node.param<std::string>("server/usc/name", uscServerName, uscServerName);
   node.param<double>("server/connection/retry", connectionRetry,
@@ -168,18 +408,109 @@ void getParameters(const ros::NodeHandle& node) {
   node.param<double>("controller/gain/offset", controllerOffsetGain,
     controllerOffsetGain);
   ::controllerOffsetGain = controllerOffsetGain;
+  node.param<bool>("controller/realtime/enabled", controllerRealtimeEnabled,
+    controllerRealtimeEnabled);
+  node.param<int>("controller/realtime/priority", controllerRealtimePriority,
+    controllerRealtimePriority);
+  node.param<bool>("controller/realtime/lock_memory",
+    controllerRealtimeLockMemory, controllerRealtimeLockMemory);
+  node.param<bool>("controller/asynchronous", controllerAsynchronous,
+    controllerAsynchronous);
+  node.param<std::string>("controller/mode", controllerMode, controllerMode);
+  double controllerCpgConvergence = ::controllerCpgConvergence;
+  node.param<double>("controller/cpg/convergence", controllerCpgConvergence,
+    controllerCpgConvergence);
+  ::controllerCpgConvergence = controllerCpgConvergence;
+  node.param<double>("commands/max_age", commandsMaxAge, commandsMaxAge);
+  node.param<bool>("shared_memory/enabled", sharedMemoryEnabled,
+    sharedMemoryEnabled);
+  node.param<bool>("trace/enabled", traceEnabled, traceEnabled);
+  node.param<int>("trace/capacity", traceCapacity, traceCapacity);
+  node.param<std::string>("trace/file", traceFile, traceFile);
+}
+
+inline bool parameterToWeight(XmlRpc::XmlRpcValue& value, float& weight) {
+  if (value.getType() == XmlRpc::XmlRpcValue::TypeDouble)
+    weight = static_cast<double>(value);
+  else if (value.getType() == XmlRpc::XmlRpcValue::TypeInt)
+    weight = static_cast<int>(value);
+  else
+    return false;
+
+  return true;
+}
+
+/** Configure the central pattern generator, whose coupling is given either
+  * as the weight of a chain of neighboring servos or as a matrix with one
+  * row of weights per servo
+  */
+void getCoupling(const ros::NodeHandle& node) {
+  network.setConvergence(controllerCpgConvergence);
+  network.setChainCoupling(controllerCpgCoupling);
+
+  XmlRpc::XmlRpcValue value;
+  if (!node.getParam("controller/cpg/coupling", value))
+    return;
+
+  if (parameterToWeight(value, controllerCpgCoupling))
+    network.setChainCoupling(controllerCpgCoupling);
+  else if (value.getType() == XmlRpc::XmlRpcValue::TypeArray) {
+    network.setChainCoupling(0.0f);
+
+    for (int i = 0; (i < value.size()) && (i < network.getSize()); ++i) {
+      if (value[i].getType() != XmlRpc::XmlRpcValue::TypeArray) {
+        ROS_WARN("Invalid type for row %d of coupling parameter: "
+          "expecting array", i);
+        continue;
+      }
+
+      for (int j = 0; (j < value[i].size()) && (j < network.getSize());
+          ++j) {
+        float weight;
+        if (parameterToWeight(value[i][j], weight))
+          network.setCoupling(i, j, weight);
+        else
+          ROS_WARN("Invalid type for coupling weight (%d, %d): expecting "
+            "number", i, j);
+      }
+    }
+  }
+  else
+    ROS_WARN("Invalid type for coupling parameter: expecting number or "
+      "array");
+}
+
+/** Publish the setpoints of all controllers to the control loop, to be
+  * called by the service handlers after any modification
+  */
+void publishSetpoints() {
+  Setpoints setpoints;
+
+  setpoints.stamp = commandsStamp;
+  setpoints.trace = commandsTrace;
+  setpoints.numServos = controllers.size();
+  for (int i = 0; i < controllers.size(); ++i) {
+    setpoints.servos[i].channel = controllers[i].channel;
+    setpoints.servos[i].enabled = controllers[i].enabled;
+    setpoints.servos[i].home = controllers[i].home;
+    setpoints.servos[i].gain = controllers[i].gain;
+    setpoints.servos[i].command = controllers[i].command;
+  }
+
+  setpointBuffer.write(setpoints);
 }
 
 void initializeControllers() {
   controllers.clear();
 
-  getChannelsClient = ros::NodeHandle("~").serviceClient<GetChannels>(
+  getChannelsClient = nodeHandle->serviceClient<GetChannels>(
     "/"+uscServerName+"/get_channels");
   GetChannels getChannels;
 
   if (getChannelsClient.call(getChannels)) {
     for (int i = 0; (i < getChannels.response.mode.size()) &&
-        (controllers.size() < controllerMaxServos); ++i)
+        (controllers.size() < controllerMaxServos) &&
+        (controllers.size() < Setpoints::maxServos); ++i)
       if (getChannels.response.mode[i] == GetChannels::Response::SERVO) {
       controllers.push_back(i);
 
@@ -191,6 +522,7 @@ void initializeControllers() {
 
     ROS_INFO("USC server reported %d available servo(s).",
       (unsigned int)controllers.size());
+    publishSetpoints();
   }
   else
     ROS_FATAL("No servos available: GetChannels request failed.");
@@ -249,13 +581,15 @@ bool getGains(GetGains::Request& request, GetGains::Response& response) {
 
 bool getFrequencies(GetFrequencies::Request& request,
     GetFrequencies::Response& response) {
+  Actuals actuals = actualBuffer.read();
+
   response.command.resize(request.servos.size());
   response.actual.resize(request.servos.size());
 
   for (int i = 0; i < request.servos.size(); ++i) {
     if (request.servos[i] < controllers.size()) {
       response.command[i] = controllers[request.servos[i]].command.frequency;
-      response.actual[i] = controllers[request.servos[i]].actual.frequency;
+      response.actual[i] = actuals.servos[request.servos[i]].frequency;
     }
     else {
       response.command[i] = std::numeric_limits<float>::quiet_NaN();
@@ -268,13 +602,15 @@ bool getFrequencies(GetFrequencies::Request& request,
 
 bool getAmplitudes(GetAmplitudes::Request& request, GetAmplitudes::Response&
     response) {
+  Actuals actuals = actualBuffer.read();
+
   response.command.resize(request.servos.size());
   response.actual.resize(request.servos.size());
 
   for (int i = 0; i < request.servos.size(); ++i) {
     if (request.servos[i] < controllers.size()) {
       response.command[i] = controllers[request.servos[i]].command.amplitude;
-      response.actual[i] = controllers[request.servos[i]].actual.amplitude;
+      response.actual[i] = actuals.servos[request.servos[i]].amplitude;
     }
     else {
       response.command[i] = std::numeric_limits<float>::quiet_NaN();
@@ -286,13 +622,15 @@ bool getAmplitudes(GetAmplitudes::Request& request, GetAmplitudes::Response&
 }
 
 bool getPhases(GetPhases::Request& request, GetPhases::Response& response) {
+  Actuals actuals = actualBuffer.read();
+
   response.command.resize(request.servos.size());
   response.actual.resize(request.servos.size());
 
   for (int i = 0; i < request.servos.size(); ++i) {
     if (request.servos[i] < controllers.size()) {
       response.command[i] = controllers[request.servos[i]].command.phase;
-      response.actual[i] = controllers[request.servos[i]].actual.phase;
+      response.actual[i] = actuals.servos[request.servos[i]].phase;
     }
     else {
       response.command[i] = std::numeric_limits<float>::quiet_NaN();
@@ -304,13 +642,15 @@ bool getPhases(GetPhases::Request& request, GetPhases::Response& response) {
 }
 
 bool getOffsets(GetOffsets::Request& request, GetOffsets::Response& response) {
+  Actuals actuals = actualBuffer.read();
+
   response.command.resize(request.servos.size());
   response.actual.resize(request.servos.size());
 
   for (int i = 0; i < request.servos.size(); ++i) {
     if (request.servos[i] < controllers.size()) {
       response.command[i] = controllers[request.servos[i]].command.offset;
-      response.actual[i] = controllers[request.servos[i]].actual.offset;
+      response.actual[i] = actuals.servos[request.servos[i]].offset;
     }
     else {
       response.command[i] = std::numeric_limits<float>::quiet_NaN();
@@ -348,6 +688,8 @@ bool getCommands(GetCommands::Request& request, GetCommands::Response&
 
 bool getActuals(GetActuals::Request& request, GetActuals::Response&
     response) {
+  Actuals actuals = actualBuffer.read();
+
   response.frequency.resize(request.servos.size());
   response.amplitude.resize(request.servos.size());
   response.phase.resize(request.servos.size());
@@ -355,10 +697,10 @@ bool getActuals(GetActuals::Request& request, GetActuals::Response&
 
   for (int i = 0; i < request.servos.size(); ++i) {
     if (request.servos[i] < controllers.size()) {
-      response.frequency[i] = controllers[request.servos[i]].actual.frequency;
-      response.amplitude[i] = controllers[request.servos[i]].actual.amplitude;
-      response.phase[i] = controllers[request.servos[i]].actual.phase;
-      response.offset[i] = controllers[request.servos[i]].actual.offset;
+      response.frequency[i] = actuals.servos[request.servos[i]].frequency;
+      response.amplitude[i] = actuals.servos[request.servos[i]].amplitude;
+      response.phase[i] = actuals.servos[request.servos[i]].phase;
+      response.offset[i] = actuals.servos[request.servos[i]].offset;
     }
     else {
       response.frequency[i] = std::numeric_limits<float>::quiet_NaN();
@@ -384,6 +726,7 @@ bool setHomes(SetHomes::Request& request, SetHomes::Response& response) {
     }
   }
 
+  publishSetpoints();
   return result;
 }
 
@@ -404,6 +747,7 @@ bool setGains(SetGains::Request& request, SetGains::Response& response) {
     }
   }
 
+  publishSetpoints();
   return result;
 }
 
@@ -421,6 +765,7 @@ bool setFrequencies(SetFrequencies::Request& request,
     }
   }
 
+  publishSetpoints();
   return result;
 }
 
@@ -438,6 +783,7 @@ bool setAmplitudes(SetAmplitudes::Request& request, SetAmplitudes::Response&
     }
   }
 
+  publishSetpoints();
   return result;
 }
 
@@ -454,6 +800,7 @@ bool setPhases(SetPhases::Request& request, SetPhases::Response& response) {
     }
   }
 
+  publishSetpoints();
   return result;
 }
 
@@ -470,6 +817,7 @@ bool setOffsets(SetOffsets::Request& request, SetOffsets::Response& response) {
     }
   }
 
+  publishSetpoints();
   return result;
 }
 
@@ -491,6 +839,7 @@ bool setCommands(SetCommands::Request& request, SetCommands::Response&
     }
   }
 
+  publishSetpoints();
   return result;
 }
 
@@ -507,6 +856,7 @@ bool enable(Enable::Request& request, Enable::Response& response) {
     }
   }
 
+  publishSetpoints();
   return result;
 }
 
@@ -515,7 +865,7 @@ bool disable(Disable::Request& request, Disable::Response& response) {
   
   unsigned int numEnabled = 0;
   if (!request.servos.empty()) {
-    for (int i = 0; i < request.servos.size(); ) {
+    for (int i = 0; i < request.servos.size(); ++i) {
       if (request.servos[i] >= controllers.size()) {
         ROS_WARN("Enable request failed: Servo %d does not exist.",
           request.servos[i]);
@@ -544,7 +894,6 @@ bool disable(Disable::Request& request, Disable::Response& response) {
     if ((request.servos[i] < controllers.size()) &&
       controllers[request.servos[i]].enabled) {
     controllers[request.servos[i]].enabled = false;
-    controllers[request.servos[i]].reset();
     
     setProfiles.request.channels[j] = controllers[request.servos[i]].channel;
     setProfiles.request.position[j] = controllers[request.servos[i]].home;
@@ -554,7 +903,15 @@ bool disable(Disable::Request& request, Disable::Response& response) {
     ++j;
   }
 
-  return setProfilesClient.call(setProfiles);
+  /** The control loop resets the actual parameters of disabled servos
+    */
+  publishSetpoints();
+  {
+    boost::mutex::scoped_lock lock(outputMutex);
+    disableStamp = ros::Time::now();
+  }
+
+  return setProfilesClient.call(setProfiles) && result;
 }
 
 void diagnoseConnections(diagnostic_updater::DiagnosticStatusWrapper &status) {
@@ -584,72 +941,519 @@ void tryConnect(const ros::TimerEvent& event = ros::TimerEvent()) {
     initializeControllers();
 
   if (!getPositionsClient)
-    getPositionsClient = ros::NodeHandle("~").serviceClient<GetPositions>(
+    getPositionsClient = nodeHandle->serviceClient<GetPositions>(
       "/"+uscServerName+"/get_positions", true);
   if (!setProfilesClient)
-    setProfilesClient = ros::NodeHandle("~").serviceClient<SetProfiles>(
+    setProfilesClient = nodeHandle->serviceClient<SetProfiles>(
       "/"+uscServerName+"/set_profiles", true);
 }
 
-void updateControl(const ros::TimerEvent& event) {
-  unsigned int numEnabled = 0;
-  for (int i = 0; i < controllers.size(); ++i)
-    numEnabled += controllers[i].enabled;
+void receiveProfilesStatus(const ProfilesStatus::ConstPtr& profilesStatus) {
+  ::profilesStatus = profilesStatus;
+}
 
-  if (!numEnabled)
-    return;
-  
-  SetProfiles setProfiles;
-  setProfiles.request.channels.resize(numEnabled);
-  setProfiles.request.position.resize(numEnabled);
-  setProfiles.request.speed.resize(numEnabled);
-  setProfiles.request.acceleration.resize(numEnabled);
-  
+void diagnosePipeline(diagnostic_updater::DiagnosticStatusWrapper &status) {
+  unsigned int sequence = profilesSequence;
+
+  if (profilesSegment.isOpen())
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "Profiles frame %u written to shared memory.",
+      profilesSegment.getSequence());
+  else if (!controllerAsynchronous)
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "Profiles sent synchronously.");
+  else if (!profilesStatus)
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::WARN,
+      "No profiles acknowledged.");
+  else if (!profilesStatus->result)
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::WARN,
+      "Profiles frame %u failed to apply.", profilesStatus->sequence);
+  else
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "Profiles frame %u acknowledged.", profilesStatus->sequence);
+
+  if (controllerAsynchronous) {
+    status.addf("Sent", "%u", sequence);
+    if (profilesStatus) {
+      status.addf("Applied", "%u", profilesStatus->applied);
+      status.addf("Dropped", "%u", profilesStatus->dropped);
+      status.addf("Lag", "%d frame(s)", (int)(sequence-
+        profilesStatus->sequence));
+    }
+  }
+}
+
+void diagnoseSharedMemory(diagnostic_updater::DiagnosticStatusWrapper
+    &status) {
+  if (!sharedMemoryEnabled)
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "Shared memory transport disabled.");
+  else if (!commandsSegment.isOpen())
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::WARN,
+      "Shared memory segment for commands not created.");
+  else if (!profilesSegment.isOpen())
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "Shared memory segment for profiles absent, using ROS transport.");
+  else
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "Shared memory segments connected.");
+
+  if (sharedMemoryEnabled)
+    status.addf("Commands received", "%u", commandsSequence);
+}
+
+void diagnoseGait(diagnostic_updater::DiagnosticStatusWrapper &status) {
+  if (controllerMode == "cpg") {
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "Central pattern generator running.");
+    status.addf("Coherence", "%.3f", networkCoherence);
+    status.addf("Settling time", "%.2f s (%d ticks)",
+      network.getSettlingTime(), (int)ceil(network.getSettlingTime()*
+      controllerFrequency));
+  }
+  else if (controllerMode == "sine")
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "Independent sine oscillators running.");
+  else
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::ERROR,
+      "Unknown controller mode %s.", controllerMode.c_str());
+}
+
+void diagnoseCommands(diagnostic_updater::DiagnosticStatusWrapper &status) {
+  static unsigned long lastRejected = 0;
+  LatencyStatistics statistics = latencyStatisticsBuffer.read();
+
+  if (numCommandsRejected > lastRejected)
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::WARN,
+      "%lu commands frame(s) rejected as older than %.1f ms.",
+      numCommandsRejected-lastRejected, commandsMaxAge*1e3);
+  else if (!numCommandsApplied)
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "No commands frames applied.");
+  else
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "Input-to-servo latency %.1f ms.", statistics.last*1e3);
+
+  status.addf("Applied", "%lu", numCommandsApplied);
+  status.addf("Rejected", "%lu", numCommandsRejected);
+  status.addf("Dropped", "%lu", numCommandsDropped);
+  status.addf("Last latency", "%.1f ms", statistics.last*1e3);
+  status.addf("Mean latency", "%.1f ms", statistics.numSamples ?
+    statistics.sum/statistics.numSamples*1e3 : 0.0);
+  status.addf("Max latency", "%.1f ms", statistics.max*1e3);
+
+  lastRejected = numCommandsRejected;
+}
+
+void diagnoseLoop(diagnostic_updater::DiagnosticStatusWrapper &status) {
+  LoopStatistics statistics = loopStatisticsBuffer.read();
+
+  if (!controllerRealtimeEnabled)
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "Control loop timer-driven.");
+  else if (!statistics.numOverruns)
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "Control loop running in real-time thread.");
+  else
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::WARN,
+      "Control loop overran %lu time(s).", statistics.numOverruns);
+
+  status.addf("Ticks", "%lu", statistics.numTicks);
+  status.addf("Overruns", "%lu", statistics.numOverruns);
+  status.addf("Mean jitter", "%.1f us", statistics.numTicks ?
+    statistics.sumJitter/statistics.numTicks*1e6 : 0.0);
+  status.addf("Max jitter", "%.1f us", statistics.maxJitter*1e6);
+  status.addf("Stale setpoints", "%lu", numSetpointsStale);
+}
+
+/** Advance the control loop by one tick and compute the resulting servo
+  * profiles, returning whether any servo is enabled
+  *
+  * A tick neither allocates memory nor makes any system call besides
+  * reading the clock, such that it may run in the real-time thread.
+  */
+bool stepControl(naro_shm::Profiles& frame) {
+  static OscillatorBank bank(Setpoints::maxServos);
+  naro_trace::Scope scope(tracer, naro_trace::stageFinControl);
+
+  /** The frame is stamped before the setpoints are read, such that a frame
+    * stamped after a write of the setpoints never derives from older ones
+    */
   float dt = 0.0f;
   if (!lastTime.isZero())
     dt = (ros::Time::now()-lastTime).toSec();
   lastTime = ros::Time::now();
 
+  /** Keep the last consistent setpoints while the service handlers are
+    * preempted in the middle of writing new ones
+    */
+  static Setpoints setpoints;
+  if (!setpointBuffer.tryRead(setpoints))
+    ++numSetpointsStale;
+  Actuals actuals;
+
+  /** Only the first profiles computed from a traced input carry its
+    * identifier
+    */
+  static uint32_t lastTrace = 0;
+  uint32_t trace = (setpoints.trace != lastTrace) ? setpoints.trace : 0;
+  lastTrace = setpoints.trace;
+  scope.setTrace(trace);
+
   float t_0 = (lastTime-timeOffset).toSec();
   float t_2 = t_0+2.0f/controllerFrequency;
 
+  unsigned int numEnabled = 0;
+  for (int i = 0; i < setpoints.numServos; ++i)
+    numEnabled += setpoints.servos[i].enabled;
+
+  for (int i = 0; i < setpoints.numServos; ++i) {
+    const Setpoints::Servo& servo = setpoints.servos[i];
+
+    bank.enabled[i] = servo.enabled;
+    bank.home[i] = servo.home;
+    bank.gain.frequency[i] = servo.gain.frequency;
+    bank.gain.amplitude[i] = servo.gain.amplitude;
+    bank.gain.phase[i] = servo.gain.phase;
+    bank.gain.offset[i] = servo.gain.offset;
+    bank.command.frequency[i] = servo.command.frequency;
+    bank.command.amplitude[i] = servo.command.amplitude;
+    bank.command.phase[i] = servo.command.phase;
+    bank.command.offset[i] = servo.command.offset;
+  }
+  for (int i = setpoints.numServos; i < bank.getSize(); ++i)
+    bank.enabled[i] = 0.0f;
+
+  /** The central pattern generator shares its commands with the bank but
+    * integrates its own oscillator states
+    */
+  bool cpg = (controllerMode == "cpg");
+  if (cpg) {
+    network.update(bank, std::max(dt, 0.0f), t_2-t_0);
+    networkCoherence = network.getCoherence();
+  }
+  else
+    bank.update(std::max(dt, 0.0f), t_2, t_0);
+
+  const float* position = cpg ? network.position : bank.position;
+  const float* speed = cpg ? network.speed : bank.speed;
+
   int j = 0;
-  for (int i = 0; i < controllers.size(); ++i) {
-    if (controllers[i].enabled) {
-      if (dt > 0.0f) {
-        controllers[i].actual.frequency += controllers[i].gain.frequency*dt*
-          (controllers[i].command.frequency-controllers[i].actual.frequency);
-        controllers[i].actual.amplitude += controllers[i].gain.amplitude*dt*
-          (controllers[i].command.amplitude-controllers[i].actual.amplitude);
-        controllers[i].actual.phase += controllers[i].gain.phase*dt*
-          (controllers[i].command.phase-controllers[i].actual.phase);
-        controllers[i].actual.offset += controllers[i].gain.offset*dt*
-          (controllers[i].command.offset-controllers[i].actual.offset);
-      }
+  for (int i = 0; i < setpoints.numServos; ++i) {
+    if (setpoints.servos[i].enabled && (j < (int)naro_shm::maxChannels)) {
+      frame.channels[j] = setpoints.servos[i].channel;
+      frame.position[j] = position[i];
+      frame.speed[j] = speed[i];
+      frame.acceleration[j] = std::numeric_limits<float>::infinity();
 
-      float omega_i = pi2*controllers[i].actual.frequency;
-      setProfiles.request.channels[j] = controllers[i].channel;
-      setProfiles.request.position[j] = controllers[i].home+
-        controllers[i].actual.offset+controllers[i].actual.amplitude*
-        sin(omega_i*t_2+controllers[i].actual.phase);
-      setProfiles.request.speed[j] = omega_i*controllers[i].actual.amplitude*
-        cos(omega_i*t_0+controllers[i].actual.phase);
-      setProfiles.request.acceleration[j] =
-        std::numeric_limits<float>::infinity();
-        
       ++j;
     }
+
+    if (cpg) {
+      actuals.servos[i].frequency = network.frequency[i];
+      actuals.servos[i].amplitude = network.amplitude[i];
+      actuals.servos[i].phase = setpoints.servos[i].enabled ?
+        bank.command.phase[i]+pi2*network.lag[i] : 0.0f;
+      actuals.servos[i].offset = network.offset[i];
+    }
+    else {
+      actuals.servos[i].frequency = bank.actual.frequency[i];
+      actuals.servos[i].amplitude = bank.actual.amplitude[i];
+      actuals.servos[i].phase = bank.actual.phase[i];
+      actuals.servos[i].offset = bank.actual.offset[i];
+    }
+  }
+
+  actuals.numServos = setpoints.numServos;
+  actualBuffer.write(actuals);
+
+  static ros::Time lastStamp;
+  if (setpoints.stamp != lastStamp) {
+    static LatencyStatistics statistics;
+    double latency = (lastTime-setpoints.stamp).toSec();
+
+    ++statistics.numSamples;
+    statistics.last = latency;
+    statistics.sum += latency;
+    statistics.max = std::max(statistics.max, latency);
+    latencyStatisticsBuffer.write(statistics);
+
+    lastStamp = setpoints.stamp;
+  }
+
+  frame.stamp = lastTime.toNSec();
+  frame.trace = trace;
+  frame.numChannels = j;
+
+  return numEnabled > 0;
+}
+
+/** Re-check the owner of the profiles segment at the connection retry rate
+  *
+  * The profiles segment is only ever touched by the thread sending the
+  * profiles.
+  */
+void reconnectProfiles() {
+  static ros::WallTime lastConnect;
+  ros::WallTime now = ros::WallTime::now();
+
+  if (sharedMemoryEnabled && ((now-lastConnect).toSec() >=
+      connectionRetry)) {
+    profilesSegment.reconnect(naro_shm::getSegmentName("/"+uscServerName,
+      "profiles"));
+    lastConnect = now;
   }
+}
+
+/** Send servo profiles computed by the control loop through shared memory,
+  * as an asynchronous frame or by a synchronous service call, unless they
+  * were computed before the last servos were disabled
+  */
+void sendProfiles(const naro_shm::Profiles& frame) {
+  boost::mutex::scoped_lock lock(outputMutex);
+  if (frame.stamp < disableStamp.toNSec())
+    return;
 
-  if (setProfilesClient.call(setProfiles))
+  size_t numChannels = frame.numChannels;
+
+  if (profilesSegment.isOpen()) {
+    profilesSegment.write(frame);
+    diagnoseFrequency->tick();
+  }
+  /** Asynchronous profiles are published as sequenced frames which the
+    * USC server acknowledges through its status topic
+    */
+  else if (controllerAsynchronous) {
+    Profiles::Ptr profiles(new Profiles());
+
+    profiles->header.stamp.fromNSec(frame.stamp);
+    profiles->sequence = profilesSequence+1;
+    profiles->trace = frame.trace;
+    profiles->channels.assign(frame.channels, frame.channels+numChannels);
+    profiles->position.assign(frame.position, frame.position+numChannels);
+    profiles->speed.assign(frame.speed, frame.speed+numChannels);
+    profiles->acceleration.assign(frame.acceleration,
+      frame.acceleration+numChannels);
+
+    profilesPublisher.publish(profiles);
+    profilesSequence = profiles->sequence;
     diagnoseFrequency->tick();
+  }
+  else {
+    static SetProfiles setProfiles;
+
+    setProfiles.request.channels.assign(frame.channels,
+      frame.channels+numChannels);
+    setProfiles.request.position.assign(frame.position,
+      frame.position+numChannels);
+    setProfiles.request.speed.assign(frame.speed, frame.speed+numChannels);
+    setProfiles.request.acceleration.assign(frame.acceleration,
+      frame.acceleration+numChannels);
+
+    if (setProfilesClient.call(setProfiles))
+      diagnoseFrequency->tick();
+  }
 }
 
-int main(int argc, char **argv) {
-  ros::init(argc, argv, "fin_controller");
-  ros::NodeHandle node("~");
+/** Check the input stamp of a commands frame against the maximum age
+  */
+bool isCommandsTooOld(const ros::Time& stamp) {
+  if ((commandsMaxAge > 0.0) && ((ros::Time::now()-stamp).toSec() >
+      commandsMaxAge)) {
+    ++numCommandsRejected;
+    return true;
+  }
+
+  return false;
+}
+
+/** Apply the newest commands frame written by the joy command into the
+  * shared memory segment, if any
+  *
+  * Frames overwritten before being read count as dropped.
+  */
+void receiveSharedCommands(const ros::TimerEvent& event) {
+  if (commandsSegment.getSequence() == commandsSequence)
+    return;
+
+  static naro_shm::Commands frame;
+  naro_trace::Scope scope(tracer, naro_trace::stageFinCommands);
+  uint32_t sequence = commandsSegment.read(frame);
+  if (!sequence)
+    return;
+  if (commandsSequence && (sequence > commandsSequence))
+    numCommandsDropped += sequence-commandsSequence-1;
+  commandsSequence = sequence;
+
+  ros::Time stamp;
+  stamp.fromNSec(frame.stamp);
+  if (isCommandsTooOld(stamp))
+    return;
+
+  for (int i = 0; (i < frame.numServos) && (i < naro_shm::maxServos); ++i) {
+    if (frame.servos[i] < controllers.size()) {
+      controllers[frame.servos[i]].command.frequency = frame.frequency[i];
+      controllers[frame.servos[i]].command.amplitude = frame.amplitude[i];
+      controllers[frame.servos[i]].command.phase = frame.phase[i];
+      controllers[frame.servos[i]].command.offset = frame.offset[i];
+    }
+  }
+
+  commandsStamp = stamp;
+  commandsTrace = frame.trace;
+  ++numCommandsApplied;
+  publishSetpoints();
+  scope.setTrace(frame.trace);
+}
+
+/** Apply a commands frame published by the joy command
+  *
+  * Frames with a sequence number not beyond the last applied one are stale
+  * and dropped unless their stamp is newer, which indicates a restarted
+  * publisher, gaps in the sequence count as frames dropped by the queue.
+  * Frames older than the maximum age are rejected.
+  */
+void receiveCommands(const naro_fin_ctrl::Commands::ConstPtr& commands) {
+  naro_trace::Scope scope(tracer, naro_trace::stageFinCommands);
+
+  if (numCommandsApplied && (commands->sequence <= commandsFrameSequence)) {
+    if (commands->header.stamp <= commandsStamp) {
+      ++numCommandsDropped;
+      return;
+    }
+  }
+  else if (numCommandsApplied)
+    numCommandsDropped += commands->sequence-commandsFrameSequence-1;
+  commandsFrameSequence = commands->sequence;
+
+  if (isCommandsTooOld(commands->header.stamp))
+    return;
+
+  for (int i = 0; i < commands->servos.size(); ++i) {
+    if (commands->servos[i] < controllers.size()) {
+      controllers[commands->servos[i]].command.frequency =
+        commands->frequency[i];
+      controllers[commands->servos[i]].command.amplitude =
+        commands->amplitude[i];
+      controllers[commands->servos[i]].command.phase = commands->phase[i];
+      controllers[commands->servos[i]].command.offset = commands->offset[i];
+    }
+  }
+
+  commandsStamp = commands->header.stamp;
+  commandsTrace = commands->trace;
+  ++numCommandsApplied;
+  publishSetpoints();
+  scope.setTrace(commands->trace);
+}
+
+bool dumpTrace(naro_trace::DumpTrace::Request& request,
+    naro_trace::DumpTrace::Response& response) {
+  int numSpans = tracer.dump(request.file.empty() ? traceFile :
+    request.file);
+
+  if (numSpans < 0)
+    return false;
+  response.spans = numSpans;
+
+  return true;
+}
+
+void updateControl(const ros::TimerEvent& event) {
+  static naro_shm::Profiles frame;
+
+  reconnectProfiles();
+  if (stepControl(frame))
+    sendProfiles(frame);
+}
+
+inline double timespecToSec(const struct timespec& time) {
+  return time.tv_sec+time.tv_nsec*1e-9;
+}
+
+/** Real-time control loop, paced by absolute deadlines on the monotonic
+  * clock
+  */
+void runControl() {
+  struct sched_param parameter;
+  parameter.sched_priority = controllerRealtimePriority;
+  int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &parameter);
+  if (error)
+    ROS_WARN("Failed to set real-time scheduling policy: %s",
+      strerror(error));
+
+  long period = 1e9/controllerFrequency;
+  LoopStatistics statistics;
+  naro_shm::Profiles frame;
+  struct timespec deadline, now;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+  while (running && ros::ok()) {
+    deadline.tv_nsec += period;
+    while (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_nsec -= 1000000000L;
+      ++deadline.tv_sec;
+    }
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, 0) ==
+      EINTR);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    double jitter = timespecToSec(now)-timespecToSec(deadline);
+    ++statistics.numTicks;
+    statistics.sumJitter += jitter;
+    statistics.maxJitter = std::max(statistics.maxJitter, jitter);
+
+    /** Skip missed deadlines instead of catching up in a burst
+      */
+    if (jitter*1e9 > period) {
+      ++statistics.numOverruns;
+      deadline = now;
+    }
+    loopStatisticsBuffer.write(statistics);
+
+    if (stepControl(frame)) {
+      profilesBuffer.write(frame);
+      sem_post(&profilesSemaphore);
+    }
+  }
+}
+
+/** Send the profiles of the real-time control loop, which it never waits
+  * for, and keep the profiles segment connected
+  */
+void runOutput() {
+  naro_shm::Profiles frame;
+
+  while (running && ros::ok()) {
+    struct timespec timeout;
+    clock_gettime(CLOCK_REALTIME, &timeout);
+    timeout.tv_nsec += 100000000L;
+    if (timeout.tv_nsec >= 1000000000L) {
+      timeout.tv_nsec -= 1000000000L;
+      ++timeout.tv_sec;
+    }
+
+    bool posted = !sem_timedwait(&profilesSemaphore, &timeout);
+    reconnectProfiles();
+    if (!posted)
+      continue;
+
+    /** Only the newest of several profiles posted meanwhile is sent
+      */
+    while (!sem_trywait(&profilesSemaphore));
+    frame = profilesBuffer.read();
+    sendProfiles(frame);
+  }
+}
 
-  updater.reset(new diagnostic_updater::Updater());
+/** Advertise the services and start the timers of the fin controller under
+  * the given private node handle
+  */
+void startNode(ros::NodeHandle& node) {
+  nodeHandle.reset(new ros::NodeHandle(node));
+  updater.reset(new diagnostic_updater::Updater(ros::NodeHandle(), node,
+    node.getNamespace()));
   updater->setHardwareID("none");
 
   updater->add("Connections", diagnoseConnections);
@@ -659,9 +1463,25 @@ int main(int argc, char **argv) {
     &controllerFrequency)));
   updater->add("Frequency", &*diagnoseFrequency,
     &diagnostic_updater::FrequencyStatus::run);
+  updater->add("Gait", diagnoseGait);
+  updater->add("Commands", diagnoseCommands);
+  updater->add("Loop", diagnoseLoop);
+  updater->add("Pipeline", diagnosePipeline);
+  updater->add("Shared Memory", diagnoseSharedMemory);
   updater->force_update();
 
   getParameters(node);
+  getCoupling(node);
+
+  /** The real-time loop must not wait for service calls
+    */
+  if (controllerRealtimeEnabled && !controllerAsynchronous) {
+    ROS_WARN("Real-time control rejects synchronous profiles, "
+      "sending them asynchronously.");
+    controllerAsynchronous = true;
+  }
+
+  tracer.enable(traceEnabled ? traceCapacity : 0);
 
   getServosService = node.advertiseService("get_servos", getServos);
   getEnabledService = node.advertiseService("get_enabled", getEnabled);
@@ -686,19 +1506,102 @@ int main(int argc, char **argv) {
   setCommandsService = node.advertiseService("set_commands", setCommands);
   enableService = node.advertiseService("enable", enable);
   disableService = node.advertiseService("disable", disable);
+  dumpTraceService = node.advertiseService("dump_trace", dumpTrace);
+
+  if (controllerAsynchronous) {
+    profilesPublisher = node.advertise<Profiles>(
+      "/"+uscServerName+"/profiles", 1);
+    profilesStatusSubscriber = node.subscribe(
+      "/"+uscServerName+"/profiles_status", 1, receiveProfilesStatus,
+      ros::TransportHints().tcpNoDelay());
+  }
+
+  commandsSubscriber = node.subscribe("commands", 1, receiveCommands,
+    ros::TransportHints().tcpNoDelay());
 
-  ros::Timer diagnosticsTimer = node.createTimer(
+  diagnosticsTimer = node.createTimer(
     ros::Duration(1.0), updateDiagnostics);
-  ros::Timer connectionTimer = node.createTimer(
+  connectionTimer = node.createTimer(
     ros::Duration(connectionRetry), tryConnect);
-  ros::Timer controllerTimer = node.createTimer(
-    ros::Duration(1.0/controllerFrequency), updateControl);
 
   initializeControllers();
   tryConnect();
   timeOffset = ros::Time::now();
 
+  if (sharedMemoryEnabled) {
+    if (commandsSegment.create(naro_shm::getSegmentName(
+        node.getNamespace(), "commands")))
+      commandsTimer = node.createTimer(
+        ros::Duration(1.0/controllerFrequency), receiveSharedCommands);
+    else
+      ROS_WARN("Failed to create shared memory segment: %s",
+        strerror(errno));
+  }
+
+  if (controllerRealtimeEnabled) {
+    if (controllerRealtimeLockMemory && mlockall(MCL_CURRENT | MCL_FUTURE))
+      ROS_WARN("Failed to lock memory: %s", strerror(errno));
+    sem_init(&profilesSemaphore, 0, 0);
+    running = true;
+    outputThread = boost::thread(runOutput);
+    controlThread = boost::thread(runControl);
+  }
+  else
+    controllerTimer = node.createTimer(
+      ros::Duration(1.0/controllerFrequency), updateControl);
+}
+
+void stopNode() {
+  diagnosticsTimer.stop();
+  connectionTimer.stop();
+  controllerTimer.stop();
+  commandsTimer.stop();
+
+  running = false;
+  if (controlThread.joinable())
+    controlThread.join();
+  if (outputThread.joinable()) {
+    outputThread.join();
+    sem_destroy(&profilesSemaphore);
+  }
+
+  commandsSegment.close();
+  profilesSegment.close();
+
+  if (tracer.isEnabled() && !traceFile.empty())
+    tracer.dump(traceFile);
+}
+
+};
+
+#ifdef NARO_NODELET
+namespace naro_fin_ctrl {
+  /** Nodelet running the fin controller in the process of a nodelet manager
+    */
+  class FinControllerNodelet :
+    public nodelet::Nodelet {
+  public:
+    ~FinControllerNodelet() {
+      stopNode();
+    };
+
+    virtual void onInit() {
+      startNode(getPrivateNodeHandle());
+    };
+  };
+};
+
+PLUGINLIB_DECLARE_CLASS(naro_fin_ctrl, fin_controller,
+  naro_fin_ctrl::FinControllerNodelet, nodelet::Nodelet)
+#else
+int main(int argc, char **argv) {
+  ros::init(argc, argv, "fin_controller");
+  ros::NodeHandle node("~");
+
+  startNode(node);
   ros::spin();
+  stopNode();
 
   return 0;
 }
+#endif
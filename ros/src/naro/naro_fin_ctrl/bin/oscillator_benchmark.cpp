@@ -0,0 +1,326 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Ralf Kaestner                                   *
+ *   ralf.kaestner@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <vector>
+#include <algorithm>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "naro_fin_ctrl/oscillator_bank.h"
+#include "naro_fin_ctrl/oscillator_network.h"
+
+using namespace naro_fin_ctrl;
+
+/** Microbenchmark of the fin controller's oscillators
+  *
+  * Compares the scalar per-servo loop of the fin controller with the
+  * vectorized oscillator bank in oscillators per microsecond and reports
+  * the maximum error of the fast sine and cosine over a sweep of 40
+  * revolutions. For the central pattern generator, it reports the cost
+  * per tick of the coupled oscillator network and the number of ticks a
+  * gait transition takes to settle at 200 Hz.
+  */
+
+const float pi2 = 2.0f*M_PI;
+const float controllerFrequency = 25.0f;
+
+struct Parameters {
+  Parameters() :
+    frequency(0.0f),
+    amplitude(0.0f),
+    phase(0.0f),
+    offset(0.0f) {
+  };
+
+  float frequency;
+  float amplitude;
+  float phase;
+  float offset;
+};
+
+struct Servo {
+  bool enabled;
+  float home;
+  Parameters gain;
+  Parameters command;
+  Parameters actual;
+};
+
+double getTime() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+
+  return time.tv_sec+time.tv_nsec*1e-9;
+}
+
+float uniform(float min, float max) {
+  return min+(max-min)*rand()/RAND_MAX;
+}
+
+/** The scalar loop of the fin controller as it was before the oscillator
+  * bank, kept as the reference
+  */
+float runScalar(std::vector<Servo>& servos, std::vector<float>& position,
+    std::vector<float>& speed, size_t numTicks) {
+  float dt = 1.0f/controllerFrequency;
+  float sum = 0.0f;
+
+  for (size_t k = 0; k < numTicks; ++k) {
+    float t_0 = k*dt;
+    float t_2 = t_0+2.0f/controllerFrequency;
+
+    for (size_t i = 0; i < servos.size(); ++i) {
+      Servo& servo = servos[i];
+
+      if (servo.enabled) {
+        servo.actual.frequency += servo.gain.frequency*dt*
+          (servo.command.frequency-servo.actual.frequency);
+        servo.actual.amplitude += servo.gain.amplitude*dt*
+          (servo.command.amplitude-servo.actual.amplitude);
+        servo.actual.phase += servo.gain.phase*dt*
+          (servo.command.phase-servo.actual.phase);
+        servo.actual.offset += servo.gain.offset*dt*
+          (servo.command.offset-servo.actual.offset);
+
+        float omega_i = pi2*servo.actual.frequency;
+        position[i] = servo.home+servo.actual.offset+
+          servo.actual.amplitude*sin(omega_i*t_2+servo.actual.phase);
+        speed[i] = omega_i*servo.actual.amplitude*
+          cos(omega_i*t_0+servo.actual.phase);
+      }
+      else
+        servo.actual = Parameters();
+    }
+
+    sum += position[k % servos.size()];
+  }
+
+  return sum;
+}
+
+float runBank(OscillatorBank& bank, size_t numTicks) {
+  float dt = 1.0f/controllerFrequency;
+  float sum = 0.0f;
+
+  for (size_t k = 0; k < numTicks; ++k) {
+    float t_0 = k*dt;
+    float t_2 = t_0+2.0f/controllerFrequency;
+
+    bank.update(dt, t_2, t_0);
+    sum += bank.position[k % bank.getSize()];
+  }
+
+  return sum;
+}
+
+void initialize(std::vector<Servo>& servos, OscillatorBank& bank) {
+  for (size_t i = 0; i < servos.size(); ++i) {
+    Servo& servo = servos[i];
+
+    servo.enabled = true;
+    servo.home = uniform(-0.5f, 0.5f);
+    servo.gain.frequency = servo.gain.amplitude = servo.gain.phase =
+      servo.gain.offset = 1.0f;
+    servo.command.frequency = uniform(0.1f, 3.0f);
+    servo.command.amplitude = uniform(0.0f, 0.8f);
+    servo.command.phase = uniform(-M_PI, M_PI);
+    servo.command.offset = uniform(-0.2f, 0.2f);
+
+    bank.enabled[i] = 1.0f;
+    bank.home[i] = servo.home;
+    bank.gain.frequency[i] = servo.gain.frequency;
+    bank.gain.amplitude[i] = servo.gain.amplitude;
+    bank.gain.phase[i] = servo.gain.phase;
+    bank.gain.offset[i] = servo.gain.offset;
+    bank.command.frequency[i] = servo.command.frequency;
+    bank.command.amplitude[i] = servo.command.amplitude;
+    bank.command.phase[i] = servo.command.phase;
+    bank.command.offset[i] = servo.command.offset;
+  }
+}
+
+void sweepError(float& sinError, float& cosError) {
+  sinError = cosError = 0.0f;
+
+  for (int i = -4000000; i < 4000000; i += 4) {
+    Vector4f x = {i*1e-5f, (i+1)*1e-5f, (i+2)*1e-5f, (i+3)*1e-5f};
+    Vector4f s = sinRevolutions(x);
+    Vector4f c = cosRevolutions(x);
+
+    for (int j = 0; j < 4; ++j) {
+      double angle = 2.0*M_PI*(double)x[j];
+
+      sinError = std::max(sinError, (float)fabs(s[j]-sin(angle)));
+      cosError = std::max(cosError, (float)fabs(c[j]-cos(angle)));
+    }
+  }
+}
+
+/** Time per tick of the oscillator network with chain coupling, in
+  * microseconds
+  */
+double timeNetwork(size_t size, size_t numTicks) {
+  std::vector<Servo> servos(size);
+  OscillatorBank bank(size);
+  OscillatorNetwork network(size);
+
+  srand(size);
+  initialize(servos, bank);
+  network.setChainCoupling(4.0f);
+
+  float dt = 1.0f/200.0f;
+  float sum = 0.0f;
+
+  double start = getTime();
+  for (size_t k = 0; k < numTicks; ++k) {
+    network.update(bank, dt, 2.0f*dt);
+    sum += network.position[k % size];
+  }
+  double time = getTime()-start;
+
+  return (sum == sum) ? time/numTicks*1e6 : 0.0;
+}
+
+/** Switch a locked fin of 8 servos from a standing to a traveling wave at
+  * 200 Hz and count the ticks until the network has settled, reporting the
+  * largest position step of a servo between two ticks
+  */
+size_t runTransition(float& maxStep) {
+  size_t size = 8;
+  float dt = 1.0f/200.0f;
+  float weight = 4.0f;
+
+  OscillatorBank bank(size);
+  OscillatorNetwork network(size);
+  network.setChainCoupling(weight);
+
+  for (size_t i = 0; i < size; ++i) {
+    bank.enabled[i] = 1.0f;
+    bank.command.frequency[i] = 1.0f;
+    bank.command.amplitude[i] = 0.5f;
+  }
+  for (size_t k = 0; k < 2000; ++k)
+    network.update(bank, dt, 2.0f*dt);
+
+  for (size_t i = 0; i < size; ++i)
+    bank.command.phase[i] = 2.0f*M_PI*i/size;
+
+  std::vector<float> position(network.position, network.position+size);
+  maxStep = 0.0f;
+
+  for (size_t k = 1; k < 20000; ++k) {
+    network.update(bank, dt, 2.0f*dt);
+
+    float maxLag = 0.0f;
+    for (size_t i = 0; i < size; ++i) {
+      maxLag = std::max(maxLag, (float)fabs(network.lag[i]));
+      maxStep = std::max(maxStep, (float)fabs(network.position[i]-
+        position[i]));
+      position[i] = network.position[i];
+    }
+
+    if (maxLag < 0.01f)
+      return k;
+  }
+
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  size_t sizes[] = {8, 32, 128, 512, 2048};
+  size_t numOscillatorTicks = 1 << 24;
+  size_t numErrorTicks = 1000;
+
+  float sinError, cosError;
+  sweepError(sinError, cosError);
+  printf("Fast sine error:   %.2e\n", sinError);
+  printf("Fast cosine error: %.2e\n\n", cosError);
+
+  printf("%12s %16s %16s %10s %12s\n", "Oscillators", "Scalar [1/us]",
+    "Bank [1/us]", "Speedup", "Max error");
+
+  for (size_t n = 0; n < sizeof(sizes)/sizeof(sizes[0]); ++n) {
+    size_t size = sizes[n];
+    size_t numTicks = numOscillatorTicks/size;
+
+    std::vector<Servo> servos(size);
+    std::vector<float> position(size), speed(size);
+    OscillatorBank bank(size);
+
+    srand(size);
+    initialize(servos, bank);
+
+    double start = getTime();
+    float scalarSum = runScalar(servos, position, speed, numTicks);
+    double scalarTime = getTime()-start;
+
+    start = getTime();
+    float bankSum = runBank(bank, numTicks);
+    double bankTime = getTime()-start;
+
+    /** Positions are compared after a short run, as the float time
+      * arguments of both loops lose precision over long runs
+      */
+    std::vector<Servo> referenceServos(size);
+    OscillatorBank referenceBank(size);
+
+    srand(size);
+    initialize(referenceServos, referenceBank);
+    runScalar(referenceServos, position, speed, numErrorTicks);
+    runBank(referenceBank, numErrorTicks);
+
+    float error = 0.0f;
+    for (size_t i = 0; i < size; ++i)
+      error = std::max(error, (float)fabs(position[i]-
+        referenceBank.position[i]));
+
+    double scalarRate = numOscillatorTicks/(scalarTime*1e6);
+    double bankRate = numOscillatorTicks/(bankTime*1e6);
+
+    printf("%12lu %16.1f %16.1f %9.1fx %12.2e\n", (unsigned long)size,
+      scalarRate, bankRate, bankRate/scalarRate, error);
+
+    if (scalarSum != scalarSum || bankSum != bankSum)
+      return 1;
+  }
+
+  printf("\n%12s %16s %16s\n", "Oscillators", "Network [us]",
+    "Load at 200 Hz");
+
+  for (size_t n = 0; n < sizeof(sizes)/sizeof(sizes[0]); ++n) {
+    size_t size = sizes[n];
+    double time = timeNetwork(size, std::max<size_t>(numOscillatorTicks/
+      (size*size), 100));
+
+    printf("%12lu %16.2f %15.2f%%\n", (unsigned long)size, time,
+      time*200.0*1e-4);
+  }
+
+  float maxStep;
+  size_t numTransitionTicks = runTransition(maxStep);
+  printf("\nGait transition settled to 1%% after %lu tick(s) at 200 Hz\n",
+    (unsigned long)numTransitionTicks);
+  printf("Largest position step between ticks: %.4f rad\n", maxStep);
+
+  return 0;
+}
@@ -0,0 +1,261 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Ralf Kaestner                                   *
+ *   ralf.kaestner@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef NARO_FIN_CTRL_OSCILLATOR_BANK_H
+#define NARO_FIN_CTRL_OSCILLATOR_BANK_H
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace naro_fin_ctrl {
+  /** Packed single-precision vector of the width of an SSE or NEON register
+    *
+    * The operators of GCC's generic vectors compile to SSE instructions on
+    * x86 and to NEON instructions on ARM targets providing them, and to
+    * scalar code elsewhere.
+    */
+  typedef float Vector4f __attribute__((vector_size(16)));
+  typedef int Vector4i __attribute__((vector_size(16)));
+
+  inline Vector4f broadcast(float value) {
+    Vector4f vector = {value, value, value, value};
+    return vector;
+  };
+
+  inline Vector4i broadcast(int value) {
+    Vector4i vector = {value, value, value, value};
+    return vector;
+  };
+
+  /** Reduce four angles given in revolutions to half a revolution around
+    * zero
+    *
+    * The angles must be less than 2^22 revolutions in magnitude. The
+    * rounding relies on strict IEEE arithmetic and breaks under
+    * -ffast-math.
+    */
+  inline Vector4f wrapRevolutions(const Vector4f& x) {
+    const Vector4f round = broadcast(12582912.0f);
+    return x-((x+round)-round);
+  };
+
+  inline Vector4f absolute(const Vector4f& x) {
+    return (Vector4f)((Vector4i)x & broadcast(0x7fffffff));
+  };
+
+  /** Sine of four angles given in revolutions
+    *
+    * The angles are reduced to a quarter revolution by symmetry and the
+    * sine is approximated by its Taylor polynomial of degree 9. The absolute
+    * error is below 4e-6 plus rounding for angles within the range of
+    * wrapRevolutions().
+    */
+  inline Vector4f sinRevolutions(const Vector4f& x) {
+    const Vector4i sign = broadcast(int(0x80000000));
+
+    Vector4f y = wrapRevolutions(x);
+    Vector4f z = broadcast(float(2.0*M_PI))*(broadcast(0.25f)-
+      absolute(absolute(y)-broadcast(0.25f)));
+    Vector4f z2 = z*z;
+
+    Vector4f p = broadcast(1.0f/362880.0f);
+    p = p*z2-broadcast(1.0f/5040.0f);
+    p = p*z2+broadcast(1.0f/120.0f);
+    p = p*z2-broadcast(1.0f/6.0f);
+    p = (p*z2+broadcast(1.0f))*z;
+
+    return (Vector4f)((Vector4i)p | ((Vector4i)y & sign));
+  };
+
+  /** Cosine of four angles given in revolutions, with the error bound of
+    * sinRevolutions()
+    *
+    * The quarter revolution shift is applied after the reduction, where it
+    * is exact, since shifting large angles would round them by up to half
+    * an ulp of the angle.
+    */
+  inline Vector4f cosRevolutions(const Vector4f& x) {
+    return sinRevolutions(wrapRevolutions(x)+broadcast(0.25f));
+  };
+
+  /** Bank of sinusoidal oscillators stored as a structure of arrays
+    *
+    * Each oscillator tracks its commanded frequency, amplitude, phase and
+    * offset through a first-order lag and yields the position and speed
+    * of its sinusoid. All parameters live in separate arrays, padded to
+    * the vector width and aligned to 16 bytes, such that a single update
+    * processes four oscillators per instruction. Padding oscillators are
+    * disabled and remain at rest.
+    */
+  class OscillatorBank {
+  public:
+    static const size_t width = 4;
+
+    /** Parameter arrays of the oscillators, phases are in radians
+      */
+    struct Parameters {
+      float* frequency;
+      float* amplitude;
+      float* phase;
+      float* offset;
+    };
+
+    OscillatorBank(size_t size = 0) :
+      size(0),
+      capacity(0),
+      data(0) {
+      resize(size);
+    };
+
+    ~OscillatorBank() {
+      free(data);
+    };
+
+    size_t getSize() const {
+      return size;
+    };
+
+    /** Resize the bank, which resets all oscillators
+      */
+    void resize(size_t size) {
+      free(data);
+      data = 0;
+
+      this->size = size;
+      capacity = (size+width-1)/width*width;
+
+      if (capacity) {
+        void* address = 0;
+        if (posix_memalign(&address, sizeof(Vector4f), numArrays*capacity*
+            sizeof(float)))
+          address = 0;
+        data = static_cast<float*>(address);
+      }
+
+      if (!data)
+        this->size = capacity = 0;
+
+      enabled = array(0);
+      home = array(1);
+      gain = parameters(2);
+      command = parameters(6);
+      actual = parameters(10);
+      position = array(14);
+      speed = array(15);
+
+      reset();
+    };
+
+    /** Clear all oscillators, which leaves them disabled and at rest
+      */
+    void reset() {
+      if (data)
+        memset(data, 0, numArrays*capacity*sizeof(float));
+    };
+
+    /** Advance the actual parameters by a time step and evaluate the
+      * position of each oscillator at time t_position and its speed at
+      * time t_speed
+      *
+      * Disabled oscillators are reset to zero parameters.
+      */
+    void update(float dt, float t_position, float t_speed) {
+      const Vector4f vdt = broadcast(dt);
+      const Vector4f vt_position = broadcast(t_position);
+      const Vector4f vt_speed = broadcast(t_speed);
+      const Vector4f revolution = broadcast(float(0.5/M_PI));
+      const Vector4f pi2 = broadcast(float(2.0*M_PI));
+
+      for (size_t i = 0; i < capacity; i += width) {
+        Vector4f e = load(enabled, i);
+
+        Vector4f f = step(gain.frequency, command.frequency,
+          actual.frequency, i, vdt, e);
+        Vector4f a = step(gain.amplitude, command.amplitude,
+          actual.amplitude, i, vdt, e);
+        Vector4f p = step(gain.phase, command.phase,
+          actual.phase, i, vdt, e)*revolution;
+        Vector4f o = step(gain.offset, command.offset,
+          actual.offset, i, vdt, e);
+
+        store(position, i, load(home, i)+o+a*sinRevolutions(f*vt_position+
+          p));
+        store(speed, i, pi2*f*a*cosRevolutions(f*vt_speed+p));
+      }
+    };
+
+    float* enabled;
+    float* home;
+    Parameters gain;
+    Parameters command;
+    Parameters actual;
+    float* position;
+    float* speed;
+
+  private:
+    static const size_t numArrays = 16;
+
+    OscillatorBank(const OscillatorBank&);
+    OscillatorBank& operator=(const OscillatorBank&);
+
+    float* array(size_t index) const {
+      return data ? data+index*capacity : 0;
+    };
+
+    Parameters parameters(size_t index) const {
+      Parameters parameters;
+
+      parameters.frequency = array(index);
+      parameters.amplitude = array(index+1);
+      parameters.phase = array(index+2);
+      parameters.offset = array(index+3);
+
+      return parameters;
+    };
+
+    static Vector4f load(const float* array, size_t i) {
+      return *reinterpret_cast<const Vector4f*>(array+i);
+    };
+
+    static void store(float* array, size_t i, const Vector4f& vector) {
+      *reinterpret_cast<Vector4f*>(array+i) = vector;
+    };
+
+    /** First-order update of one parameter of four oscillators, masked
+      * by their enabled flags
+      */
+    static Vector4f step(const float* gain, const float* command, float*
+        actual, size_t i, const Vector4f& dt, const Vector4f& enabled) {
+      Vector4f x = load(actual, i);
+
+      x = (x+load(gain, i)*dt*(load(command, i)-x))*enabled;
+      store(actual, i, x);
+
+      return x;
+    };
+
+    size_t size;
+    size_t capacity;
+    float* data;
+  };
+};
+
+#endif
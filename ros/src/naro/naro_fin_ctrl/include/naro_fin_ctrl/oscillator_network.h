@@ -0,0 +1,299 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Ralf Kaestner                                   *
+ *   ralf.kaestner@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef NARO_FIN_CTRL_OSCILLATOR_NETWORK_H
+#define NARO_FIN_CTRL_OSCILLATOR_NETWORK_H
+
+#include "naro_fin_ctrl/oscillator_bank.h"
+
+namespace naro_fin_ctrl {
+  /** Central pattern generator made of coupled phase oscillators
+    *
+    * The phase of each oscillator is integrated incrementally, such that
+    * commanded phase changes never cause discontinuities. Oscillators are
+    * pulled towards their commanded phase differences by Kuramoto coupling
+    *
+    *   dtheta_i/dt = f_i+sum_j w_ij/(2pi)*sin(2pi*(psi_j-psi_i)),
+    *
+    * where phases are in revolutions, psi_i is the phase of oscillator i
+    * minus its commanded phase and w_ij are the weights of the coupling
+    * matrix in 1/s. For small phase errors, a symmetric pair locks at the
+    * rate w_ij+w_ji. Frequency, amplitude and offset follow their commands
+    * as critically damped second-order systems, integrated exactly, which
+    * settle to 1% within 6.64/convergence seconds regardless of the time
+    * step.
+    *
+    * The network shares its commands with an oscillator bank. Its cost per
+    * update is dominated by the dense coupling matrix and grows with the
+    * square of the number of oscillators.
+    */
+  class OscillatorNetwork {
+  public:
+    static const size_t width = OscillatorBank::width;
+
+    OscillatorNetwork(size_t size = 0) :
+      convergence(10.0f),
+      coherence(0.0f),
+      size(0),
+      capacity(0),
+      data(0) {
+      resize(size);
+    };
+
+    ~OscillatorNetwork() {
+      free(data);
+    };
+
+    size_t getSize() const {
+      return size;
+    };
+
+    /** Resize the network, which resets all oscillators and removes all
+      * couplings
+      */
+    void resize(size_t size) {
+      free(data);
+      data = 0;
+
+      this->size = size;
+      capacity = (size+width-1)/width*width;
+
+      if (capacity) {
+        void* address = 0;
+        if (posix_memalign(&address, sizeof(Vector4f), (numArrays+capacity)*
+            capacity*sizeof(float)))
+          address = 0;
+        data = static_cast<float*>(address);
+      }
+
+      if (!data)
+        this->size = capacity = 0;
+
+      frequency = array(0);
+      frequencyRate = array(1);
+      amplitude = array(2);
+      amplitudeRate = array(3);
+      offset = array(4);
+      offsetRate = array(5);
+      phase = array(6);
+      phaseRate = array(7);
+      lag = array(8);
+      position = array(9);
+      speed = array(10);
+      error = array(11);
+      coupling = array(numArrays);
+
+      if (data)
+        memset(data, 0, (numArrays+capacity)*capacity*sizeof(float));
+      coherence = 0.0f;
+    };
+
+    /** Reset all oscillators to rest, keeping the couplings
+      */
+    void reset() {
+      if (data)
+        memset(data, 0, numArrays*capacity*sizeof(float));
+      coherence = 0.0f;
+    };
+
+    float getConvergence() const {
+      return convergence;
+    };
+
+    /** Set the convergence rate of frequency, amplitude and offset in 1/s
+      */
+    void setConvergence(float convergence) {
+      this->convergence = convergence;
+    };
+
+    /** Time in seconds after which a step in frequency, amplitude or offset
+      * has settled to 1%
+      */
+    float getSettlingTime() const {
+      return convergence > 0.0f ? 6.64f/convergence : 0.0f;
+    };
+
+    float getCoupling(size_t i, size_t j) const {
+      return coupling[i*capacity+j];
+    };
+
+    /** Set the weight in 1/s at which oscillator i is pulled towards
+      * oscillator j
+      */
+    void setCoupling(size_t i, size_t j, float weight) {
+      coupling[i*capacity+j] = weight;
+    };
+
+    /** Couple each oscillator symmetrically to its neighbors, which is the
+      * usual topology of a fin
+      */
+    void setChainCoupling(float weight) {
+      memset(coupling, 0, capacity*capacity*sizeof(float));
+
+      for (size_t i = 0; i+1 < size; ++i) {
+        setCoupling(i, i+1, weight);
+        setCoupling(i+1, i, weight);
+      }
+    };
+
+    /** Synchronization of all enabled oscillators with respect to their
+      * commanded phases, ranging from zero to one when fully locked
+      */
+    float getCoherence() const {
+      return coherence;
+    };
+
+    /** Advance the network by a time step, using the enabled flags, homes
+      * and commands of the given bank, and evaluate the position of each
+      * oscillator the given lead time ahead and its current speed
+      *
+      * The bank must be of the same size as the network.
+      * Disabled oscillators are reset to rest and do not couple.
+      */
+    void update(const OscillatorBank& bank, float dt, float lead) {
+      const Vector4f vdt = broadcast(dt);
+      const Vector4f vlead = broadcast(lead);
+      const Vector4f lambda = broadcast(convergence);
+      const Vector4f decay = broadcast(expf(-convergence*dt));
+      const Vector4f revolution = broadcast(float(0.5/M_PI));
+
+      Vector4f sumCos = broadcast(0.0f);
+      Vector4f sumSin = broadcast(0.0f);
+      Vector4f numEnabled = broadcast(0.0f);
+
+      for (size_t i = 0; i < capacity; i += width) {
+        Vector4f e = load(bank.enabled, i);
+
+        settle(bank.command.frequency, frequency, frequencyRate, i, vdt,
+          lambda, decay, e);
+        settle(bank.command.amplitude, amplitude, amplitudeRate, i, vdt,
+          lambda, decay, e);
+        settle(bank.command.offset, offset, offsetRate, i, vdt,
+          lambda, decay, e);
+
+        Vector4f psi = wrapRevolutions(load(phase, i)-
+          load(bank.command.phase, i)*revolution)*e;
+        store(error, i, psi);
+
+        sumCos += cosRevolutions(psi)*e;
+        sumSin += sinRevolutions(psi)*e;
+        numEnabled += e;
+      }
+
+      for (size_t i = 0; i < size; ++i) {
+        const float* weights = coupling+i*capacity;
+        Vector4f psi_i = broadcast(error[i]);
+        Vector4f sum = broadcast(0.0f);
+
+        for (size_t j = 0; j < capacity; j += width)
+          sum += load(weights, j)*load(bank.enabled, j)*
+            sinRevolutions(load(error, j)-psi_i);
+
+        phaseRate[i] = (frequency[i]+(sum[0]+sum[1]+sum[2]+sum[3])*
+          float(0.5/M_PI))*bank.enabled[i];
+      }
+
+      float c = sumCos[0]+sumCos[1]+sumCos[2]+sumCos[3];
+      float s = sumSin[0]+sumSin[1]+sumSin[2]+sumSin[3];
+      float n = numEnabled[0]+numEnabled[1]+numEnabled[2]+numEnabled[3];
+      Vector4f mean = broadcast(float(atan2(s, c)*0.5/M_PI));
+      coherence = (n > 0.0f) ? sqrtf(c*c+s*s)/n : 0.0f;
+
+      const Vector4f pi2 = broadcast(float(2.0*M_PI));
+
+      for (size_t i = 0; i < capacity; i += width) {
+        Vector4f e = load(bank.enabled, i);
+        Vector4f rate = load(phaseRate, i);
+        Vector4f theta = wrapRevolutions(load(phase, i)+rate*vdt)*e;
+        Vector4f a = load(amplitude, i);
+
+        store(phase, i, theta);
+        store(lag, i, wrapRevolutions(load(error, i)-mean)*e);
+        store(position, i, load(bank.home, i)+load(offset, i)+
+          a*sinRevolutions(theta+rate*vlead));
+        store(speed, i, load(offsetRate, i)+load(amplitudeRate, i)*
+          sinRevolutions(theta)+pi2*rate*a*cosRevolutions(theta));
+      }
+    };
+
+    /** States of the oscillators, phases are in revolutions
+      */
+    float* frequency;
+    float* frequencyRate;
+    float* amplitude;
+    float* amplitudeRate;
+    float* offset;
+    float* offsetRate;
+    float* phase;
+    float* phaseRate;
+
+    /** Phase of each oscillator relative to its commanded phase and the
+      * mean of all enabled oscillators, in revolutions
+      */
+    float* lag;
+
+    float* position;
+    float* speed;
+
+  private:
+    static const size_t numArrays = 12;
+
+    OscillatorNetwork(const OscillatorNetwork&);
+    OscillatorNetwork& operator=(const OscillatorNetwork&);
+
+    float* array(size_t index) const {
+      return data ? data+index*capacity : 0;
+    };
+
+    static Vector4f load(const float* array, size_t i) {
+      return *reinterpret_cast<const Vector4f*>(array+i);
+    };
+
+    static void store(float* array, size_t i, const Vector4f& vector) {
+      *reinterpret_cast<Vector4f*>(array+i) = vector;
+    };
+
+    /** Exact step of a critically damped second-order system with poles
+      * at -lambda towards its command, masked by the enabled flags
+      */
+    static void settle(const float* command, float* value, float* rate,
+        size_t i, const Vector4f& dt, const Vector4f& lambda, const
+        Vector4f& decay, const Vector4f& enabled) {
+      Vector4f x = load(command, i);
+      Vector4f e = load(value, i)-x;
+      Vector4f v = load(rate, i);
+      Vector4f w = (v+lambda*e)*dt;
+
+      store(value, i, (x+(e+w)*decay)*enabled);
+      store(rate, i, (v-lambda*w)*decay*enabled);
+    };
+
+    float convergence;
+    float coherence;
+
+    size_t size;
+    size_t capacity;
+    float* data;
+    float* error;
+    float* coupling;
+  };
+};
+
+#endif
@@ -25,6 +25,11 @@
 #include <diagnostic_updater/diagnostic_updater.h>
 #include <diagnostic_updater/update_functions.h>
 
+#ifdef NARO_NODELET
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#endif
+
 #include "naro_blinkm_srvs/FadeToColor.h"
 
 #include "naro_led_ctrl/GetEnabled.h"
@@ -38,12 +43,15 @@
 using namespace naro_led_ctrl;
 using namespace naro_blinkm_srvs;
 
+namespace {
+
 std::string blinkmServerName = "blinkm_server";
 double connectionRetry = 0.1;
 double controllerFrequency = 1.0;
 float defaultColor[] = {1.0f, 1.0f, 1.0f};
 
 boost::shared_ptr<diagnostic_updater::Updater> updater;
+boost::shared_ptr<ros::NodeHandle> nodeHandle;
 boost::shared_ptr<diagnostic_updater::FrequencyStatus> diagnoseFrequency;
 
 ros::ServiceClient fadeToColorClient;
@@ -56,6 +64,9 @@ ros::ServiceServer setCommandService;
 ros::ServiceServer enableService;
 ros::ServiceServer disableService;
 
+ros::Timer diagnosticsTimer;
+ros::Timer controllerTimer;
+
 class Controller {
 public:
   class Parameters {
@@ -213,7 +224,7 @@ void updateDiagnostics(const ros::TimerEvent& event) {
 
 void tryConnect(const ros::TimerEvent& event = ros::TimerEvent()) {
   if (!fadeToColorClient) {
-    fadeToColorClient = ros::NodeHandle("~").serviceClient<FadeToColor>(
+    fadeToColorClient = nodeHandle->serviceClient<FadeToColor>(
       "/"+blinkmServerName+"/fade_to_color");//, true);
     fadeToDefaultColor();
   }
@@ -256,11 +267,13 @@ void updateControl(const ros::TimerEvent& event) {
     diagnoseFrequency->tick();
 }
 
-int main(int argc, char **argv) {
-  ros::init(argc, argv, "led_controller");
-  ros::NodeHandle node("~");
-
-  updater.reset(new diagnostic_updater::Updater());
+/** Advertise the services and start the timers of the LED controller under
+  * the given private node handle
+  */
+void startNode(ros::NodeHandle& node) {
+  nodeHandle.reset(new ros::NodeHandle(node));
+  updater.reset(new diagnostic_updater::Updater(ros::NodeHandle(), node,
+    node.getNamespace()));
   updater->setHardwareID("none");
 
   updater->add("Connections", diagnoseConnections);
@@ -281,16 +294,51 @@ int main(int argc, char **argv) {
   enableService = node.advertiseService("enable", enable);
   disableService = node.advertiseService("disable", disable);
 
-  ros::Timer diagnosticsTimer = node.createTimer(
+  diagnosticsTimer = node.createTimer(
     ros::Duration(1.0), updateDiagnostics);
   //ros::Timer connectionTimer = node.createTimer(
     //ros::Duration(connectionRetry), tryConnect);
-  ros::Timer controllerTimer = node.createTimer(
+  controllerTimer = node.createTimer(
     ros::Duration(1.0/controllerFrequency), updateControl);
 
   tryConnect();
+}
+
+void stopNode() {
+  diagnosticsTimer.stop();
+  controllerTimer.stop();
+}
+
+};
+
+#ifdef NARO_NODELET
+namespace naro_led_ctrl {
+  /** Nodelet running the LED controller in the process of a nodelet manager
+    */
+  class LedControllerNodelet :
+    public nodelet::Nodelet {
+  public:
+    ~LedControllerNodelet() {
+      stopNode();
+    };
+
+    virtual void onInit() {
+      startNode(getPrivateNodeHandle());
+    };
+  };
+};
+
+PLUGINLIB_DECLARE_CLASS(naro_led_ctrl, led_controller,
+  naro_led_ctrl::LedControllerNodelet, nodelet::Nodelet)
+#else
+int main(int argc, char **argv) {
+  ros::init(argc, argv, "led_controller");
+  ros::NodeHandle node("~");
 
+  startNode(node);
   ros::spin();
+  stopNode();
 
   return 0;
 }
+#endif
@@ -0,0 +1,132 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Ralf Kaestner                                   *
+ *   ralf.kaestner@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#include <vector>
+#include <algorithm>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "naro_sensor_srvs/pressure_model.h"
+
+using namespace naro_sensor_srvs;
+
+/** Microbenchmark of the depth sensor's voltage conversions
+  *
+  * Compares the cost of converting a voltage into pressure, depth and
+  * elevation by the model with the cost of the lookup table, for voltages
+  * on the ADC codes and for filtered voltages between them. Reports the
+  * maximum deviation of the table and of the single-precision model from
+  * the model evaluated in double precision.
+  */
+
+const size_t numVoltages = 1 << 16;
+const size_t numRounds = 256;
+
+double getTime() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+
+  return time.tv_sec+time.tv_nsec*1e-9;
+}
+
+double timeModel(const PressureModel& model, const std::vector<float>&
+    voltages) {
+  float sum = 0.0f;
+
+  double start = getTime();
+  for (size_t k = 0; k < numRounds; ++k)
+    for (size_t i = 0; i < voltages.size(); ++i)
+      sum += model.voltageToPressure(voltages[i])+
+        model.voltageToDepth(voltages[i])+
+        model.voltageToElevation(voltages[i]);
+  double time = getTime()-start;
+
+  return (sum == sum) ? time/(numRounds*voltages.size())*1e9 : 0.0;
+}
+
+double timeTable(const ConversionTable& table, const std::vector<float>&
+    voltages) {
+  float sum = 0.0f;
+
+  double start = getTime();
+  for (size_t k = 0; k < numRounds; ++k)
+    for (size_t i = 0; i < voltages.size(); ++i) {
+      ConversionTable::Entry entry = table.convert(voltages[i]);
+      sum += entry.pressure+entry.depth+entry.elevation;
+    }
+  double time = getTime()-start;
+
+  return (sum == sum) ? time/(numRounds*voltages.size())*1e9 : 0.0;
+}
+
+int main(int argc, char** argv) {
+  PressureModel model;
+  ConversionTable table;
+  table.build(model);
+
+  std::vector<float> codes(numVoltages), filtered(numVoltages);
+  srand(0);
+  for (size_t i = 0; i < numVoltages; ++i) {
+    codes[i] = (rand() % ConversionTable::numCodes)*5.0f/1023.0f;
+    filtered[i] = 5.0f*rand()/RAND_MAX;
+  }
+
+  printf("%-20s %12s %12s %10s\n", "Voltages", "Model [ns]", "Table [ns]",
+    "Speedup");
+
+  double modelTime = timeModel(model, codes);
+  double tableTime = timeTable(table, codes);
+  printf("%-20s %12.2f %12.2f %9.1fx\n", "on codes", modelTime, tableTime,
+    modelTime/tableTime);
+
+  modelTime = timeModel(model, filtered);
+  tableTime = timeTable(table, filtered);
+  printf("%-20s %12.2f %12.2f %9.1fx\n", "between codes", modelTime,
+    tableTime, modelTime/tableTime);
+
+  double pressureError = 0.0, depthError = 0.0, elevationError = 0.0;
+  double modelElevationError = 0.0;
+  for (size_t i = 0; i < numVoltages; ++i) {
+    double voltage = filtered[i];
+    double pressure = (voltage/model.inputVoltage-model.transferOffset)/
+      model.transferCoefficient;
+    double depth = (pressure-model.standardAtmosphere)/model.meterSeaWater;
+    double elevation = -(log(pressure)-log(model.standardAtmosphere))*
+      model.barometricConstant;
+
+    ConversionTable::Entry entry = table.convert(filtered[i]);
+    pressureError = std::max(pressureError, fabs(entry.pressure-pressure));
+    depthError = std::max(depthError, fabs(entry.depth-depth));
+    elevationError = std::max(elevationError, fabs(entry.elevation-
+      elevation));
+    modelElevationError = std::max(modelElevationError, fabs(
+      model.voltageToElevation(filtered[i])-elevation));
+  }
+
+  printf("\nMax table error: pressure %.3f Pa, depth %.2e m, "
+    "elevation %.2e m\n", pressureError, depthError, elevationError);
+  printf("Max model error:  elevation %.2e m\n", modelElevationError);
+
+  return 0;
+}
@@ -0,0 +1,129 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Ralf Kaestner                                   *
+ *   ralf.kaestner@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "naro_sensor_srvs/filters.h"
+
+using namespace naro_sensor_srvs;
+
+/** Microbenchmark of the depth sensor's oversampling decimation
+  *
+  * Feeds a slowly varying pressure signal disturbed by white noise and
+  * quantized to 10 bits, as read from the USC, through the CIC decimator
+  * and its FIR compensator for a range of decimation factors. Reports the
+  * effective bits gained over the raw samples, derived from the RMS error
+  * against the noise-free signal, next to the half bit per halving of the
+  * rate a boxcar average gains, and the CPU cost per output sample.
+  */
+
+const double inputFrequency = 1000.0;
+const double signalFrequency = 0.2;
+const double signalOffset = 500.0;
+const double signalAmplitude = 50.0;
+const double noise = 1.5;
+const size_t numInputs = 1 << 22;
+const size_t order = 3;
+
+double getTime() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+
+  return time.tv_sec+time.tv_nsec*1e-9;
+}
+
+double gaussian() {
+  double u = (rand()+1.0)/(RAND_MAX+2.0);
+  double v = (rand()+1.0)/(RAND_MAX+2.0);
+
+  return sqrt(-2.0*log(u))*cos(2.0*M_PI*v);
+}
+
+double getSignal(double sample) {
+  return signalOffset+signalAmplitude*sin(2.0*M_PI*signalFrequency*
+    sample/inputFrequency);
+}
+
+int main(int argc, char** argv) {
+  size_t decimations[] = {1, 4, 8, 16, 32, 64};
+
+  std::vector<int> samples(numInputs);
+  double rawError = 0.0;
+
+  srand(0);
+  for (size_t k = 0; k < numInputs; ++k) {
+    double value = getSignal(k)+noise*gaussian();
+
+    samples[k] = (int)floor(value+0.5);
+    rawError += (samples[k]-getSignal(k))*(samples[k]-getSignal(k));
+  }
+  rawError = sqrt(rawError/numInputs);
+
+  printf("Input at %.0f Hz, RMS error %.3f LSB\n\n", inputFrequency,
+    rawError);
+  printf("%10s %12s %14s %12s %12s %14s\n", "Decimation", "Output [Hz]",
+    "RMS error", "Bits gained", "Boxcar bits", "Output [ns]");
+
+  for (size_t n = 0; n < sizeof(decimations)/sizeof(decimations[0]); ++n) {
+    size_t decimation = decimations[n];
+    CicDecimator cic(decimation, order);
+    FirFilter fir(FirFilter::getCicCompensator(order));
+
+    /** The compensator delays by one output sample
+      */
+    double delay = cic.getDelay()+decimation;
+    double error = 0.0;
+    size_t numOutputs = 0, numErrors = 0;
+    float sum = 0.0f;
+
+    double start = getTime();
+    for (size_t k = 0; k < numInputs; ++k) {
+      if (cic.update(samples[k])) {
+        float output = fir.update(cic.getOutput());
+        sum += output;
+        ++numOutputs;
+
+        if (cic.isSettled() && fir.isValid() && (k > 4*decimation)) {
+          double e = output-getSignal(k-delay);
+          error += e*e;
+          ++numErrors;
+        }
+      }
+    }
+    double time = getTime()-start;
+    error = sqrt(error/numErrors);
+
+    printf("%10lu %12.1f %10.3f LSB %12.2f %12.2f %14.1f\n",
+      (unsigned long)decimation, inputFrequency/decimation, error,
+      log2(rawError/error), 0.5*log2((double)decimation),
+      time/numOutputs*1e9);
+
+    if (sum != sum)
+      return 1;
+  }
+
+  return 0;
+}
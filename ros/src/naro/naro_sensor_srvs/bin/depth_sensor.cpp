@@ -19,114 +19,226 @@
  ***************************************************************************/
 
 #include <vector>
-#include <deque>
 #include <limits>
 
 #include <ros/ros.h>
 #include <diagnostic_updater/diagnostic_updater.h>
 #include <diagnostic_updater/update_functions.h>
 
+#ifdef NARO_NODELET
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#endif
+
 #include <naro_usc_srvs/GetChannels.h>
 #include <naro_usc_srvs/GetInputs.h>
+#include <naro_usc_srvs/ServoState.h>
+#include <naro_usc_srvs/InputSamples.h>
+
+#include <naro_shm/segment.h>
+#include <naro_shm/frames.h>
 
 #include "naro_sensor_srvs/Calibrate.h"
 #include "naro_sensor_srvs/GetPressure.h"
 #include "naro_sensor_srvs/GetDepth.h"
 #include "naro_sensor_srvs/GetElevation.h"
 
+#include "naro_sensor_srvs/filters.h"
+#include "naro_sensor_srvs/pressure_model.h"
+
 using namespace naro_sensor_srvs;
 using namespace naro_usc_srvs;
 
+namespace {
+
 std::string uscServerName = "usc_server";
 double connectionRetry = 0.1;
-float modelStandardAtmosphere = 101325.0f;
-float modelMeterSeaWater = 9625.0f;
-float modelBarometricConstant = 7990.0f;
 double sensorFrequency = 25.0;
+bool sensorStreaming = true;
 int sensorInputChannel = 11;
-float sensorInputVoltage = 5.0f;
-float sensorTransferCoefficient = 4e-6f;
-float sensorTransferOffset = -0.04f;
+bool sensorLookupTable = false;
+bool sensorOversamplingEnabled = false;
+int sensorOversamplingDecimation = 16;
+int sensorOversamplingOrder = 3;
+std::string filterType = "boxcar";
 int filterWindowSize = 50;
+double filterTimeConstant = 2.0;
+double filterKalmanProcessNoise = 0.5;
+double filterKalmanMeasurementNoise = 0.05;
 int calibrationWindowSize = 100;
+bool sharedMemoryEnabled = false;
 
+/** Subscriptions, timers and clients are created through the handle of
+  * the node or nodelet, whose callback queue also serves its services
+  */
+boost::shared_ptr<ros::NodeHandle> nodeHandle;
 boost::shared_ptr<diagnostic_updater::Updater> updater;
 boost::shared_ptr<diagnostic_updater::FrequencyStatus> diagnoseFrequency;
 
 ros::ServiceClient getChannelsClient;
 ros::ServiceClient getInputsClient;
+ros::Subscriber servoStateSubscriber;
+ros::Subscriber inputSamplesSubscriber;
 
 ros::ServiceServer calibrateService;
 ros::ServiceServer getPressureService;
 ros::ServiceServer getDepthService;
 ros::ServiceServer getElevationService;
 
+ros::Timer diagnosticsTimer;
+ros::Timer connectionTimer;
+ros::Timer sensorTimer;
+
 int input = -1;
-std::vector<float> calibrationReadings;
-size_t calibrationNumReadings = 0;
+boost::shared_ptr<MedianFilter> calibration;
 float depthOffset = 0.0;
-std::deque<float> filterReadings;
-float filterSumReadings = 0.0;
-
-inline float voltageToPressure(float voltage) {
-  return (voltage/sensorInputVoltage-sensorTransferOffset)/
-    sensorTransferCoefficient;
-}
-
-inline float voltageToDepth(float voltage) {
-  return (voltageToPressure(voltage)-modelStandardAtmosphere)/
-    modelMeterSeaWater;
-}
-
-inline float voltageToElevation(float voltage) {
-  return -(logf(voltageToPressure(voltage))-logf(modelStandardAtmosphere))*
-    modelBarometricConstant;
-}
+boost::shared_ptr<Filter> filter;
+ros::Time lastReadingTime;
+
+PressureModel model;
+ConversionTable conversionTable;
+
+/** Conversions of a voltage reading, computed once per acquired reading
+  * such that queries merely copy them
+  */
+class Reading {
+public:
+  Reading() :
+    voltage(std::numeric_limits<float>::quiet_NaN()),
+    pressure(std::numeric_limits<float>::quiet_NaN()),
+    depth(std::numeric_limits<float>::quiet_NaN()),
+    elevation(std::numeric_limits<float>::quiet_NaN()),
+    velocity(std::numeric_limits<float>::quiet_NaN()) {
+  };
+
+  ros::Time stamp;
+  float voltage;                        // [V]
+  float pressure;                       // [Pa]
+  float depth;                          // [m], clamped to the surface
+  float elevation;                      // [m], clamped to sea level
+  float velocity;                       // [m/s], NaN unless estimated
+};
+
+Reading rawReading;
+Reading filteredReading;
+
+CicDecimator decimator;
+FirFilter compensator;
+ros::Time lastSamplesTime;
+uint32_t lastSamplesSequence = 0;
+float samplesPeriod = 0.0f;
+bool samplesContinuous = false;
+unsigned long numSamplesBlocks = 0;
+unsigned long numSamplesDropped = 0;
+float streamVoltage = std::numeric_limits<float>::quiet_NaN();
+ros::Time streamTime;
+ros::Time lastStreamTime;
+
+naro_shm::Segment<naro_shm::ServoState> servoStateSegment;
+naro_shm::Segment<naro_shm::Depth> depthSegment;
+uint32_t servoStateSequence = 0;
 
 void getParameters(const ros::NodeHandle& node) {
   node.param<std::string>("server/usc/name", uscServerName, uscServerName);
   node.param<double>("server/connection/retry", connectionRetry,
     connectionRetry);
 
-  double modelStandardAtmosphere = ::modelStandardAtmosphere;
+  double modelStandardAtmosphere = model.standardAtmosphere;
   node.param<double>("model/standard_atmosphere", modelStandardAtmosphere,
     modelStandardAtmosphere);
-  ::modelStandardAtmosphere = modelStandardAtmosphere;
-  double modelMeterSeaWater = ::modelMeterSeaWater;
+  model.standardAtmosphere = modelStandardAtmosphere;
+  double modelMeterSeaWater = model.meterSeaWater;
   node.param<double>("model/meter_sea_water", modelMeterSeaWater,
     modelMeterSeaWater);
-  ::modelMeterSeaWater = modelMeterSeaWater;
-  double modelBarometricConstant = ::modelBarometricConstant;
+  model.meterSeaWater = modelMeterSeaWater;
+  double modelBarometricConstant = model.barometricConstant;
   node.param<double>("model/barometric_constant", modelBarometricConstant,
     modelBarometricConstant);
-  ::modelBarometricConstant = modelBarometricConstant;
+  model.barometricConstant = modelBarometricConstant;
 
   node.param<double>("sensor/frequency", sensorFrequency, sensorFrequency);
+  node.param<bool>("sensor/streaming", sensorStreaming, sensorStreaming);
   node.param<int>("sensor/input_channel", sensorInputChannel,
     sensorInputChannel);
-  double sensorInputVoltage = ::sensorInputVoltage;
+  double sensorInputVoltage = model.inputVoltage;
   node.param<double>("sensor/input_voltage", sensorInputVoltage,
     sensorInputVoltage);
-  ::sensorInputVoltage = sensorInputVoltage;
-  double sensorTransferCoefficient = ::sensorTransferCoefficient;
+  model.inputVoltage = sensorInputVoltage;
+  double sensorTransferCoefficient = model.transferCoefficient;
   node.param<double>("sensor/transfer_coefficient", sensorTransferCoefficient,
     sensorTransferCoefficient);
-  ::sensorTransferCoefficient = sensorTransferCoefficient;
-  double sensorTransferOffset = ::sensorTransferOffset;
+  model.transferCoefficient = sensorTransferCoefficient;
+  double sensorTransferOffset = model.transferOffset;
   node.param<double>("sensor/transfer_offset", sensorTransferOffset,
     sensorTransferOffset);
-  ::sensorTransferOffset = sensorTransferOffset;
-
+  model.transferOffset = sensorTransferOffset;
+  node.param<bool>("sensor/lookup_table", sensorLookupTable,
+    sensorLookupTable);
+  node.param<bool>("sensor/oversampling/enabled", sensorOversamplingEnabled,
+    sensorOversamplingEnabled);
+  node.param<int>("sensor/oversampling/decimation",
+    sensorOversamplingDecimation, sensorOversamplingDecimation);
+  node.param<int>("sensor/oversampling/order", sensorOversamplingOrder,
+    sensorOversamplingOrder);
+
+  node.param<std::string>("filter/type", filterType, filterType);
   node.param<int>("filter/window_size", filterWindowSize, filterWindowSize);
+  node.param<double>("filter/time_constant", filterTimeConstant,
+    filterTimeConstant);
+  node.param<double>("filter/kalman/process_noise", filterKalmanProcessNoise,
+    filterKalmanProcessNoise);
+  node.param<double>("filter/kalman/measurement_noise",
+    filterKalmanMeasurementNoise, filterKalmanMeasurementNoise);
 
   node.param<int>("calibration/window_size", calibrationWindowSize,
     calibrationWindowSize);
+
+  node.param<bool>("shared_memory/enabled", sharedMemoryEnabled,
+    sharedMemoryEnabled);
+}
+
+/** Create the filter of the input voltage, whose Kalman noise parameters
+  * are given in meters of depth
+  */
+void initializeFilter() {
+  if (filterType == "exponential")
+    filter.reset(new ExponentialFilter(filterTimeConstant));
+  else if (filterType == "median")
+    filter.reset(new MedianFilter(filterWindowSize));
+  else if (filterType == "kalman")
+    filter.reset(new KalmanFilter(filterKalmanProcessNoise*
+      model.getVoltsPerMeter(), filterKalmanMeasurementNoise*
+      model.getVoltsPerMeter()));
+  else {
+    if (filterType != "boxcar")
+      ROS_WARN("Unknown filter type %s, using boxcar filter.",
+        filterType.c_str());
+    filter.reset(new BoxcarFilter(filterWindowSize));
+  }
+}
+
+/** Create the decimation stage of oversampled input blocks, a CIC
+  * decimator followed by the FIR compensator of its passband droop
+  */
+void initializeDecimation() {
+  decimator = CicDecimator(sensorOversamplingDecimation,
+    sensorOversamplingOrder);
+  compensator = FirFilter(FirFilter::getCicCompensator(
+    decimator.getOrder()));
+}
+
+/** Whether readings are currently produced by decimating oversampled
+  * input blocks, which supersede all other sources
+  */
+bool isOversampling() {
+  return sensorOversamplingEnabled && !lastSamplesTime.isZero() &&
+    ((ros::Time::now()-lastSamplesTime).toSec() < 1.0);
 }
 
 void initializeInput() {
   input = -1;
 
-  getChannelsClient = ros::NodeHandle("~").serviceClient<GetChannels>(
+  getChannelsClient = nodeHandle->serviceClient<GetChannels>(
     "/"+uscServerName+"/get_channels");
   GetChannels getChannels;
 
@@ -149,65 +261,74 @@ void initializeInput() {
 }
 
 bool calibrate(Calibrate::Request& request, Calibrate::Response& response) {
-  if (request.window > 0) {
-    calibrationReadings.resize(request.window);
-    calibrationNumReadings = 0;
-  }
+  if (request.window > 0)
+    calibration.reset(new MedianFilter(request.window));
   else
     return false;
 
   return true;
 }
 
+/** Convert a voltage into a reading, by the lookup table if enabled
+  *
+  * NaN voltages, such as those of a filter which has not yet converged,
+  * convert into NaN readings.
+  */
+Reading convertVoltage(float voltage, const ros::Time& stamp) {
+  Reading reading;
+
+  reading.stamp = stamp;
+  reading.voltage = voltage;
+  if (voltage != voltage)
+    return reading;
+
+  if (!conversionTable.isEmpty()) {
+    ConversionTable::Entry entry = conversionTable.convert(voltage);
+
+    reading.pressure = entry.pressure;
+    reading.depth = entry.depth;
+    reading.elevation = entry.elevation;
+  }
+  else {
+    reading.pressure = model.voltageToPressure(voltage);
+    reading.depth = model.voltageToDepth(voltage);
+    reading.elevation = model.voltageToElevation(voltage);
+  }
+
+  reading.depth = fmaxf(0.0f, reading.depth+depthOffset);
+  reading.elevation = fmaxf(0.0f, reading.elevation);
+
+  return reading;
+}
+
 bool getPressure(GetPressure::Request& request, GetPressure::Response&
     response) {
-  if (!filterReadings.empty())
-    response.raw = voltageToPressure(filterReadings.back());
-  else
-    response.raw = std::numeric_limits<float>::quiet_NaN();
-
-  if (filterReadings.size() == filterWindowSize)
-    response.filtered = voltageToPressure(filterSumReadings/filterWindowSize);
-  else
-    response.filtered = std::numeric_limits<float>::quiet_NaN();
+  response.raw = rawReading.pressure;
+  response.filtered = filteredReading.pressure;
 
   return true;
 }
 
 bool getDepth(GetDepth::Request& request, GetDepth::Response& response) {
-  if (!filterReadings.empty())
-    response.raw = fmaxf(0.0f, voltageToDepth(filterReadings.back())+
-      depthOffset);
-  else
-    response.raw = std::numeric_limits<float>::quiet_NaN();
-
-  if (filterReadings.size() == filterWindowSize)
-    response.filtered = fmaxf(0.0f, voltageToDepth(filterSumReadings/
-      filterWindowSize)+depthOffset);
-  else
-    response.filtered = std::numeric_limits<float>::quiet_NaN();
+  response.raw = rawReading.depth;
+  response.filtered = filteredReading.depth;
+  response.velocity = filteredReading.velocity;
+  response.stamp = rawReading.stamp;
 
   return true;
 }
 
 bool getElevation(GetElevation::Request& request, GetElevation::Response&
     response) {
-  if (!filterReadings.empty())
-    response.raw = fmaxf(0.0f, voltageToElevation(filterReadings.back()));
-  else
-    response.raw = std::numeric_limits<float>::quiet_NaN();
-
-  if (filterReadings.size() == filterWindowSize)
-    response.filtered = fmaxf(0.0f, voltageToElevation(filterSumReadings/
-      filterWindowSize));
-  else
-    response.filtered = std::numeric_limits<float>::quiet_NaN();
+  response.raw = rawReading.elevation;
+  response.filtered = filteredReading.elevation;
 
   return true;
 }
 
 void diagnoseConnections(diagnostic_updater::DiagnosticStatusWrapper &status) {
-  if (!getInputsClient)
+  if (!getInputsClient && !(sensorStreaming && servoStateSubscriber) &&
+      !servoStateSegment.isOpen())
     status.summaryf(diagnostic_msgs::DiagnosticStatus::ERROR,
       "Not all required services are connected.");
   else
@@ -224,60 +345,242 @@ void diagnoseInput(diagnostic_updater::DiagnosticStatusWrapper &status) {
       "No input available.");
 }
 
+void diagnoseOversampling(diagnostic_updater::DiagnosticStatusWrapper
+    &status) {
+  if (!sensorOversamplingEnabled)
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "Input oversampling disabled.");
+  else if (isOversampling())
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "Decimating oversampled input by %lu.",
+      (unsigned long)decimator.getDecimation());
+  else
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::WARN,
+      "No oversampled input received.");
+
+  if (sensorOversamplingEnabled) {
+    status.addf("Order", "%lu", (unsigned long)decimator.getOrder());
+    if (samplesPeriod > 0.0f) {
+      status.addf("Input rate", "%.1f Hz", 1.0f/samplesPeriod);
+      status.addf("Output rate", "%.1f Hz", 1.0f/(samplesPeriod*
+        decimator.getDecimation()));
+    }
+    status.addf("Blocks", "%lu", numSamplesBlocks);
+    status.addf("Dropped blocks", "%lu", numSamplesDropped);
+  }
+}
+
+void diagnoseFilter(diagnostic_updater::DiagnosticStatusWrapper &status) {
+  if (filter && filter->isValid())
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "Filter %s converged.", filterType.c_str());
+  else
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::WARN,
+      "Filter %s awaiting readings.", filterType.c_str());
+
+  if (filter && ((filterType == "boxcar") || (filterType == "median")))
+    status.addf("Window size", "%d", filterWindowSize);
+  if (filter && filter->isValid())
+    status.addf("Filtered voltage", "%.4f V", filter->getValue());
+  if (filter && (filter->getRate() == filter->getRate()))
+    status.addf("Velocity", "%.3f m/s", filteredReading.velocity);
+}
+
+void diagnoseCalibration(diagnostic_updater::DiagnosticStatusWrapper
+    &status) {
+  if (!calibration)
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::WARN,
+      "Not calibrated.");
+  else if (calibration->isValid())
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "Calibrated over %lu reading(s).",
+      (unsigned long)calibration->getWindow());
+  else
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::WARN,
+      "Calibrating: %lu of %lu reading(s).",
+      (unsigned long)calibration->getSize(),
+      (unsigned long)calibration->getWindow());
+
+  status.addf("Depth offset", "%.3f m", depthOffset);
+}
+
 void updateDiagnostics(const ros::TimerEvent& event) {
   updater->update();
 }
 
+void receiveServoState(const ServoState::ConstPtr& servoState) {
+  if ((input >= 0) && (input < servoState->voltage.size())) {
+    streamVoltage = servoState->voltage[input];
+    streamTime = servoState->header.stamp;
+  }
+}
+
 void tryConnect(const ros::TimerEvent& event = ros::TimerEvent()) {
   if (input < 0)
     initializeInput();
 
+  if (sharedMemoryEnabled)
+    servoStateSegment.reconnect(naro_shm::getSegmentName("/"+uscServerName,
+      "servo_state"));
+
+  /** The servo state stream is superseded by the shared memory segment
+    */
+  if (servoStateSegment.isOpen())
+    servoStateSubscriber.shutdown();
+  else if (sensorStreaming && !servoStateSubscriber)
+    servoStateSubscriber = nodeHandle->subscribe(
+      "/"+uscServerName+"/servo_state", 1, receiveServoState,
+      ros::TransportHints().tcpNoDelay());
+
   if (!getInputsClient)
-    getInputsClient = ros::NodeHandle("~").serviceClient<GetInputs>(
+    getInputsClient = nodeHandle->serviceClient<GetInputs>(
       "/"+uscServerName+"/get_inputs", true);
 }
 
-void acquireReading(const ros::TimerEvent& event) {
-  if (input < 0)
+/** Calibrate, filter and publish a reading of the input voltage taken at
+  * the given time and the given interval [s] after the previous reading
+  */
+void processReading(float voltage, const ros::Time& time, float dt) {
+  /** The surface is calibrated to the running median of the readings,
+    * updated in O(log n) per reading until the window is full
+    */
+  if (calibration && !calibration->isValid()) {
+    calibration->update(voltage, 0.0f);
+    depthOffset = -model.voltageToDepth(calibration->getValue());
+  }
+
+  lastReadingTime = time;
+
+  filter->update(voltage, dt);
+
+  rawReading = convertVoltage(voltage, time);
+  filteredReading = convertVoltage(filter->isValid() ? filter->getValue() :
+    std::numeric_limits<float>::quiet_NaN(), time);
+  filteredReading.velocity = filter->getRate()/model.getVoltsPerMeter();
+
+  if (depthSegment.isOpen()) {
+    naro_shm::Depth frame;
+
+    frame.stamp = time.toNSec();
+    frame.raw = rawReading.depth;
+    frame.filtered = filteredReading.depth;
+    frame.velocity = filteredReading.velocity;
+
+    depthSegment.write(frame);
+  }
+
+  diagnoseFrequency->tick();
+}
+
+/** Decimate a block of raw input samples from the USC server into
+  * readings
+  *
+  * Readings are stamped with the time of the sample completing them, derived
+  * from the stamp of the last sample and the sample period of the block, and
+  * are one decimated output period apart. A gap in the block sequence breaks
+  * the continuity the decimator relies on, which is then restarted, and the
+  * first reading after it is timed from the previous one.
+  */
+void receiveInputSamples(const InputSamples::ConstPtr& block) {
+  if ((input < 0) || (block->channel != input))
     return;
 
-  GetInputs getInputs;
-  getInputs.request.channels.push_back(input);
-  if (!getInputsClient.call(getInputs))
+  if (lastSamplesSequence && (block->sequence != lastSamplesSequence+1)) {
+    if (block->sequence > lastSamplesSequence)
+      numSamplesDropped += block->sequence-lastSamplesSequence-1;
+
+    decimator.reset();
+    compensator.reset();
+    samplesContinuous = false;
+  }
+  lastSamplesSequence = block->sequence;
+  lastSamplesTime = ros::Time::now();
+  samplesPeriod = block->period;
+  ++numSamplesBlocks;
+
+  float period = block->period*decimator.getDecimation();
+  for (int i = 0; i < block->samples.size(); ++i) {
+    if (decimator.update(block->samples[i])) {
+      float code = compensator.update(decimator.getOutput());
+
+      if (decimator.isSettled() && compensator.isValid()) {
+        ros::Time time = block->header.stamp-ros::Duration(
+          (block->samples.size()-1-i)*block->period);
+        float dt = samplesContinuous ? period : (lastReadingTime.isZero() ?
+          0.0f : (time-lastReadingTime).toSec());
+
+        processReading(code/1023.0f*5.0f, time, dt);
+        samplesContinuous = true;
+      }
+      else
+        samplesContinuous = false;
+    }
+  }
+}
+
+void acquireReading(const ros::TimerEvent& event) {
+  if ((input < 0) || isOversampling())
     return;
 
-  if (calibrationNumReadings < calibrationReadings.size()) {
-    calibrationReadings[calibrationNumReadings] =
-      getInputs.response.voltage[0];
-    ++calibrationNumReadings;
+  float voltage;
+  bool acquired = false;
+
+  /** Prefer a new servo state frame from shared memory, then the streamed
+    * servo state, and fall back to polling the input if no new state has
+    * been received since the last reading
+    */
+  if (servoStateSegment.isOpen() &&
+      (servoStateSegment.getSequence() != servoStateSequence)) {
+    static naro_shm::ServoState frame;
+    uint32_t sequence = servoStateSegment.read(frame);
+
+    if (sequence) {
+      servoStateSequence = sequence;
+
+      if (input < frame.numChannels) {
+        voltage = frame.voltage[input];
+        acquired = true;
+      }
+    }
+  }
 
-    std::nth_element(calibrationReadings.begin(),
-      calibrationReadings.begin()+calibrationNumReadings/2,
-      calibrationReadings.begin()+calibrationNumReadings);
-    depthOffset = -voltageToDepth(
-      calibrationReadings[calibrationNumReadings/2]);
+  if (!acquired && sensorStreaming && !streamTime.isZero() &&
+      (streamTime != lastStreamTime)) {
+    voltage = streamVoltage;
+    lastStreamTime = streamTime;
+    acquired = true;
   }
 
-  if (filterReadings.size() == filterWindowSize) {
-    float reading = filterReadings.front();
-    filterReadings.pop_front();
-    filterSumReadings -= reading;
+  if (!acquired) {
+    GetInputs getInputs;
+    getInputs.request.channels.push_back(input);
+    if (!getInputsClient.call(getInputs))
+      return;
+
+    voltage = getInputs.response.voltage[0];
   }
-  filterReadings.push_back(getInputs.response.voltage[0]);
-  filterSumReadings += getInputs.response.voltage[0];
 
-  diagnoseFrequency->tick();
+  if (voltage == voltage) {
+    ros::Time time = ros::Time::now();
+    processReading(voltage, time, lastReadingTime.isZero() ? 0.0f :
+      (time-lastReadingTime).toSec());
+  }
 }
 
-int main(int argc, char **argv) {
-  ros::init(argc, argv, "depth_sensor");
-  ros::NodeHandle node("~");
-
-  updater.reset(new diagnostic_updater::Updater());
+/** Advertise the services and start the timers of the depth sensor under the
+  * given private node handle
+  */
+void startNode(ros::NodeHandle& node) {
+  nodeHandle.reset(new ros::NodeHandle(node));
+  updater.reset(new diagnostic_updater::Updater(ros::NodeHandle(), node,
+    node.getNamespace()));
   updater->setHardwareID("none");
 
   updater->add("Connections", diagnoseConnections);
   updater->add("Input", diagnoseInput);
+  updater->add("Filter", diagnoseFilter);
+  updater->add("Oversampling", diagnoseOversampling);
+  updater->add("Calibration", diagnoseCalibration);
   diagnoseFrequency.reset(new diagnostic_updater::FrequencyStatus(
     diagnostic_updater::FrequencyStatusParam(&sensorFrequency,
     &sensorFrequency)));
@@ -286,26 +589,77 @@ int main(int argc, char **argv) {
   updater->force_update();
 
   getParameters(node);
+  initializeFilter();
+  initializeDecimation();
+  if (sensorLookupTable)
+    conversionTable.build(model);
 
   calibrateService = node.advertiseService("calibrate", calibrate);
   getPressureService = node.advertiseService("get_pressure", getPressure);
   getDepthService = node.advertiseService("get_depth", getDepth);
   getElevationService = node.advertiseService("get_elevation", getElevation);
 
-  ros::Timer diagnosticsTimer = node.createTimer(
+  diagnosticsTimer = node.createTimer(
     ros::Duration(1.0), updateDiagnostics);
-  ros::Timer connectionTimer = node.createTimer(
+  connectionTimer = node.createTimer(
     ros::Duration(connectionRetry), tryConnect);
-  ros::Timer sensorTimer = node.createTimer(
+  sensorTimer = node.createTimer(
     ros::Duration(1.0/sensorFrequency), acquireReading);
 
+  if (sensorOversamplingEnabled)
+    inputSamplesSubscriber = node.subscribe(
+      "/"+uscServerName+"/input_samples", 10, receiveInputSamples,
+      ros::TransportHints().tcpNoDelay());
+
+  if (sharedMemoryEnabled && !depthSegment.create(
+      naro_shm::getSegmentName(node.getNamespace(), "depth")))
+    ROS_WARN("Failed to create shared memory segment: %s", strerror(errno));
+
   initializeInput();
   tryConnect();
 
-  calibrationReadings.resize(calibrationWindowSize);
-  calibrationNumReadings = 0;
+  if (calibrationWindowSize > 0)
+    calibration.reset(new MedianFilter(calibrationWindowSize));
+}
+
+void stopNode() {
+  diagnosticsTimer.stop();
+  connectionTimer.stop();
+  sensorTimer.stop();
+
+  depthSegment.close();
+}
+
+};
+
+#ifdef NARO_NODELET
+namespace naro_sensor_srvs {
+  /** Nodelet running the depth sensor in the process of a nodelet manager
+    */
+  class DepthSensorNodelet :
+    public nodelet::Nodelet {
+  public:
+    ~DepthSensorNodelet() {
+      stopNode();
+    };
+
+    virtual void onInit() {
+      startNode(getPrivateNodeHandle());
+    };
+  };
+};
+
+PLUGINLIB_DECLARE_CLASS(naro_sensor_srvs, depth_sensor,
+  naro_sensor_srvs::DepthSensorNodelet, nodelet::Nodelet)
+#else
+int main(int argc, char **argv) {
+  ros::init(argc, argv, "depth_sensor");
+  ros::NodeHandle node("~");
 
+  startNode(node);
   ros::spin();
+  stopNode();
 
   return 0;
 }
+#endif
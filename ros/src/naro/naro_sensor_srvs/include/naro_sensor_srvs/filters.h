@@ -0,0 +1,631 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Ralf Kaestner                                   *
+ *   ralf.kaestner@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#ifndef NARO_SENSOR_SRVS_FILTERS_H
+#define NARO_SENSOR_SRVS_FILTERS_H
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+namespace naro_sensor_srvs {
+  /** Ring buffer of fixed capacity, allocated once on construction
+    */
+  template <typename T> class RingBuffer {
+  public:
+    RingBuffer(size_t capacity = 0) :
+      values(capacity),
+      begin(0),
+      size(0) {
+    };
+
+    size_t getCapacity() const {
+      return values.size();
+    };
+
+    size_t getSize() const {
+      return size;
+    };
+
+    bool isEmpty() const {
+      return !size;
+    };
+
+    bool isFull() const {
+      return size == values.size();
+    };
+
+    /** The i-th oldest value
+      */
+    const T& operator[](size_t i) const {
+      return values[(begin+i) % values.size()];
+    };
+
+    const T& front() const {
+      return (*this)[0];
+    };
+
+    const T& back() const {
+      return (*this)[size-1];
+    };
+
+    /** Index of the slot the next value will be pushed into, which holds
+      * the oldest value if the buffer is full
+      */
+    size_t getNextSlot() const {
+      return (begin+size) % values.size();
+    };
+
+    /** Append a value, overwriting the oldest one if the buffer is full
+      */
+    void push(const T& value) {
+      values[getNextSlot()] = value;
+
+      if (size < values.size())
+        ++size;
+      else
+        begin = (begin+1) % values.size();
+    };
+
+    void clear() {
+      begin = size = 0;
+    };
+
+  private:
+    std::vector<T> values;
+    size_t begin;
+    size_t size;
+  };
+
+  /** Sum with Neumaier compensation, which keeps the rounding error of
+    * arbitrarily many additions and subtractions at the order of a single
+    * one
+    */
+  class CompensatedSum {
+  public:
+    CompensatedSum() :
+      sum(0.0),
+      compensation(0.0) {
+    };
+
+    double get() const {
+      return sum+compensation;
+    };
+
+    void add(double value) {
+      double total = sum+value;
+
+      if (fabs(sum) >= fabs(value))
+        compensation += (sum-total)+value;
+      else
+        compensation += (value-total)+sum;
+      sum = total;
+    };
+
+    void subtract(double value) {
+      add(-value);
+    };
+
+    void clear() {
+      sum = compensation = 0.0;
+    };
+
+  private:
+    double sum;
+    double compensation;
+  };
+
+  /** Streaming filter of a scalar signal
+    *
+    * Filters take one sample per update together with the time elapsed
+    * since the previous sample. They allocate all their memory on
+    * construction, such that updates never allocate.
+    */
+  class Filter {
+  public:
+    virtual ~Filter() {
+    };
+
+    virtual void reset() = 0;
+    virtual void update(float value, float dt) = 0;
+
+    /** Whether the filter has seen enough samples to yield a value
+      */
+    virtual bool isValid() const = 0;
+
+    virtual float getValue() const = 0;
+
+    /** Estimated rate of change of the signal per second, which is NaN
+      * for filters not estimating it
+      */
+    virtual float getRate() const {
+      return std::numeric_limits<float>::quiet_NaN();
+    };
+  };
+
+  /** Moving average over a window of samples, in O(1) per sample
+    */
+  class BoxcarFilter :
+    public Filter {
+  public:
+    BoxcarFilter(size_t window) :
+      samples(std::max<size_t>(window, 1)) {
+    };
+
+    void reset() {
+      samples.clear();
+      sum.clear();
+    };
+
+    void update(float value, float dt) {
+      if (samples.isFull())
+        sum.subtract(samples.front());
+
+      samples.push(value);
+      sum.add(value);
+    };
+
+    bool isValid() const {
+      return samples.isFull();
+    };
+
+    float getValue() const {
+      return sum.get()/samples.getCapacity();
+    };
+
+  private:
+    RingBuffer<float> samples;
+    CompensatedSum sum;
+  };
+
+  /** First-order low-pass with the given time constant in seconds, whose
+    * smoothing adapts to irregular sample intervals, in O(1) per sample
+    */
+  class ExponentialFilter :
+    public Filter {
+  public:
+    ExponentialFilter(float timeConstant) :
+      timeConstant(timeConstant),
+      value(0.0f),
+      valid(false) {
+    };
+
+    void reset() {
+      valid = false;
+    };
+
+    void update(float value, float dt) {
+      if (valid && (timeConstant > 0.0f))
+        this->value += (1.0f-expf(-dt/timeConstant))*(value-this->value);
+      else
+        this->value = value;
+
+      valid = true;
+    };
+
+    bool isValid() const {
+      return valid;
+    };
+
+    float getValue() const {
+      return value;
+    };
+
+  private:
+    float timeConstant;
+    float value;
+    bool valid;
+  };
+
+  /** Median over a window of samples, in O(log n) per sample
+    *
+    * The samples of the window are partitioned into a max-heap of the
+    * lower and a min-heap of the upper half, which hold indexes into the
+    * ring of samples. Each slot of the ring tracks its position within
+    * the heaps, such that the oldest sample is replaced in place and only
+    * sifted within its heap. Until the window is full, new samples are
+    * inserted and the median is that of all samples so far.
+    */
+  class MedianFilter :
+    public Filter {
+  public:
+    MedianFilter(size_t window) :
+      values(std::max<size_t>(window, 1)),
+      positions(values.size()),
+      lower(values.size()),
+      upper(values.size()),
+      numLower(0),
+      numUpper(0),
+      next(0) {
+    };
+
+    void reset() {
+      numLower = numUpper = next = 0;
+    };
+
+    size_t getWindow() const {
+      return values.size();
+    };
+
+    size_t getSize() const {
+      return numLower+numUpper;
+    };
+
+    void update(float value, float dt) {
+      size_t size = getSize();
+
+      if (size < values.size()) {
+        size_t slot = (next+size) % values.size();
+        values[slot] = value;
+
+        if (!numLower || (value <= values[lower[0]]))
+          insert(lower, numLower, slot, true);
+        else
+          insert(upper, numUpper, slot, false);
+
+        if (numLower > numUpper+1)
+          move(lower, numLower, true, upper, numUpper, false);
+        else if (numUpper > numLower)
+          move(upper, numUpper, false, lower, numLower, true);
+      }
+      else {
+        size_t slot = next;
+        next = (next+1) % values.size();
+        values[slot] = value;
+
+        int position = positions[slot];
+        if (position < 0)
+          sift(lower, numLower, -position-1, true);
+        else
+          sift(upper, numUpper, position-1, false);
+
+        if (numUpper && (values[lower[0]] > values[upper[0]])) {
+          std::swap(lower[0], upper[0]);
+          positions[lower[0]] = -1;
+          positions[upper[0]] = 1;
+
+          siftDown(lower, numLower, 0, true);
+          siftDown(upper, numUpper, 0, false);
+        }
+      }
+    };
+
+    bool isValid() const {
+      return getSize() == values.size();
+    };
+
+    /** Median of the samples so far, which must not be empty
+      */
+    float getValue() const {
+      if (numLower > numUpper)
+        return values[lower[0]];
+      else
+        return 0.5f*(values[lower[0]]+values[upper[0]]);
+    };
+
+  private:
+    /** Whether the sample in slot a belongs above the one in slot b of a
+      * max-heap, or of a min-heap otherwise
+      */
+    bool isAbove(size_t a, size_t b, bool max) const {
+      return max ? (values[a] > values[b]) : (values[a] < values[b]);
+    };
+
+    void place(std::vector<size_t>& heap, size_t i, size_t slot, bool max) {
+      heap[i] = slot;
+      positions[slot] = max ? -int(i)-1 : int(i)+1;
+    };
+
+    size_t siftUp(std::vector<size_t>& heap, size_t i, bool max) {
+      size_t slot = heap[i];
+
+      while (i) {
+        size_t parent = (i-1)/2;
+        if (!isAbove(slot, heap[parent], max))
+          break;
+
+        place(heap, i, heap[parent], max);
+        i = parent;
+      }
+      place(heap, i, slot, max);
+
+      return i;
+    };
+
+    void siftDown(std::vector<size_t>& heap, size_t size, size_t i, bool
+        max) {
+      size_t slot = heap[i];
+
+      while (2*i+1 < size) {
+        size_t child = 2*i+1;
+        if ((child+1 < size) && isAbove(heap[child+1], heap[child], max))
+          ++child;
+        if (!isAbove(heap[child], slot, max))
+          break;
+
+        place(heap, i, heap[child], max);
+        i = child;
+      }
+      place(heap, i, slot, max);
+    };
+
+    void sift(std::vector<size_t>& heap, size_t size, size_t i, bool max) {
+      if (siftUp(heap, i, max) == i)
+        siftDown(heap, size, i, max);
+    };
+
+    void insert(std::vector<size_t>& heap, size_t& size, size_t slot, bool
+        max) {
+      place(heap, size, slot, max);
+      siftUp(heap, size++, max);
+    };
+
+    /** Move the top of one heap into the other
+      */
+    void move(std::vector<size_t>& from, size_t& fromSize, bool fromMax,
+        std::vector<size_t>& to, size_t& toSize, bool toMax) {
+      size_t slot = from[0];
+
+      place(from, 0, from[--fromSize], fromMax);
+      if (fromSize)
+        siftDown(from, fromSize, 0, fromMax);
+
+      insert(to, toSize, slot, toMax);
+    };
+
+    std::vector<float> values;
+    std::vector<int> positions;
+    std::vector<size_t> lower;
+    std::vector<size_t> upper;
+    size_t numLower;
+    size_t numUpper;
+    size_t next;
+  };
+
+  /** Kalman filter of a signal and its rate of change under a constant
+    * rate model, in O(1) per sample
+    *
+    * The rate is driven by white noise of the given spectral density in
+    * units per s^2 per square root of Hz, the samples are disturbed by
+    * white noise of the given standard deviation. The rate starts at zero
+    * with the variance it accumulates over one second.
+    */
+  class KalmanFilter :
+    public Filter {
+  public:
+    KalmanFilter(float processNoise, float measurementNoise) :
+      processNoise(processNoise*processNoise),
+      measurementNoise(measurementNoise*measurementNoise),
+      valid(false),
+      x(0.0f),
+      v(0.0f),
+      pxx(0.0f),
+      pxv(0.0f),
+      pvv(0.0f) {
+    };
+
+    void reset() {
+      valid = false;
+    };
+
+    void update(float value, float dt) {
+      if (!valid) {
+        x = value;
+        v = 0.0f;
+        pxx = measurementNoise;
+        pxv = 0.0f;
+        pvv = processNoise;
+        valid = true;
+
+        return;
+      }
+
+      float dt2 = dt*dt;
+      x += v*dt;
+      pxx += dt*(2.0f*pxv+dt*pvv)+processNoise*dt2*dt/3.0f;
+      pxv += dt*pvv+processNoise*dt2/2.0f;
+      pvv += processNoise*dt;
+
+      float s = pxx+measurementNoise;
+      float kx = pxx/s;
+      float kv = pxv/s;
+      float innovation = value-x;
+
+      x += kx*innovation;
+      v += kv*innovation;
+      pvv -= kv*pxv;
+      pxv -= kv*pxx;
+      pxx -= kx*pxx;
+    };
+
+    bool isValid() const {
+      return valid;
+    };
+
+    float getValue() const {
+      return x;
+    };
+
+    float getRate() const {
+      return valid ? v : std::numeric_limits<float>::quiet_NaN();
+    };
+
+  private:
+    float processNoise;
+    float measurementNoise;
+    bool valid;
+
+    float x;
+    float v;
+    float pxx;
+    float pxv;
+    float pvv;
+  };
+
+  /** Cascaded integrator-comb decimator of integer samples
+    *
+    * The decimator runs the given number of integrator stages at the
+    * input rate and as many comb stages at the output rate, which yields
+    * the moving sum over the decimation factor applied order times,
+    * without any multiplication. Integrators wrap around modulo 2^64,
+    * which the combs cancel exactly as long as the output fits into 63
+    * bits. The first outputs after a reset ramp up until the number of
+    * outputs reaches the order. For white noise, each halving of the
+    * output rate gains half a bit of resolution.
+    */
+  class CicDecimator {
+  public:
+    static const size_t maxOrder = 8;
+
+    CicDecimator(size_t decimation = 1, size_t order = 1) :
+      decimation(std::max<size_t>(decimation, 1)),
+      order(std::min(std::max<size_t>(order, 1), maxOrder)),
+      gain(pow((double)this->decimation, (double)this->order)) {
+      reset();
+    };
+
+    void reset() {
+      memset(integrators, 0, sizeof(integrators));
+      memset(combs, 0, sizeof(combs));
+      count = 0;
+      numOutputs = 0;
+      output = 0.0;
+    };
+
+    size_t getDecimation() const {
+      return decimation;
+    };
+
+    size_t getOrder() const {
+      return order;
+    };
+
+    /** Whether the ramp-up after a reset has passed
+      */
+    bool isSettled() const {
+      return numOutputs > order;
+    };
+
+    /** Delay of an output behind its most recent input, in input samples
+      */
+    double getDelay() const {
+      return 0.5*order*(decimation-1);
+    };
+
+    /** Take an input sample and return true if an output is due
+      */
+    bool update(int32_t sample) {
+      integrators[0] += (uint64_t)(int64_t)sample;
+      for (size_t i = 1; i < order; ++i)
+        integrators[i] += integrators[i-1];
+
+      if (++count < decimation)
+        return false;
+      count = 0;
+
+      uint64_t value = integrators[order-1];
+      for (size_t i = 0; i < order; ++i) {
+        uint64_t previous = combs[i];
+        combs[i] = value;
+        value -= previous;
+      }
+
+      output = (int64_t)value/gain;
+      ++numOutputs;
+
+      return true;
+    };
+
+    /** Most recent output, normalized to the input scale
+      */
+    double getOutput() const {
+      return output;
+    };
+
+  private:
+    size_t decimation;
+    size_t order;
+    double gain;
+
+    uint64_t integrators[maxOrder];
+    uint64_t combs[maxOrder];
+    size_t count;
+    size_t numOutputs;
+    double output;
+  };
+
+  /** Finite impulse response filter, in O(n) per sample for n taps
+    */
+  class FirFilter {
+  public:
+    FirFilter(const std::vector<float>& coefficients =
+        std::vector<float>(1, 1.0f)) :
+      coefficients(coefficients),
+      samples(coefficients.size()),
+      output(0.0f) {
+    };
+
+    /** Three taps compensating the passband droop of a CIC decimator of
+      * the given order, which is 1-order*(pi*f)^2/6 at f cycles per output
+      * sample for large decimation factors
+      */
+    static std::vector<float> getCicCompensator(size_t order) {
+      std::vector<float> coefficients(3, -(float)order/24.0f);
+      coefficients[1] = 1.0f+(float)order/12.0f;
+
+      return coefficients;
+    };
+
+    void reset() {
+      samples.clear();
+    };
+
+    bool isValid() const {
+      return samples.isFull();
+    };
+
+    float update(float value) {
+      samples.push(value);
+
+      float sum = 0.0f;
+      for (size_t i = 0; i < samples.getSize(); ++i)
+        sum += coefficients[i]*samples[samples.getSize()-1-i];
+
+      return output = sum;
+    };
+
+    float getOutput() const {
+      return output;
+    };
+
+  private:
+    std::vector<float> coefficients;
+    RingBuffer<float> samples;
+    float output;
+  };
+};
+
+#endif
@@ -0,0 +1,153 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Ralf Kaestner                                   *
+ *   ralf.kaestner@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#ifndef NARO_SENSOR_SRVS_PRESSURE_MODEL_H
+#define NARO_SENSOR_SRVS_PRESSURE_MODEL_H
+
+#include <vector>
+#include <limits>
+
+#include <math.h>
+
+namespace naro_sensor_srvs {
+  /** Pressure sensor with a linear transfer function, converting its output
+    * voltage into absolute pressure, depth under sea water and barometric
+    * elevation
+    */
+  class PressureModel {
+  public:
+    PressureModel() :
+      standardAtmosphere(101325.0f),
+      meterSeaWater(9625.0f),
+      barometricConstant(7990.0f),
+      inputVoltage(5.0f),
+      transferCoefficient(4e-6f),
+      transferOffset(-0.04f) {
+    };
+
+    float voltageToPressure(float voltage) const {
+      return (voltage/inputVoltage-transferOffset)/transferCoefficient;
+    };
+
+    float voltageToDepth(float voltage) const {
+      return (voltageToPressure(voltage)-standardAtmosphere)/meterSeaWater;
+    };
+
+    float voltageToElevation(float voltage) const {
+      return -(logf(voltageToPressure(voltage))-logf(standardAtmosphere))*
+        barometricConstant;
+    };
+
+    /** Change of the output voltage per meter of depth, by which rates of
+      * the voltage convert into vertical velocities
+      */
+    float getVoltsPerMeter() const {
+      return inputVoltage*transferCoefficient*meterSeaWater;
+    };
+
+    float standardAtmosphere;           // [Pa]
+    float meterSeaWater;                // [Pa/m]
+    float barometricConstant;           // [m]
+    float inputVoltage;                 // [V]
+    float transferCoefficient;          // [1/Pa]
+    float transferOffset;
+  };
+
+  /** Pressure, depth and elevation of a sensor voltage, precomputed over
+    * the codes of the 10-bit ADC of the USC
+    *
+    * Voltages on a code convert by a plain memory read. Voltages between
+    * codes, as produced by filtering or decimation, are interpolated
+    * linearly between the adjacent codes, which is exact for pressure and
+    * depth. The elevation additionally takes a quadratic term matching the
+    * logarithm at the midpoint between codes. Voltages outside the ADC
+    * range are extrapolated.
+    */
+  class ConversionTable {
+  public:
+    static const int numCodes = 1024;
+
+    class Entry {
+    public:
+      float pressure;
+      float depth;
+      float elevation;
+    };
+
+    ConversionTable() :
+      scale(0.0f) {
+    };
+
+    bool isEmpty() const {
+      return entries.empty();
+    };
+
+    /** Build the table for the given model and ADC reference voltage
+      */
+    void build(const PressureModel& model, float referenceVoltage = 5.0f) {
+      entries.resize(numCodes);
+      curvatures.resize(numCodes);
+      scale = (numCodes-1)/referenceVoltage;
+
+      for (int i = 0; i < numCodes; ++i) {
+        float voltage = i/scale;
+
+        entries[i].pressure = model.voltageToPressure(voltage);
+        entries[i].depth = model.voltageToDepth(voltage);
+        entries[i].elevation = model.voltageToElevation(voltage);
+      }
+
+      for (int i = 0; i+1 < numCodes; ++i)
+        curvatures[i] = 4.0f*(model.voltageToElevation((i+0.5f)/scale)-
+          0.5f*(entries[i].elevation+entries[i+1].elevation));
+    };
+
+    Entry convert(float voltage) const {
+      Entry entry;
+      float x = voltage*scale;
+
+      if (x != x) {
+        entry.pressure = entry.depth = entry.elevation =
+          std::numeric_limits<float>::quiet_NaN();
+        return entry;
+      }
+
+      int i = (x <= 0.0f) ? 0 : (x >= numCodes-2) ? numCodes-2 : (int)x;
+      float t = x-i;
+      const Entry& a = entries[i];
+      const Entry& b = entries[i+1];
+
+      entry.pressure = a.pressure+t*(b.pressure-a.pressure);
+      entry.depth = a.depth+t*(b.depth-a.depth);
+      entry.elevation = a.elevation+t*(b.elevation-a.elevation)+
+        curvatures[i]*t*(1.0f-t);
+
+      return entry;
+    };
+
+  private:
+    std::vector<Entry> entries;
+    std::vector<float> curvatures;
+    float scale;
+  };
+};
+
+#endif
@@ -0,0 +1,85 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Ralf Kaestner                                   *
+ *   ralf.kaestner@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef NARO_SHM_FRAMES_H
+#define NARO_SHM_FRAMES_H
+
+#include <stdint.h>
+
+namespace naro_shm {
+  static const unsigned int maxServos = 32;
+  static const unsigned int maxChannels = 24;
+
+  /** Fin commands written by the joy command into the segment owned by
+    * the fin controller
+    */
+  class Commands {
+  public:
+    uint64_t stamp;                     // [ns]
+    uint32_t trace;
+    uint32_t numServos;
+    uint32_t servos[maxServos];
+    float frequency[maxServos];         // [Hz]
+    float amplitude[maxServos];         // [rad]
+    float phase[maxServos];             // [rad]
+    float offset[maxServos];            // [rad]
+  };
+
+  /** Servo profiles written by the fin controller into the segment owned
+    * by the USC server
+    */
+  class Profiles {
+  public:
+    uint64_t stamp;                     // [ns]
+    uint32_t trace;
+    uint32_t numChannels;
+    uint8_t channels[maxChannels];
+    float position[maxChannels];        // [rad]
+    float speed[maxChannels];           // [rad/s]
+    float acceleration[maxChannels];    // [rad/s^2]
+  };
+
+  /** Servo state written by the USC server into its own segment, with
+    * one entry per channel
+    */
+  class ServoState {
+  public:
+    uint64_t stamp;                     // [ns]
+    uint16_t errors;
+    uint32_t numChannels;
+    float position[maxChannels];        // [rad]
+    float target[maxChannels];          // [rad]
+    float speed[maxChannels];           // [rad/s]
+    float acceleration[maxChannels];    // [rad/s^2]
+    float voltage[maxChannels];         // [V]
+  };
+
+  /** Depth reading written by the depth sensor into its own segment
+    */
+  class Depth {
+  public:
+    uint64_t stamp;                     // [ns]
+    float raw;                          // [m]
+    float filtered;                     // [m]
+    float velocity;                     // [m/s]
+  };
+};
+
+#endif
@@ -0,0 +1,253 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Ralf Kaestner                                   *
+ *   ralf.kaestner@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef NARO_SHM_SEGMENT_H
+#define NARO_SHM_SEGMENT_H
+
+#include <string>
+
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace naro_shm {
+  /** Name of the segment serving the given path of a node
+    *
+    * Slashes in the node name are replaced, such that the segment name
+    * is valid for shm_open().
+    */
+  inline std::string getSegmentName(const std::string& node, const
+      std::string& path) {
+    std::string name = "/naro";
+
+    for (int i = 0; i < node.size(); ++i)
+      name += (node[i] == '/') ? '_' : node[i];
+
+    return name+"_"+path;
+  };
+
+  /** POSIX shared memory segment holding a single fixed-layout frame
+    *
+    * A segment is created by the node owning the data path and opened by
+    * its peer, which falls back to the ROS transport while the segment is
+    * absent. Frames are protected by a sequence lock for a single writer:
+    * the writer updates the frame in place, readers copy it without any
+    * system call or serialization and retry if their copy overlapped with
+    * a write. Frames must therefore be copyable without any allocation.
+    */
+  template <typename T> class Segment {
+  public:
+    Segment() :
+      layout(0),
+      owner(false) {
+    };
+
+    ~Segment() {
+      close();
+    };
+
+    /** Create the segment and map it into memory, replacing any segment
+      * left behind by a previous owner
+      */
+    bool create(const std::string& name) {
+      close();
+
+      shm_unlink(name.c_str());
+      int descriptor = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR,
+        0666);
+      if (descriptor < 0)
+        return false;
+
+      if (ftruncate(descriptor, sizeof(Layout)) || !map(descriptor)) {
+        ::close(descriptor);
+        shm_unlink(name.c_str());
+        return false;
+      }
+      ::close(descriptor);
+
+      layout->size = sizeof(Layout);
+      layout->owner = getpid();
+      layout->sequence = 0;
+      __sync_synchronize();
+      layout->magic = magic;
+
+      this->name = name;
+      owner = true;
+
+      return true;
+    };
+
+    /** Open an existing segment and map it into memory
+      *
+      * Opening fails if the segment does not exist, has a different layout
+      * or has been left behind by an owner which is no longer alive.
+      */
+    bool open(const std::string& name) {
+      close();
+
+      int descriptor = shm_open(name.c_str(), O_RDWR, 0);
+      if (descriptor < 0)
+        return false;
+
+      struct stat status;
+      if (fstat(descriptor, &status) || (status.st_size != sizeof(Layout)) ||
+          !map(descriptor)) {
+        ::close(descriptor);
+        return false;
+      }
+      ::close(descriptor);
+
+      this->name = name;
+      if (!isAlive()) {
+        close();
+        return false;
+      }
+
+      return true;
+    };
+
+    /** Re-open the segment of a peer unless it is open and its owner is
+      * still alive
+      */
+    bool reconnect(const std::string& name) {
+      if (isAlive())
+        return true;
+
+      return open(name);
+    };
+
+    /** Unmap the segment, the owner also removes it
+      */
+    void close() {
+      if (!layout)
+        return;
+
+      if (owner) {
+        layout->magic = 0;
+        __sync_synchronize();
+        shm_unlink(name.c_str());
+      }
+
+      munmap(layout, sizeof(Layout));
+      layout = 0;
+      owner = false;
+    };
+
+    bool isOpen() const {
+      return layout;
+    };
+
+    /** Check the segment for a valid layout and a living owner
+      *
+      * This costs a system call and is meant to be used by peers when
+      * retrying their connections, not on every frame.
+      */
+    bool isAlive() const {
+      if (!layout || (layout->magic != magic) ||
+          (layout->size != sizeof(Layout)))
+        return false;
+
+      return owner || !kill(layout->owner, 0) || (errno == EPERM);
+    };
+
+    /** Sequence number of the most recently written frame, which is zero
+      * as long as no frame has been written
+      */
+    uint32_t getSequence() const {
+      return layout ? (layout->sequence+1)/2 : 0;
+    };
+
+    /** Write a frame
+      *
+      * An odd sequence number left behind by a writer which died during a
+      * write is completed rather than incremented, so the torn frame is
+      * overwritten and readers resume with this one.
+      */
+    void write(const T& frame) {
+      uint32_t sequence = layout->sequence | 1;
+
+      layout->sequence = sequence;
+      __sync_synchronize();
+      layout->frame = frame;
+      __sync_synchronize();
+      layout->sequence = sequence+1;
+    };
+
+    /** Copy the most recently written frame and return its sequence number,
+      * or zero if no frame has been written yet or no consistent copy could
+      * be made within the given number of attempts
+      *
+      * A failed read indicates a writer which stalled or died during a
+      * write, the caller should fall back to the ROS transport.
+      */
+    uint32_t read(T& frame, int maxAttempts = 64) const {
+      for (int attempt = 0; attempt < maxAttempts; ++attempt) {
+        uint32_t before = layout->sequence;
+
+        if (before & 1) {
+          sched_yield();
+          continue;
+        }
+
+        __sync_synchronize();
+        frame = layout->frame;
+        __sync_synchronize();
+
+        if (before == layout->sequence)
+          return before/2;
+      }
+
+      return 0;
+    };
+
+  private:
+    static const uint32_t magic = 0x6e61726f;
+
+    struct Layout {
+      volatile uint32_t magic;
+      uint32_t size;
+      pid_t owner;
+      volatile uint32_t sequence;
+      T frame;
+    };
+
+    bool map(int descriptor) {
+      void* address = mmap(0, sizeof(Layout), PROT_READ | PROT_WRITE,
+        MAP_SHARED, descriptor, 0);
+
+      if (address == MAP_FAILED)
+        return false;
+
+      layout = static_cast<Layout*>(address);
+      return true;
+    };
+
+    Layout* layout;
+    std::string name;
+    bool owner;
+  };
+};
+
+#endif
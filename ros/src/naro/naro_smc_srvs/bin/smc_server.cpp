@@ -19,6 +19,9 @@
  ***************************************************************************/
 
 #include <fstream>
+#include <limits>
+
+#include <boost/thread.hpp>
 
 #include <usb/context.h>
 #include <usb/error.h>
@@ -36,6 +39,11 @@
 #include <ros/ros.h>
 #include <diagnostic_updater/diagnostic_updater.h>
 
+#ifdef NARO_NODELET
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#endif
+
 #include "naro_smc_srvs/GetErrors.h"
 #include "naro_smc_srvs/GetLimits.h"
 #include "naro_smc_srvs/GetInputs.h"
@@ -47,13 +55,25 @@
 #include "naro_smc_srvs/Kill.h"
 #include "naro_smc_srvs/SetSpeed.h"
 #include "naro_smc_srvs/SetBrake.h"
+#include "naro_smc_srvs/GetAll.h"
+#include "naro_smc_srvs/LimitsEvent.h"
 
 using namespace naro_smc_srvs;
 
+namespace {
+
 double connectionRetry = 0.1;
 std::string deviceAddress = "/dev/naro/smc";
 double deviceTimeout = 0.1;
 std::string configurationFile = "etc/smc.xml";
+double variablesMaxAge = 0.05;
+bool pollingEnabled = true;
+double pollingFrequency = 200.0;
+bool reflexEnabled = true;
+std::string reflexAction = "stop";
+double reflexBrake = 1.0;
+int reflexLimitsForward = GetLimits::Response::ANALOG1;
+int reflexLimitsReverse = GetLimits::Response::ANALOG2;
 
 boost::shared_ptr<diagnostic_updater::Updater> updater;
 std::string configurationError;
@@ -62,6 +82,7 @@ Pololu::Pointer<Pololu::Usb::Context> context;
 Pololu::Pointer<Pololu::Usb::Interface> interface;
 Pololu::Pointer<Pololu::Smc::Device> device;
 Pololu::Smc::Usb::Settings settings;
+boost::recursive_mutex deviceMutex;
 
 ros::ServiceServer getErrorsService;
 ros::ServiceServer getLimitsService;
@@ -74,6 +95,73 @@ ros::ServiceServer startService;
 ros::ServiceServer killService;
 ros::ServiceServer setSpeedService;
 ros::ServiceServer setBrakeService;
+ros::ServiceServer getAllService;
+
+ros::Publisher limitsEventsPublisher;
+
+ros::Timer diagnosticsTimer;
+ros::Timer connectionTimer;
+
+/** Device variables read by a single GetVariables transfer, serving all
+  * getters until older than the maximum age
+  */
+class Snapshot {
+public:
+  Snapshot() :
+    valid(false),
+    numHits(0),
+    numRefreshes(0) {
+  };
+
+  bool valid;
+  ros::WallTime stamp;
+  Pololu::Smc::Usb::Variables variables;
+  unsigned long numHits;
+  unsigned long numRefreshes;
+};
+
+Snapshot snapshot;
+boost::mutex snapshotMutex;
+
+volatile bool running = false;
+boost::thread pollingThread;
+
+/** Limit status of the last poll, -1 if unknown
+  */
+volatile int polledLimits = -1;
+volatile double pollingRate = 0.0;
+unsigned long numPollingFailures = 0;
+
+/** Detection to stop latencies [s] of the safety reflex
+  */
+class Reflex {
+public:
+  Reflex() :
+    numReactions(0),
+    numVetoes(0),
+    numFailures(0),
+    sumLatency(0.0),
+    maxLatency(0.0),
+    lastLatency(std::numeric_limits<double>::quiet_NaN()) {
+  };
+
+  void addReaction(double latency) {
+    ++numReactions;
+    sumLatency += latency;
+    maxLatency = std::max(maxLatency, latency);
+    lastLatency = latency;
+  };
+
+  unsigned long numReactions;
+  unsigned long numVetoes;
+  unsigned long numFailures;
+  double sumLatency;
+  double maxLatency;
+  double lastLatency;
+};
+
+Reflex reflex;
+boost::mutex reflexMutex;
 
 template <typename T> inline T clamp(T x, T min, T max) {
   return x < min ? min : (x > max ? max : x);
@@ -85,6 +173,21 @@ void getParameters(const ros::NodeHandle& node) {
   node.param<double>("device/timeout", deviceTimeout, deviceTimeout);
   node.param<std::string>("configuration/file", configurationFile,
     configurationFile);
+
+  node.param<double>("variables/max_age", variablesMaxAge,
+    variablesMaxAge);
+
+  node.param<bool>("polling/enabled", pollingEnabled, pollingEnabled);
+  node.param<double>("polling/frequency", pollingFrequency,
+    pollingFrequency);
+
+  node.param<bool>("reflex/enabled", reflexEnabled, reflexEnabled);
+  node.param<std::string>("reflex/action", reflexAction, reflexAction);
+  node.param<double>("reflex/brake", reflexBrake, reflexBrake);
+  node.param<int>("reflex/limits/forward", reflexLimitsForward,
+    reflexLimitsForward);
+  node.param<int>("reflex/limits/reverse", reflexLimitsReverse,
+    reflexLimitsReverse);
 }
 
 void diagnoseContext(diagnostic_updater::DiagnosticStatusWrapper
@@ -145,6 +248,8 @@ void diagnoseConfiguration(diagnostic_updater::DiagnosticStatusWrapper
 
 void diagnoseTransfer(diagnostic_updater::DiagnosticStatusWrapper
     &status) {
+  boost::recursive_mutex::scoped_lock lock(deviceMutex);
+
   if (!device.isNull() && device->isConnected()) {
     Pololu::Smc::Usb::GetFirmwareVersion request;
     try {
@@ -195,6 +300,8 @@ void syncSettings(const std::string& filename) {
 }
 
 bool connect() {
+  boost::recursive_mutex::scoped_lock lock(deviceMutex);
+
   try {
     if (context.isNull())
       context = new Pololu::Usb::Context();
@@ -231,6 +338,8 @@ bool connect() {
 }
 
 void disconnect() {
+  boost::recursive_mutex::scoped_lock lock(deviceMutex);
+
   if (!device.isNull() && device->isConnected()) {
     try {
       device->disconnect();
@@ -245,6 +354,8 @@ void disconnect() {
 }
 
 bool transfer(Pololu::Usb::Request& request, const std::string& name) {
+  boost::recursive_mutex::scoped_lock lock(deviceMutex);
+
   if (!device.isNull() && device->isConnected()) {
     try {
       interface->transfer(request);
@@ -258,6 +369,11 @@ bool transfer(Pololu::Usb::Request& request, const std::string& name) {
         disconnect();
         connect();
       }
+
+      /** The request never reached the device, even if reconnecting
+        * succeeds, such that its response remains unfilled
+        */
+      return false;
     }
     catch (const Pololu::Exception& exception) {
       ROS_WARN("%s request failed: %s", name.c_str(), exception.what());
@@ -272,54 +388,123 @@ bool transfer(Pololu::Usb::Request& request, const std::string& name) {
   return true;
 }
 
-bool getErrors(GetErrors::Request& request, GetErrors::Response& response) {
-  Pololu::Smc::Usb::GetVariables getVariablesRequest;
+void storeVariables(const Pololu::Smc::Usb::Variables& variables,
+    const ros::WallTime& stamp) {
+  boost::mutex::scoped_lock lock(snapshotMutex);
 
-  if (transfer(getVariablesRequest, "GetVariables"))
-    response.errors = getVariablesRequest.getResponse().errorOccurred;
-  else
+  snapshot.variables = variables;
+  snapshot.stamp = stamp;
+  snapshot.valid = true;
+}
+
+/** Force the next getter to refresh the variables after a command changing
+  * the state of the device, called under the device lock
+  */
+void invalidateVariables() {
+  boost::mutex::scoped_lock lock(snapshotMutex);
+  snapshot.valid = false;
+}
+
+bool readVariables(Pololu::Smc::Usb::Variables& variables, double& age) {
+  boost::mutex::scoped_lock lock(snapshotMutex);
+
+  if (!snapshot.valid)
     return false;
+  age = (ros::WallTime::now()-snapshot.stamp).toSec();
+  if (age > variablesMaxAge)
+    return false;
+
+  variables = snapshot.variables;
+  ++snapshot.numHits;
 
   return true;
 }
 
-bool getLimits(GetLimits::Request& request, GetLimits::Response& response) {
+/** Serve the device variables from the snapshot, refreshing it by a
+  * transfer only if it has become stale
+  */
+bool getVariables(Pololu::Smc::Usb::Variables& variables, double& age) {
+  if (readVariables(variables, age))
+    return true;
+
+  boost::recursive_mutex::scoped_lock lock(deviceMutex);
+
+  /** Another request may have refreshed the snapshot while waiting for
+    * the device
+    */
+  if (readVariables(variables, age))
+    return true;
+
   Pololu::Smc::Usb::GetVariables getVariablesRequest;
+  if (!transfer(getVariablesRequest, "GetVariables"))
+    return false;
+
+  variables = getVariablesRequest.getResponse();
+  age = 0.0;
+  storeVariables(variables, ros::WallTime::now());
+  {
+    boost::mutex::scoped_lock lock(snapshotMutex);
+    ++snapshot.numRefreshes;
+  }
+
+  return true;
+}
 
-  if (transfer(getVariablesRequest, "GetVariables"))
-    response.limits = getVariablesRequest.getResponse().limitStatus;
+bool getVariables(Pololu::Smc::Usb::Variables& variables) {
+  double age;
+  return getVariables(variables, age);
+}
+
+template <typename T> void convertInputs(const Pololu::Smc::Usb::Variables&
+    variables, T& raw, T& scaled) {
+  raw[GetInputs::Response::RC1] = variables.inputChannels[
+    Pololu::Smc::Device::inputChannelRc1].rawValue*0.25e-6f;
+  scaled[GetInputs::Response::RC1] = variables.inputChannels[
+    Pololu::Smc::Device::inputChannelRc1].scaledValue/3200.0f;
+
+  raw[GetInputs::Response::RC2] = variables.inputChannels[
+    Pololu::Smc::Device::inputChannelRc2].rawValue*0.25e-6f;
+  scaled[GetInputs::Response::RC2] = variables.inputChannels[
+    Pololu::Smc::Device::inputChannelRc2].scaledValue/3200.0f;
+
+  raw[GetInputs::Response::ANALOG1] = variables.inputChannels[
+    Pololu::Smc::Device::inputChannelAnalog1].rawValue/4095.0f*3.3f;
+  scaled[GetInputs::Response::ANALOG1] = variables.inputChannels[
+    Pololu::Smc::Device::inputChannelAnalog1].scaledValue/3200.0f;
+
+  raw[GetInputs::Response::ANALOG2] = variables.inputChannels[
+    Pololu::Smc::Device::inputChannelAnalog2].rawValue/4095.0f*3.3f;
+  scaled[GetInputs::Response::ANALOG2] = variables.inputChannels[
+    Pololu::Smc::Device::inputChannelAnalog2].scaledValue/3200.0f;
+}
+
+bool getErrors(GetErrors::Request& request, GetErrors::Response& response) {
+  Pololu::Smc::Usb::Variables variables;
+
+  if (getVariables(variables))
+    response.errors = variables.errorOccurred;
   else
     return false;
 
   return true;
 }
 
-bool getInputs(GetInputs::Request& request, GetInputs::Response& response) {
-  Pololu::Smc::Usb::GetVariables getVariablesRequest;
-
-  if (transfer(getVariablesRequest, "GetVariables")) {
-    Pololu::Smc::Usb::Variables variables = getVariablesRequest.getResponse();
+bool getLimits(GetLimits::Request& request, GetLimits::Response& response) {
+  Pololu::Smc::Usb::Variables variables;
 
-    response.raw[GetInputs::Response::RC1] = variables.inputChannels[
-      Pololu::Smc::Device::inputChannelRc1].rawValue*0.25e-6f;
-    response.scaled[GetInputs::Response::RC1] = variables.inputChannels[
-      Pololu::Smc::Device::inputChannelRc1].scaledValue/3200.0f;
+  if (getVariables(variables))
+    response.limits = variables.limitStatus;
+  else
+    return false;
 
-    response.raw[GetInputs::Response::RC2] = variables.inputChannels[
-      Pololu::Smc::Device::inputChannelRc2].rawValue*0.25e-6f;
-    response.scaled[GetInputs::Response::RC2] = variables.inputChannels[
-      Pololu::Smc::Device::inputChannelRc2].scaledValue/3200.0f;
+  return true;
+}
 
-    response.raw[GetInputs::Response::ANALOG1] = variables.inputChannels[
-      Pololu::Smc::Device::inputChannelAnalog1].rawValue/4095.0f*3.3f;
-    response.scaled[GetInputs::Response::ANALOG1] = variables.inputChannels[
-      Pololu::Smc::Device::inputChannelAnalog1].scaledValue/3200.0f;
+bool getInputs(GetInputs::Request& request, GetInputs::Response& response) {
+  Pololu::Smc::Usb::Variables variables;
 
-    response.raw[GetInputs::Response::ANALOG2] = variables.inputChannels[
-      Pololu::Smc::Device::inputChannelAnalog2].rawValue/4095.0f*3.3f;
-    response.scaled[GetInputs::Response::ANALOG2] = variables.inputChannels[
-      Pololu::Smc::Device::inputChannelAnalog2].scaledValue/3200.0f;
-  }
+  if (getVariables(variables))
+    convertInputs(variables, response.raw, response.scaled);
   else
     return false;
 
@@ -328,10 +513,10 @@ bool getInputs(GetInputs::Request& request, GetInputs::Response& response) {
 
 bool getVoltage(GetVoltage::Request& request, GetVoltage::Response&
     response) {
-  Pololu::Smc::Usb::GetVariables getVariablesRequest;
+  Pololu::Smc::Usb::Variables variables;
 
-  if (transfer(getVariablesRequest, "GetVariables"))
-    response.voltage = getVariablesRequest.getResponse().vinMv*1e-3f;
+  if (getVariables(variables))
+    response.voltage = variables.vinMv*1e-3f;
   else
     return false;
 
@@ -340,11 +525,10 @@ bool getVoltage(GetVoltage::Request& request, GetVoltage::Response&
 
 bool getTemperature(GetTemperature::Request& request,
     GetTemperature::Response& response) {
-  Pololu::Smc::Usb::GetVariables getVariablesRequest;
+  Pololu::Smc::Usb::Variables variables;
 
-  if (transfer(getVariablesRequest, "GetVariables"))
-    response.temperature =
-      getVariablesRequest.getResponse().temperature*1e-1f;
+  if (getVariables(variables))
+    response.temperature = variables.temperature*1e-1f;
   else
     return false;
 
@@ -352,10 +536,9 @@ bool getTemperature(GetTemperature::Request& request,
 }
 
 bool getSpeed(GetSpeed::Request& request, GetSpeed::Response& response) {
-  Pololu::Smc::Usb::GetVariables getVariablesRequest;
+  Pololu::Smc::Usb::Variables variables;
 
-  if (transfer(getVariablesRequest, "GetVariables")) {
-    Pololu::Smc::Usb::Variables variables = getVariablesRequest.getResponse();
+  if (getVariables(variables)) {
     response.actual = variables.speed/3200.0f;
     response.target = variables.targetSpeed/3200.0f;
   }
@@ -366,10 +549,31 @@ bool getSpeed(GetSpeed::Request& request, GetSpeed::Response& response) {
 }
 
 bool getBrake(GetBrake::Request& request, GetBrake::Response& response) {
-  Pololu::Smc::Usb::GetVariables getVariablesRequest;
+  Pololu::Smc::Usb::Variables variables;
+
+  if (getVariables(variables))
+    response.brake = variables.brakeAmount/32.0f;
+  else
+    return false;
+
+  return true;
+}
+
+bool getAll(GetAll::Request& request, GetAll::Response& response) {
+  Pololu::Smc::Usb::Variables variables;
+  double age;
 
-  if (transfer(getVariablesRequest, "GetVariables"))
-    response.brake = getVariablesRequest.getResponse().brakeAmount/32.0f;
+  if (getVariables(variables, age)) {
+    response.errors = variables.errorOccurred;
+    response.limits = variables.limitStatus;
+    convertInputs(variables, response.raw, response.scaled);
+    response.voltage = variables.vinMv*1e-3f;
+    response.temperature = variables.temperature*1e-1f;
+    response.actual = variables.speed/3200.0f;
+    response.target = variables.targetSpeed/3200.0f;
+    response.brake = variables.brakeAmount/32.0f;
+    response.age = age;
+  }
   else
     return false;
 
@@ -377,8 +581,10 @@ bool getBrake(GetBrake::Request& request, GetBrake::Response& response) {
 }
 
 bool start(Start::Request& request, Start::Response& response) {
+  boost::recursive_mutex::scoped_lock lock(deviceMutex);
   Pololu::Smc::Usb::ExitSafeStart startRequest;
 
+  invalidateVariables();
   if (!transfer(startRequest, "ExitSafeStart"))
     return false;
 
@@ -386,19 +592,46 @@ bool start(Start::Request& request, Start::Response& response) {
 }
 
 bool kill(Kill::Request& request, Kill::Response& response) {
+  boost::recursive_mutex::scoped_lock lock(deviceMutex);
   Pololu::Smc::Usb::SetUsbKill killRequest;
 
+  invalidateVariables();
   if (!transfer(killRequest, "SetUsbKill"))
     return false;
 
   return true;
 }
 
+/** Return the limits asserted in the given limit status which block motion
+  * at the given speed
+  */
+inline int getBlockingLimits(int limits, int speed) {
+  if (speed > 0)
+    return limits & reflexLimitsForward;
+  else if (speed < 0)
+    return limits & reflexLimitsReverse;
+  else
+    return 0;
+}
+
 bool setSpeed(SetSpeed::Request& request, SetSpeed::Response& response) {
-  Pololu::Smc::Usb::SetSpeed setSpeedRequest(
-    round(clamp<float>(request.speed, -1.0f, 1.0f)*3200.0f));
+  boost::recursive_mutex::scoped_lock lock(deviceMutex);
+  short speed = round(clamp<float>(request.speed, -1.0f, 1.0f)*3200.0f);
+
+  /** Veto commands into an asserted limit while the reflex is enabled
+    */
+  if (reflexEnabled && (polledLimits >= 0) &&
+      getBlockingLimits(polledLimits, speed)) {
+    boost::mutex::scoped_lock lock(reflexMutex);
+    ++reflex.numVetoes;
+
+    speed = 0;
+  }
+
+  Pololu::Smc::Usb::SetSpeed setSpeedRequest(speed);
   Pololu::Smc::Usb::ExitSafeStart startRequest;
 
+  invalidateVariables();
   if (!transfer(setSpeedRequest, "SetSpeed"))
     return false;
   if (request.start && !transfer(startRequest, "ExitSafeStart"))
@@ -408,15 +641,194 @@ bool setSpeed(SetSpeed::Request& request, SetSpeed::Response& response) {
 }
 
 bool setBrake(SetBrake::Request& request, SetBrake::Response& response) {
+  boost::recursive_mutex::scoped_lock lock(deviceMutex);
   Pololu::Smc::Usb::SetBrake setBrakeRequest(
     round(clamp<float>(request.brake, 0.0f, 1.0f)*32.0f));
 
+  invalidateVariables();
   if (!transfer(setBrakeRequest, "SetBrake"))
     return false;
 
   return true;
 }
 
+void diagnoseVariables(diagnostic_updater::DiagnosticStatusWrapper
+    &status) {
+  boost::mutex::scoped_lock lock(snapshotMutex);
+  unsigned long numRequests = snapshot.numHits+snapshot.numRefreshes;
+
+  if (numRequests)
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "%.1f%% of %lu variables requests served without transfer.",
+      100.0*snapshot.numHits/numRequests, numRequests);
+  else
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "No variables requests.");
+
+  status.addf("Maximum age", "%.1f ms", variablesMaxAge*1e3);
+  status.addf("Hits", "%lu", snapshot.numHits);
+  status.addf("Refreshes", "%lu", snapshot.numRefreshes);
+}
+
+void diagnosePolling(diagnostic_updater::DiagnosticStatusWrapper &status) {
+  if (!pollingEnabled)
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "Variables polling disabled.");
+  else if (pollingRate > 0.0)
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "Variables polled at %.1f Hz.", pollingRate);
+  else
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::ERROR,
+      "Variables not polled.");
+
+  if (pollingEnabled) {
+    status.addf("Limits", "%d", polledLimits);
+    status.addf("Failures", "%lu", numPollingFailures);
+  }
+}
+
+void diagnoseReflex(diagnostic_updater::DiagnosticStatusWrapper &status) {
+  boost::mutex::scoped_lock lock(reflexMutex);
+
+  if (!reflexEnabled || !pollingEnabled)
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::WARN,
+      "Limit switch reflex disabled.");
+  else if (reflex.numFailures)
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::ERROR,
+      "Limit switch reflex failed %lu time(s).", reflex.numFailures);
+  else if (reflex.numReactions)
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "Limit switch reflex reacted within %.1f ms.",
+      reflex.maxLatency*1e3);
+  else
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "Limit switch reflex armed.");
+
+  if (reflexEnabled && pollingEnabled) {
+    status.addf("Action", "%s", reflexAction.c_str());
+    status.addf("Reactions", "%lu", reflex.numReactions);
+    status.addf("Vetoes", "%lu", reflex.numVetoes);
+    status.addf("Failures", "%lu", reflex.numFailures);
+    status.addf("Last latency", "%.2f ms", reflex.lastLatency*1e3);
+    status.addf("Mean latency", "%.2f ms", reflex.numReactions ?
+      reflex.sumLatency/reflex.numReactions*1e3 : 0.0);
+    status.addf("Max latency", "%.2f ms", reflex.maxLatency*1e3);
+    status.addf("Detection latency", "%.2f ms",
+      pollingRate > 0.0 ? 1e3/pollingRate : 0.0);
+  }
+}
+
+/** Stop or brake the motor, clearing its target speed such that it does
+  * not resume once the limit releases
+  */
+bool react() {
+  invalidateVariables();
+
+  if (reflexAction == "brake") {
+    Pololu::Smc::Usb::SetBrake setBrakeRequest(
+      round(clamp<float>(reflexBrake, 0.0f, 1.0f)*32.0f));
+    return transfer(setBrakeRequest, "SetBrake");
+  }
+  else {
+    Pololu::Smc::Usb::SetSpeed setSpeedRequest(0);
+    return transfer(setSpeedRequest, "SetSpeed");
+  }
+}
+
+/** Poll the device variables and publish limit status changes. Once a
+  * limit blocks the target speed of the motor, the reflex reacts under
+  * the same device lock, before any other request is served.
+  */
+void pollVariables() {
+  ros::WallDuration retry(connectionRetry);
+  ros::WallDuration period(pollingFrequency > 0.0 ?
+    1.0/pollingFrequency : 0.0);
+  ros::WallTime nextTime = ros::WallTime::now();
+  ros::WallTime rateTime = nextTime;
+  unsigned long numRatePolls = 0;
+  uint32_t sequence = 0;
+
+  while (running && ros::ok()) {
+    bool polled = false;
+    int limits = 0, lastLimits = polledLimits;
+    bool reacted = false;
+    double latency = std::numeric_limits<double>::quiet_NaN();
+    {
+      boost::recursive_mutex::scoped_lock lock(deviceMutex);
+
+      if (!device.isNull() && device->isConnected()) {
+        Pololu::Smc::Usb::GetVariables getVariablesRequest;
+
+        if (transfer(getVariablesRequest, "GetVariables")) {
+          ros::WallTime detectionTime = ros::WallTime::now();
+          Pololu::Smc::Usb::Variables variables =
+            getVariablesRequest.getResponse();
+
+          storeVariables(variables, detectionTime);
+          limits = variables.limitStatus;
+          polledLimits = limits;
+          polled = true;
+
+          if (reflexEnabled && getBlockingLimits(limits,
+              variables.targetSpeed)) {
+            reacted = react();
+            latency = (ros::WallTime::now()-detectionTime).toSec();
+
+            boost::mutex::scoped_lock lock(reflexMutex);
+            if (reacted)
+              reflex.addReaction(latency);
+            else
+              ++reflex.numFailures;
+          }
+        }
+      }
+    }
+
+    if (!polled) {
+      ++numPollingFailures;
+      polledLimits = -1;
+      pollingRate = 0.0;
+      retry.sleep();
+
+      nextTime = rateTime = ros::WallTime::now();
+      numRatePolls = 0;
+      continue;
+    }
+
+    if ((limits != lastLimits) || reacted) {
+      LimitsEvent::Ptr event(new LimitsEvent());
+      int previous = (lastLimits >= 0) ? lastLimits : 0;
+
+      event->header.stamp = ros::Time::now();
+      event->sequence = ++sequence;
+      event->limits = limits;
+      event->asserted = limits & ~previous;
+      event->released = previous & ~limits;
+      event->reflex = reacted;
+      event->latency = latency;
+      limitsEventsPublisher.publish(event);
+    }
+
+    ros::WallTime now = ros::WallTime::now();
+    ++numRatePolls;
+    if ((now-rateTime).toSec() >= 1.0) {
+      pollingRate = numRatePolls/(now-rateTime).toSec();
+      rateTime = now;
+      numRatePolls = 0;
+    }
+
+    if (pollingFrequency > 0.0) {
+      nextTime = nextTime+period;
+      if (nextTime > now)
+        (nextTime-now).sleep();
+      else
+        nextTime = now;
+    }
+    else
+      boost::this_thread::yield();
+  }
+}
+
 void updateDiagnostics(const ros::TimerEvent& event) {
   updater->update();
 }
@@ -428,11 +840,12 @@ void tryConnect(const ros::TimerEvent& event) {
   }
 }
 
-int main(int argc, char **argv) {
-  ros::init(argc, argv, "smc_server");
-  ros::NodeHandle node("~");
-
-  updater.reset(new diagnostic_updater::Updater());
+/** Advertise the services and start the timers of the simple motor controller
+  * server under the given private node handle
+  */
+void startNode(ros::NodeHandle& node) {
+  updater.reset(new diagnostic_updater::Updater(ros::NodeHandle(), node,
+    node.getNamespace()));
   updater->setHardwareID("none");
 
   updater->add("Context", diagnoseContext);
@@ -441,6 +854,9 @@ int main(int argc, char **argv) {
   updater->add("Connection", diagnoseConnection);
   updater->add("Configuration", diagnoseConfiguration);
   updater->add("Transfer", diagnoseTransfer);
+  updater->add("Polling", diagnosePolling);
+  updater->add("Reflex", diagnoseReflex);
+  updater->add("Variables", diagnoseVariables);
   updater->force_update();
 
   getParameters(node);
@@ -459,15 +875,64 @@ int main(int argc, char **argv) {
   killService = node.advertiseService("kill", kill);
   setSpeedService = node.advertiseService("set_speed", setSpeed);
   setBrakeService = node.advertiseService("set_brake", setBrake);
+  getAllService = node.advertiseService("get_all", getAll);
+
+  limitsEventsPublisher = node.advertise<LimitsEvent>("limits_events", 10,
+    true);
 
-  ros::Timer diagnosticsTimer = node.createTimer(
+  diagnosticsTimer = node.createTimer(
     ros::Duration(1.0), updateDiagnostics);
-  ros::Timer connectionTimer = node.createTimer(
+  connectionTimer = node.createTimer(
     ros::Duration(connectionRetry), tryConnect);
 
-  ros::spin();
+  if (pollingEnabled) {
+    running = true;
+    pollingThread = boost::thread(pollVariables);
+  }
+}
+
+void stopNode() {
+  diagnosticsTimer.stop();
+  connectionTimer.stop();
+
+  running = false;
+  if (pollingThread.joinable())
+    pollingThread.join();
 
   disconnect();
+}
+
+};
+
+#ifdef NARO_NODELET
+namespace naro_smc_srvs {
+  /** Nodelet running the simple motor controller server in the process of a
+    * nodelet manager
+    */
+  class SmcServerNodelet :
+    public nodelet::Nodelet {
+  public:
+    ~SmcServerNodelet() {
+      stopNode();
+    };
+
+    virtual void onInit() {
+      startNode(getPrivateNodeHandle());
+    };
+  };
+};
+
+PLUGINLIB_DECLARE_CLASS(naro_smc_srvs, smc_server,
+  naro_smc_srvs::SmcServerNodelet, nodelet::Nodelet)
+#else
+int main(int argc, char **argv) {
+  ros::init(argc, argv, "smc_server");
+  ros::NodeHandle node("~");
+
+  startNode(node);
+  ros::spin();
+  stopNode();
 
   return 0;
 }
+#endif
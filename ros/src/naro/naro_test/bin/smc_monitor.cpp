@@ -20,35 +20,28 @@
 
 #include <ros/ros.h>
 
-#include "naro_smc_srvs/GetErrors.h"
-#include "naro_smc_srvs/GetLimits.h"
-#include "naro_smc_srvs/GetInputs.h"
-#include "naro_smc_srvs/GetVoltage.h"
-#include "naro_smc_srvs/GetTemperature.h"
-#include "naro_smc_srvs/GetSpeed.h"
-#include "naro_smc_srvs/GetBrake.h"
+#include "naro_smc_srvs/GetAll.h"
 
 using namespace naro_smc_srvs;
 
 std::string serverName = "smc_server";
 double clientUpdate = 0.1;
 
-ros::ServiceClient getErrorsClient;
-ros::ServiceClient getLimitsClient;
-ros::ServiceClient getInputsClient;
-ros::ServiceClient getVoltageClient;
-ros::ServiceClient getTemperatureClient;
-ros::ServiceClient getSpeedClient;
-ros::ServiceClient getBrakeClient;
+ros::ServiceClient getAllClient;
 
+/** Fetch all variables in a single request, served by the server from one
+  * device transfer
+  */
 void update(const ros::TimerEvent& event) {
-  GetErrors getErrors;
-  if (getErrorsClient.call(getErrors)) {
+  GetAll getAll;
+  bool valid = getAllClient.call(getAll);
+
+  if (valid) {
     char errorBits[11];
 
     int j = sizeof(errorBits)-2;
     for (int i = 0; i+1 < sizeof(errorBits); ++i, --j)
-      errorBits[i] = (getErrors.response.errors & (1 << j)) ? '1' : '0';
+      errorBits[i] = (getAll.response.errors & (1 << j)) ? '1' : '0';
     errorBits[sizeof(errorBits)-1] = 0;
 
     printf("\r%14s: %10s\n", "Errors", errorBits);
@@ -56,13 +49,12 @@ void update(const ros::TimerEvent& event) {
   else
     printf("\r%14s: %10s\n", "Errors", "n/a");
 
-  GetLimits getLimits;
-  if (getLimitsClient.call(getLimits)) {
+  if (valid) {
     char limitsBits[11];
 
     int j = sizeof(limitsBits)-2;
     for (int i = 0; i+1 < sizeof(limitsBits); ++i, --j)
-      limitsBits[i] = (getLimits.response.limits & (1 << j)) ? '1' : '0';
+      limitsBits[i] = (getAll.response.limits & (1 << j)) ? '1' : '0';
     limitsBits[sizeof(limitsBits)-1] = 0;
 
     printf("\r%14s: %10s\n", "Limits", limitsBits);
@@ -70,45 +62,40 @@ void update(const ros::TimerEvent& event) {
   else
     printf("\r%14s: %10s\n", "Limits", "n/a");
 
-  GetInputs getInputs;
-  if (getInputsClient.call(getInputs)) {
-    printf("\r%14s: %10.2f\n", "Rc1", getInputs.response.scaled[0]);
-    printf("\r%14s: %10.2f\n", "Rc2", getInputs.response.scaled[1]);
-    printf("\r%14s: %10.2f\n", "Analog1", getInputs.response.scaled[2]);
-    printf("\r%14s: %10.2f\n", "Analog2", getInputs.response.scaled[3]);
+  if (valid) {
+    printf("\r%14s: %10.2f\n", "Rc1", getAll.response.scaled[0]);
+    printf("\r%14s: %10.2f\n", "Rc2", getAll.response.scaled[1]);
+    printf("\r%14s: %10.2f\n", "Analog1", getAll.response.scaled[2]);
+    printf("\r%14s: %10.2f\n", "Analog2", getAll.response.scaled[3]);
   }
   else {
-    printf("\r%14s: %10s\n", "Analog1", "n/a");
-    printf("\r%14s: %10s\n", "Analog2", "n/a");
     printf("\r%14s: %10s\n", "Rc1", "n/a");
     printf("\r%14s: %10s\n", "Rc2", "n/a");
+    printf("\r%14s: %10s\n", "Analog1", "n/a");
+    printf("\r%14s: %10s\n", "Analog2", "n/a");
   }
 
-  GetVoltage getVoltage;
-  if (getVoltageClient.call(getVoltage))
+  if (valid)
     printf("\r%14s: %10.2f V\n", "Voltage",
-      getVoltage.response.voltage);
+      getAll.response.voltage);
   else
     printf("\r%14s: %10s  \n", "Voltage", "n/a");
 
-  GetTemperature getTemperature;
-  if (getTemperatureClient.call(getTemperature))
+  if (valid)
     printf("\r%14s: %10.2f C\n", "Temperature",
-      getTemperature.response.temperature);
+      getAll.response.temperature);
   else
     printf("\r%14s: %10s  \n", "Temperature", "n/a");
 
-  GetSpeed getSpeed;
-  if (getSpeedClient.call(getSpeed))
+  if (valid)
     printf("\r%14s: %10.2f\n", "Speed",
-      getSpeed.response.actual);
+      getAll.response.actual);
   else
     printf("\r%14s: %10s\n", "Speed", "n/a");
 
-  GetBrake getBrake;
-  if (getBrakeClient.call(getBrake))
+  if (valid)
     printf("\r%14s: %10.2f\n", "Brake",
-      getBrake.response.brake);
+      getAll.response.brake);
   else
     printf("\r%14s: %10s\n", "Brake", "n/a");
 
@@ -122,20 +109,8 @@ int main(int argc, char **argv) {
   node.param<std::string>("server/name", serverName, serverName);
   node.param<double>("client/update", clientUpdate, clientUpdate);
 
-  getErrorsClient = node.serviceClient<GetErrors>(
-    "/"+serverName+"/get_errors");
-  getLimitsClient = node.serviceClient<GetLimits>(
-    "/"+serverName+"/get_limits");
-  getInputsClient = node.serviceClient<GetInputs>(
-    "/"+serverName+"/get_inputs");
-  getVoltageClient = node.serviceClient<GetVoltage>(
-    "/"+serverName+"/get_voltage");
-  getTemperatureClient = node.serviceClient<GetTemperature>(
-    "/"+serverName+"/get_temperature");
-  getSpeedClient = node.serviceClient<GetSpeed>(
-    "/"+serverName+"/get_speed");
-  getBrakeClient = node.serviceClient<GetBrake>(
-    "/"+serverName+"/get_brake");
+  getAllClient = node.serviceClient<GetAll>(
+    "/"+serverName+"/get_all");
 
   ros::Timer updateTimer = node.createTimer(
     ros::Duration(clientUpdate), update);
@@ -20,31 +20,32 @@
 
 #include <ros/ros.h>
 
-#include "naro_usc_srvs/GetErrors.h"
 #include "naro_usc_srvs/GetChannels.h"
-#include "naro_usc_srvs/GetPositions.h"
-#include "naro_usc_srvs/GetInputs.h"
+#include "naro_usc_srvs/ServoState.h"
 
 using namespace naro_usc_srvs;
 
 std::string serverName = "usc_server";
 double clientUpdate = 0.1;
 
-ros::ServiceClient getErrorsClient;
 ros::ServiceClient getChannelsClient;
-ros::ServiceClient getPositionsClient;
-ros::ServiceClient getInputsClient;
+ros::Subscriber servoStateSubscriber;
+
+ServoState::ConstPtr servoState;
 
 unsigned int numLines = 0;
 
+void receiveServoState(const ServoState::ConstPtr& servoState) {
+  ::servoState = servoState;
+}
+
 void update(const ros::TimerEvent& event) {
-  GetErrors getErrors;
-  if (getErrorsClient.call(getErrors)) {
+  if (servoState) {
     char errorBits[10];
 
     int j = sizeof(errorBits)-2;
     for (int i = 0; i+1 < sizeof(errorBits); ++i, --j)
-      errorBits[i] = (getErrors.response.errors & (1 << j)) ? '1' : '0';
+      errorBits[i] = (servoState->errors & (1 << j)) ? '1' : '0';
     errorBits[sizeof(errorBits)-1] = 0;
 
     printf("\r%14s: %12s\n", "Errors", errorBits);
@@ -71,40 +72,31 @@ void update(const ros::TimerEvent& event) {
   else
     printf("\r%14s: %12s\n", "Channels", "n/a");
 
-  GetPositions getPositions;
-  for (int i = 0; i < getChannels.response.mode.size(); ++i)
+  std::vector<int> servos, inputs;
+  for (int i = 0; i < getChannels.response.mode.size(); ++i) {
     if (getChannels.response.mode[i] == GetChannels::Response::SERVO)
-      getPositions.request.channels.push_back(i);
-  if (getPositionsClient.call(getPositions)) {
-    for (int i = 0; i < getPositions.request.channels.size(); ++i)
-      printf("\r%11s %2d: %12.2f deg\n", "Channel",
-        getPositions.request.channels[i],
-        getPositions.response.actual[i]*180.0/M_PI);
-  }
-  else {
-    for (int i = 0; i < getPositions.request.channels.size(); ++i)
-      printf("\r%11s %2d: %12s    \n", "Channel",
-        getPositions.request.channels[i], "n/a");
+      servos.push_back(i);
+    else if (getChannels.response.mode[i] == GetChannels::Response::INPUT)
+      inputs.push_back(i);
   }
 
-  GetInputs getInputs;
-  for (int i = 0; i < getChannels.response.mode.size(); ++i)
-    if (getChannels.response.mode[i] == GetChannels::Response::INPUT)
-      getInputs.request.channels.push_back(i);
-  if (getInputsClient.call(getInputs)) {
-    for (int i = 0; i < getInputs.request.channels.size(); ++i)
-      printf("\r%11s %2d: %12.2f V\n", "Channel",
-        getInputs.request.channels[i],
-        getInputs.response.voltage[i]);
+  for (int i = 0; i < servos.size(); ++i) {
+    if (servoState && (servos[i] < servoState->position.size()))
+      printf("\r%11s %2d: %12.2f deg\n", "Channel", servos[i],
+        servoState->position[servos[i]]*180.0/M_PI);
+    else
+      printf("\r%11s %2d: %12s    \n", "Channel", servos[i], "n/a");
   }
-  else {
-    for (int i = 0; i < getInputs.request.channels.size(); ++i)
-      printf("\r%11s %2d: %12s  \n", "Channel",
-        getInputs.request.channels[i], "n/a");
+
+  for (int i = 0; i < inputs.size(); ++i) {
+    if (servoState && (inputs[i] < servoState->voltage.size()))
+      printf("\r%11s %2d: %12.2f V\n", "Channel", inputs[i],
+        servoState->voltage[inputs[i]]);
+    else
+      printf("\r%11s %2d: %12s  \n", "Channel", inputs[i], "n/a");
   }
 
-  numLines = 2+getPositions.response.actual.size()+
-    getInputs.response.voltage.size();
+  numLines = 2+servos.size()+inputs.size();
   printf("%c[%dA\r", 0x1B, numLines);
 }
 
@@ -115,14 +107,10 @@ int main(int argc, char **argv) {
   node.param<std::string>("server/name", serverName, serverName);
   node.param<double>("client/update", clientUpdate, clientUpdate);
 
-  getErrorsClient = node.serviceClient<GetErrors>(
-    "/"+serverName+"/get_errors");
   getChannelsClient = node.serviceClient<GetChannels>(
     "/"+serverName+"/get_channels");
-  getPositionsClient = node.serviceClient<GetPositions>(
-    "/"+serverName+"/get_positions");
-  getInputsClient = node.serviceClient<GetInputs>(
-    "/"+serverName+"/get_inputs");
+  servoStateSubscriber = node.subscribe("/"+serverName+"/servo_state", 1,
+    receiveServoState, ros::TransportHints().tcpNoDelay());
 
   ros::Timer updateTimer = node.createTimer(
     ros::Duration(clientUpdate), update);
@@ -0,0 +1,89 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Ralf Kaestner                                   *
+ *   ralf.kaestner@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#include <vector>
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include "naro_trace/trace.h"
+
+using namespace naro_trace;
+
+/** Microbenchmark of span recording
+  *
+  * Reports the cost of a scoped span in nanoseconds with the tracer
+  * disabled, enabled from a single thread and enabled from several
+  * threads recording into the same ring, and the cost of a dump.
+  */
+
+const size_t numSpans = 1 << 22;
+const size_t numThreads = 4;
+
+Tracer tracer;
+
+void* recordSpans(void* arg) {
+  size_t count = *static_cast<size_t*>(arg);
+
+  for (size_t i = 0; i < count; ++i) {
+    Scope scope(tracer, stageFinControl);
+    scope.setTrace(i+1);
+  }
+
+  return 0;
+}
+
+double timeSpans(size_t threads) {
+  std::vector<pthread_t> ids(threads);
+  size_t count = numSpans/threads;
+
+  uint64_t start = now();
+  for (size_t i = 0; i < threads; ++i)
+    pthread_create(&ids[i], 0, recordSpans, &count);
+  for (size_t i = 0; i < threads; ++i)
+    pthread_join(ids[i], 0);
+
+  return (double)(now()-start)*threads/(count*threads);
+}
+
+int main(int argc, char** argv) {
+  printf("%-28s %10s\n", "Configuration", "Span [ns]");
+
+  printf("%-28s %10.1f\n", "disabled", timeSpans(1));
+
+  tracer.enable(4096);
+  printf("%-28s %10.1f\n", "enabled, 1 thread", timeSpans(1));
+  printf("%-28s %10.1f\n", "enabled, 4 threads", timeSpans(numThreads));
+
+  const char* file = "/tmp/trace_benchmark.bin";
+  uint64_t start = now();
+  int numDumped = tracer.dump(file);
+  double dumpTime = (now()-start)*1e-3;
+  remove(file);
+
+  if (numDumped < 0) {
+    fprintf(stderr, "Failed to dump trace to %s\n", file);
+    return 1;
+  }
+  printf("\nDump of %d span(s): %.1f us\n", numDumped, dumpTime);
+
+  return 0;
+}
@@ -0,0 +1,128 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Ralf Kaestner                                   *
+ *   ralf.kaestner@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#include <vector>
+#include <algorithm>
+
+#include <stdio.h>
+
+#include "naro_trace/trace.h"
+
+using namespace naro_trace;
+
+/** Offline statistics of binary trace dumps
+  *
+  * Reads the dumps of all nodes along the pipeline, joins their spans by
+  * trace identifier and prints per-stage percentiles of the time spent in
+  * each stage and of the latency from the input to the end of each stage,
+  * in microseconds. Latencies only count for traces whose input span has
+  * not been overwritten. Only the first span of a trace per stage counts, as
+  * the fin controller may forward a command over several control ticks.
+  */
+
+bool compare(const Span& a, const Span& b) {
+  return (a.trace < b.trace) || ((a.trace == b.trace) && (a.begin < b.begin));
+}
+
+double getPercentile(std::vector<double>& values, double percentile) {
+  if (values.empty())
+    return 0.0;
+
+  size_t index = (size_t)(percentile*(values.size()-1)+0.5);
+  std::nth_element(values.begin(), values.begin()+index, values.end());
+
+  return values[index];
+}
+
+void printStatistics(const char* name, std::vector<double>& values) {
+  if (values.empty())
+    return;
+
+  double p50 = getPercentile(values, 0.5);
+  double p90 = getPercentile(values, 0.9);
+  double p99 = getPercentile(values, 0.99);
+  double max = *std::max_element(values.begin(), values.end());
+
+  printf("%-14s %8lu %10.1f %10.1f %10.1f %10.1f\n", name,
+    (unsigned long)values.size(), p50, p90, p99, max);
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s FILE [FILE ...]\n", argv[0]);
+    return 1;
+  }
+
+  std::vector<Span> spans;
+  for (int i = 1; i < argc; ++i)
+    if (!load(argv[i], spans)) {
+      fprintf(stderr, "Failed to load trace dump %s\n", argv[i]);
+      return 1;
+    }
+  std::sort(spans.begin(), spans.end(), compare);
+
+  std::vector<double> durations[numStages];
+  std::vector<double> latencies[numStages];
+  std::vector<double> totals;
+  size_t numTraces = 0;
+
+  for (size_t i = 0; i < spans.size(); ) {
+    size_t j = i;
+    uint64_t origin = spans[i].begin;
+    uint64_t end = spans[i].end;
+    bool rooted = (spans[i].stage == stageInput);
+    bool seen[numStages] = {false};
+
+    for ( ; (j < spans.size()) && (spans[j].trace == spans[i].trace); ++j) {
+      const Span& span = spans[j];
+      if ((span.stage >= numStages) || seen[span.stage])
+        continue;
+
+      seen[span.stage] = true;
+      durations[span.stage].push_back((span.end-span.begin)*1e-3);
+      if (rooted)
+        latencies[span.stage].push_back((span.end-origin)*1e-3);
+      end = std::max(end, span.end);
+    }
+
+    if (rooted && seen[stageUscTransfer])
+      totals.push_back((end-origin)*1e-3);
+
+    ++numTraces;
+    i = j;
+  }
+
+  printf("%lu span(s) of %lu trace(s)\n\n", (unsigned long)spans.size(),
+    (unsigned long)numTraces);
+
+  printf("%-14s %8s %10s %10s %10s %10s\n", "Duration [us]", "Count",
+    "p50", "p90", "p99", "max");
+  for (unsigned int stage = 0; stage < numStages; ++stage)
+    printStatistics(getStageName(stage), durations[stage]);
+
+  printf("\n%-14s %8s %10s %10s %10s %10s\n", "Latency [us]", "Count",
+    "p50", "p90", "p99", "max");
+  for (unsigned int stage = 0; stage < numStages; ++stage)
+    printStatistics(getStageName(stage), latencies[stage]);
+  printStatistics("end-to-end", totals);
+
+  return 0;
+}
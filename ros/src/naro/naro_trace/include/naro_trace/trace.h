@@ -0,0 +1,331 @@
+/***************************************************************************
+ *   Copyright (C) 2013 by Ralf Kaestner                                   *
+ *   ralf.kaestner@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#ifndef NARO_TRACE_TRACE_H
+#define NARO_TRACE_TRACE_H
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+namespace naro_trace {
+  /** Stages of the joystick to servo pipeline, in the order a command
+    * passes them
+    */
+  enum Stage {
+    stageInput,           // from the joystick driver to the joy command
+    stageJoyCommand,      // mapping and forwarding in the joy command
+    stageFinCommands,     // applying commands in the fin controller
+    stageFinControl,      // control tick computing the servo profiles
+    stageUscProfiles,     // applying profiles in the USC server
+    stageUscTransfer,     // USB transfers of the applied profiles
+    numStages
+  };
+
+  inline const char* getStageName(unsigned int stage) {
+    static const char* names[] = {"input", "joy_command", "fin_commands",
+      "fin_control", "usc_profiles", "usc_transfer"};
+
+    return (stage < numStages) ? names[stage] : "unknown";
+  };
+
+  /** Monotonic time in nanoseconds, shared by all nodes on the host
+    */
+  inline uint64_t now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return (uint64_t)time.tv_sec*1000000000ULL+time.tv_nsec;
+  };
+
+  /** Time a traced item spent in one stage of the pipeline
+    *
+    * Spans of the same item share its trace identifier, which is assigned
+    * at the input and carried along with the commands and profiles. Zero
+    * identifies untraced items.
+    */
+  class Span {
+  public:
+    uint64_t begin;                     // [ns]
+    uint64_t end;                       // [ns]
+    uint32_t trace;
+    uint16_t stage;
+    uint16_t reserved;
+  };
+
+  /** Header of a binary trace dump, followed by its spans in host byte
+    * order
+    */
+  class Header {
+  public:
+    char magic[4];
+    uint32_t version;
+    uint32_t numSpans;
+    uint32_t spanSize;
+  };
+
+  static const char magic[4] = {'N', 'T', 'R', 'C'};
+  static const uint32_t version = 1;
+
+  /** Lock-free ring buffer of the most recent spans of a node
+    *
+    * Any thread records a span by claiming the next slot with a single
+    * atomic increment and writing it under the slot's sequence number,
+    * such that recording never blocks or allocates. When full, the oldest
+    * spans are overwritten. Readers copy the slots and discard those
+    * being written. A slot claimed by two writers at once, which takes
+    * the ring to wrap around during a single write, may yield a torn
+    * span.
+    */
+  class Ring {
+  public:
+    Ring(size_t capacity = 0) :
+      head(0),
+      mask(0),
+      slots(0) {
+      resize(capacity);
+    };
+
+    ~Ring() {
+      delete[] slots;
+    };
+
+    size_t getCapacity() const {
+      return slots ? mask+1 : 0;
+    };
+
+    /** Resize the ring to the given capacity rounded up to a power of
+      * two, which clears it and must not race with recording
+      */
+    void resize(size_t capacity) {
+      delete[] slots;
+      slots = 0;
+      head = mask = 0;
+
+      if (capacity) {
+        size_t size = 1;
+        while (size < capacity)
+          size <<= 1;
+
+        slots = new Slot[size];
+        memset(slots, 0, size*sizeof(Slot));
+        mask = size-1;
+      }
+    };
+
+    /** Total number of spans recorded, including overwritten ones
+      */
+    uint32_t getNumRecorded() const {
+      return head;
+    };
+
+    void record(const Span& span) {
+      if (!slots)
+        return;
+
+      uint32_t index = __sync_fetch_and_add(&head, 1);
+      Slot& slot = slots[index & mask];
+
+      slot.sequence = 2*index+1;
+      __sync_synchronize();
+      slot.span = span;
+      __sync_synchronize();
+      slot.sequence = 2*index+2;
+    };
+
+    /** Append a consistent copy of all recorded spans to the given
+      * vector and return the number of spans appended
+      */
+    size_t copy(std::vector<Span>& spans) const {
+      size_t numSpans = 0;
+
+      for (size_t i = 0; i < getCapacity(); ++i) {
+        uint32_t before = slots[i].sequence;
+        if (!before || (before & 1))
+          continue;
+
+        __sync_synchronize();
+        Span span = slots[i].span;
+        __sync_synchronize();
+
+        if (before == slots[i].sequence) {
+          spans.push_back(span);
+          ++numSpans;
+        }
+      }
+
+      return numSpans;
+    };
+
+  private:
+    struct Slot {
+      volatile uint32_t sequence;
+      Span span;
+    };
+
+    Ring(const Ring&);
+    Ring& operator=(const Ring&);
+
+    volatile uint32_t head;
+    uint32_t mask;
+    Slot* slots;
+  };
+
+  /** Span tracer of a node, which records nothing while disabled or for
+    * untraced items
+    */
+  class Tracer {
+  public:
+    Tracer() :
+      enabled(false) {
+    };
+
+    bool isEnabled() const {
+      return enabled;
+    };
+
+    /** Enable the tracer with a ring of the given capacity, or disable it
+      * for a capacity of zero
+      */
+    void enable(size_t capacity) {
+      enabled = false;
+      ring.resize(capacity);
+      enabled = ring.getCapacity();
+    };
+
+    const Ring& getRing() const {
+      return ring;
+    };
+
+    void record(uint32_t trace, Stage stage, uint64_t begin, uint64_t end) {
+      if (!enabled || !trace)
+        return;
+
+      Span span;
+      span.begin = begin;
+      span.end = end;
+      span.trace = trace;
+      span.stage = stage;
+      span.reserved = 0;
+
+      ring.record(span);
+    };
+
+    /** Write all recorded spans to a binary dump and return the number of
+      * spans written, or a negative value on failure
+      */
+    int dump(const std::string& file) const {
+      std::vector<Span> spans;
+      spans.reserve(ring.getCapacity());
+      ring.copy(spans);
+
+      FILE* stream = fopen(file.c_str(), "wb");
+      if (!stream)
+        return -1;
+
+      Header header;
+      memcpy(header.magic, magic, sizeof(magic));
+      header.version = version;
+      header.numSpans = spans.size();
+      header.spanSize = sizeof(Span);
+
+      bool result = (fwrite(&header, sizeof(header), 1, stream) == 1) &&
+        (spans.empty() || (fwrite(&spans[0], sizeof(Span), spans.size(),
+        stream) == spans.size()));
+
+      if (fclose(stream))
+        result = false;
+
+      return result ? (int)spans.size() : -1;
+    };
+
+  private:
+    Tracer(const Tracer&);
+    Tracer& operator=(const Tracer&);
+
+    volatile bool enabled;
+    Ring ring;
+  };
+
+  /** Span of the enclosing scope, recorded on leaving it
+    *
+    * The trace identifier may be set after entering the scope, when the
+    * traced item has not been received yet.
+    */
+  class Scope {
+  public:
+    Scope(Tracer& tracer, Stage stage, uint32_t trace = 0) :
+      tracer(tracer),
+      stage(stage),
+      trace(trace),
+      begin(tracer.isEnabled() ? now() : 0) {
+    };
+
+    ~Scope() {
+      if (trace && begin)
+        tracer.record(trace, stage, begin, now());
+    };
+
+    void setTrace(uint32_t trace) {
+      this->trace = trace;
+    };
+
+  private:
+    Tracer& tracer;
+    Stage stage;
+    uint32_t trace;
+    uint64_t begin;
+  };
+
+  /** Append the spans of a binary dump to the given vector
+    */
+  inline bool load(const std::string& file, std::vector<Span>& spans) {
+    FILE* stream = fopen(file.c_str(), "rb");
+    if (!stream)
+      return false;
+
+    Header header;
+    bool result = (fread(&header, sizeof(header), 1, stream) == 1) &&
+      !memcmp(header.magic, magic, sizeof(magic)) &&
+      (header.version == version) && (header.spanSize == sizeof(Span));
+
+    if (result && header.numSpans) {
+      size_t offset = spans.size();
+      spans.resize(offset+header.numSpans);
+
+      if (fread(&spans[offset], sizeof(Span), header.numSpans, stream) !=
+          header.numSpans) {
+        spans.resize(offset);
+        result = false;
+      }
+    }
+
+    fclose(stream);
+    return result;
+  };
+};
+
+#endif
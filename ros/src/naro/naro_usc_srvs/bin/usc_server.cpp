@@ -20,6 +20,9 @@
 
 #include <fstream>
 #include <limits>
+#include <map>
+
+#include <string.h>
 
 #include <usb/context.h>
 #include <usb/error.h>
@@ -36,9 +39,23 @@
 #include <usc/usb/setspeed.h>
 #include <usc/usb/setacceleration.h>
 
+#include <boost/thread.hpp>
+
 #include <ros/ros.h>
+#include <ros/callback_queue.h>
 #include <diagnostic_updater/diagnostic_updater.h>
 
+#ifdef NARO_NODELET
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#endif
+
+#include <naro_shm/segment.h>
+#include <naro_shm/frames.h>
+
+#include <naro_trace/trace.h>
+#include <naro_trace/DumpTrace.h>
+
 #include "naro_usc_srvs/GetErrors.h"
 #include "naro_usc_srvs/GetChannels.h"
 #include "naro_usc_srvs/GetPositions.h"
@@ -53,14 +70,33 @@
 #include "naro_usc_srvs/SetAccelerations.h"
 #include "naro_usc_srvs/SetProfiles.h"
 #include "naro_usc_srvs/SetOutputs.h"
+#include "naro_usc_srvs/ServoState.h"
+#include "naro_usc_srvs/Profiles.h"
+#include "naro_usc_srvs/ProfilesStatus.h"
+#include "naro_usc_srvs/InputSamples.h"
 
 using namespace naro_usc_srvs;
 
+namespace {
+
 double connectionRetry = 0.1;
 std::string deviceAddress = "/dev/naro/usc";
 double deviceTimeout = 0.1;
 float servosTransmission = 0.001f;
 std::string configurationFile = "etc/usc.xml";
+double transferHistogramResolution = 1e-3;
+int transferHistogramBins = 50;
+double acquisitionFrequency = 50.0;
+bool oversamplingEnabled = false;
+int oversamplingChannel = 11;
+int oversamplingBlockSize = 32;
+double oversamplingFrequency = 0.0;
+double oversamplingMinInterval = 2e-4;
+bool sharedMemoryEnabled = false;
+double sharedMemoryPollFrequency = 500.0;
+bool traceEnabled = false;
+int traceCapacity = 4096;
+std::string traceFile;
 
 boost::shared_ptr<diagnostic_updater::Updater> updater;
 std::string configurationError;
@@ -69,6 +105,14 @@ Pololu::Pointer<Pololu::Usb::Context> context;
 Pololu::Pointer<Pololu::Usb::Interface> interface;
 Pololu::Pointer<Pololu::Usc::Device> device;
 Pololu::Usc::Usb::Mini::Settings settings(0);
+/** The device lock also guards the batch, from the first register set
+  * until its commit returns, since several threads fill it
+  */
+boost::recursive_mutex deviceMutex;
+
+/** Spans of applying traced profiles and of their USB transfers
+  */
+naro_trace::Tracer tracer;
 
 ros::ServiceServer getErrorsService;
 ros::ServiceServer getChannelsService;
@@ -84,6 +128,41 @@ ros::ServiceServer setSpeedsService;
 ros::ServiceServer setAccelerationsService;
 ros::ServiceServer setProfilesService;
 ros::ServiceServer setOutputsService;
+ros::ServiceServer dumpTraceService;
+
+ros::Publisher servoStatePublisher;
+ros::Publisher profilesStatusPublisher;
+ros::Publisher inputSamplesPublisher;
+ros::Subscriber profilesSubscriber;
+
+ros::Timer diagnosticsTimer;
+ros::Timer connectionTimer;
+
+ros::CallbackQueue profilesQueue;
+boost::shared_ptr<ros::AsyncSpinner> profilesSpinner;
+ProfilesStatus profilesStatus;
+ros::Time profilesStamp;
+
+/** Receipt time of the last profiles set through the service, guarded by
+  * the device lock
+  *
+  * Frames from the topic or the shared memory segment stamped earlier were
+  * computed before the call and would undo it, such as the homing of servos
+  * just disabled by the fin controller.
+  */
+ros::Time setProfilesStamp;
+
+naro_shm::Segment<naro_shm::ServoState> servoStateSegment;
+naro_shm::Segment<naro_shm::Profiles> profilesSegment;
+boost::thread sharedProfilesThread;
+volatile bool running = false;
+unsigned int sharedProfilesApplied = 0;
+unsigned int sharedProfilesDropped = 0;
+
+boost::thread samplingThread;
+volatile double samplingRate = 0.0;
+volatile unsigned long numSamplingBlocks = 0;
+volatile unsigned long numSamplingFailures = 0;
 
 const float pi = M_PI;
 
@@ -93,6 +172,145 @@ template <typename T> inline T clamp(const T& x,
   return x < min ? min : (x > max ? max : x);
 }
 
+/** Histogram over fixed-width bins, the last bin collecting all values
+  * beyond the histogram range
+  */
+class Histogram {
+public:
+  Histogram(double resolution = 1e-3, size_t numBins = 50) :
+    resolution(resolution),
+    bins(numBins+1, 0),
+    numSamples(0),
+    sum(0.0),
+    maximum(0.0) {
+  };
+
+  void add(double value) {
+    value = std::max(value, 0.0);
+    size_t bin = std::min<size_t>(value/resolution, bins.size()-1);
+
+    ++bins[bin];
+    ++numSamples;
+    sum += value;
+    maximum = std::max(maximum, value);
+  };
+
+  double getMean() const {
+    if (numSamples)
+      return sum/numSamples;
+    else
+      return std::numeric_limits<double>::quiet_NaN();
+  };
+
+  /** Upper bin boundary below which the given fraction of samples lies
+    */
+  double getPercentile(double percentile) const {
+    size_t rank = ceil(percentile*numSamples), count = 0;
+
+    for (size_t i = 0; i+1 < bins.size(); ++i) {
+      count += bins[i];
+      if (count && (count >= rank))
+        return (i+1)*resolution;
+    }
+
+    if (numSamples)
+      return maximum;
+    else
+      return std::numeric_limits<double>::quiet_NaN();
+  };
+
+  double resolution;
+  std::vector<size_t> bins;
+  size_t numSamples;
+  double sum;
+  double maximum;
+};
+
+class TransferStatistics {
+public:
+  TransferStatistics() :
+    latency(transferHistogramResolution, transferHistogramBins),
+    numTransfers(0) {
+  };
+
+  Histogram latency;
+  size_t numTransfers;
+};
+
+std::map<std::string, TransferStatistics> transferStatistics;
+
+/** Servo and device variables acquired from the controller at a given time
+  */
+class Snapshot {
+public:
+  static const size_t maxChannels = 24;
+
+  class Servo {
+  public:
+    unsigned short position;
+    unsigned short target;
+    unsigned short speed;
+    unsigned char acceleration;
+  };
+
+  Snapshot() :
+    valid(false),
+    errors(0),
+    numChannels(0) {
+  };
+
+  bool valid;
+  ros::Time stamp;
+  unsigned short errors;
+  size_t numChannels;
+  Servo servos[maxChannels];
+};
+
+/** Double-buffered snapshot shared between the acquisition thread as the
+  * single writer and any number of readers
+  *
+  * The writer always fills the buffer not referred to by the current
+  * sequence number and publishes it by incrementing the sequence number.
+  * Readers never block, but retry their copy if a new snapshot has been
+  * published meanwhile.
+  */
+class SnapshotBuffer {
+public:
+  SnapshotBuffer() :
+    sequence(0) {
+  };
+
+  void write(const Snapshot& snapshot) {
+    unsigned int next = sequence+1;
+
+    buffers[next & 1] = snapshot;
+    __sync_synchronize();
+    sequence = next;
+  };
+
+  Snapshot read() const {
+    Snapshot snapshot;
+    unsigned int current;
+
+    do {
+      current = sequence;
+      __sync_synchronize();
+      snapshot = buffers[current & 1];
+      __sync_synchronize();
+    }
+    while (current != sequence);
+
+    return snapshot;
+  };
+
+private:
+  Snapshot buffers[2];
+  volatile unsigned int sequence;
+};
+
+SnapshotBuffer snapshots;
+boost::thread acquisitionThread;
+
 inline bool isServo(int channel) {
   return (channel >= 0) && (channel < settings.channels.size()) &&
     ((settings.channels[channel].mode ==
@@ -156,6 +374,198 @@ inline unsigned char angularAccelerationToQus(int channel, float
     return 0;
 }
 
+bool transfer(Pololu::Usb::Request& request, const std::string& name);
+
+/** Pending channel writes of a single service call, committed to the device
+  * in one pass
+  *
+  * The USB control interface of the controller only accepts one channel
+  * per SetTarget/SetSpeed/SetAcceleration request. Instead of interleaving
+  * transfers with request processing, all writes are thus collected first
+  * and then issued back-to-back. Repeated writes to the same channel are
+  * coalesced, and accelerations and speeds precede targets so that the new
+  * profile applies to the movement towards the new target.
+  *
+  * Each channel further shadows the register values last committed to the
+  * device. A pending write which quantizes to the shadowed value is elided
+  * and never reaches the bus.
+  */
+class Batch {
+public:
+  enum Registers {
+    registerTarget = 0x01,
+    registerSpeed = 0x02,
+    registerAcceleration = 0x04,
+    registerAll = 0x07
+  };
+
+  class Channel {
+  public:
+    Channel() :
+      target(0),
+      speed(0),
+      acceleration(0),
+      dirty(0),
+      shadowTarget(0),
+      shadowSpeed(0),
+      shadowAcceleration(0),
+      valid(0) {
+    };
+
+    unsigned short target;
+    unsigned short speed;
+    unsigned char acceleration;
+    unsigned char dirty;
+
+    unsigned short shadowTarget;
+    unsigned short shadowSpeed;
+    unsigned char shadowAcceleration;
+    unsigned char valid;
+  };
+
+  Batch() :
+    numSent(0),
+    numElided(0) {
+  };
+
+  void setTarget(int channel, unsigned short target) {
+    getChannel(channel).target = target;
+    channels[channel].dirty |= registerTarget;
+  };
+
+  void setSpeed(int channel, unsigned short speed) {
+    getChannel(channel).speed = speed;
+    channels[channel].dirty |= registerSpeed;
+  };
+
+  void setAcceleration(int channel, unsigned char acceleration) {
+    getChannel(channel).acceleration = acceleration;
+    channels[channel].dirty |= registerAcceleration;
+  };
+
+  /** Invalidate the shadowed registers of all channels, e.g., after the
+    * device has been (re-)connected or reinitialized
+    */
+  void invalidate() {
+    for (int i = 0; i < channels.size(); ++i)
+      channels[i].valid = 0;
+  };
+
+  bool commit(const std::string& name, uint32_t trace = 0) {
+    boost::recursive_mutex::scoped_lock lock(deviceMutex);
+    Pololu::Usc::Usb::SetTarget setTargetRequest(settings.channels.size());
+    Pololu::Usc::Usb::SetSpeed setSpeedRequest(settings.channels.size());
+    Pololu::Usc::Usb::SetAcceleration setAccelerationRequest(
+      settings.channels.size());
+    size_t numTransfers = 0;
+    bool result = true;
+
+    for (int i = 0; i < pending.size(); ++i) {
+      Channel& channel = channels[pending[i]];
+
+      if ((channel.valid & registerTarget) &&
+          (channel.target == channel.shadowTarget))
+        elide(channel, registerTarget);
+      if ((channel.valid & registerSpeed) &&
+          (channel.speed == channel.shadowSpeed))
+        elide(channel, registerSpeed);
+      if ((channel.valid & registerAcceleration) &&
+          (channel.acceleration == channel.shadowAcceleration))
+        elide(channel, registerAcceleration);
+    }
+
+    ros::WallTime startTime = ros::WallTime::now();
+    naro_trace::Scope scope(tracer, naro_trace::stageUscTransfer, trace);
+
+    for (int i = 0; i < pending.size(); ++i) {
+      if (channels[pending[i]].dirty & registerAcceleration) {
+        Channel& channel = channels[pending[i]];
+
+        setAccelerationRequest.setServo(pending[i]);
+        setAccelerationRequest.setValue(channel.acceleration);
+
+        if (transfer(setAccelerationRequest, "SetAcceleration")) {
+          channel.shadowAcceleration = channel.acceleration;
+          channel.valid |= registerAcceleration;
+        }
+        else
+          result = false;
+        ++numTransfers;
+      }
+    }
+
+    for (int i = 0; i < pending.size(); ++i) {
+      if (channels[pending[i]].dirty & registerSpeed) {
+        Channel& channel = channels[pending[i]];
+
+        setSpeedRequest.setServo(pending[i]);
+        setSpeedRequest.setValue(channel.speed);
+
+        if (transfer(setSpeedRequest, "SetSpeed")) {
+          channel.shadowSpeed = channel.speed;
+          channel.valid |= registerSpeed;
+        }
+        else
+          result = false;
+        ++numTransfers;
+      }
+    }
+
+    for (int i = 0; i < pending.size(); ++i) {
+      if (channels[pending[i]].dirty & registerTarget) {
+        Channel& channel = channels[pending[i]];
+
+        setTargetRequest.setServo(pending[i]);
+        setTargetRequest.setValue(channel.target);
+
+        if (transfer(setTargetRequest, "SetTarget")) {
+          channel.shadowTarget = channel.target;
+          channel.valid |= registerTarget;
+        }
+        else
+          result = false;
+        ++numTransfers;
+      }
+    }
+
+    for (int i = 0; i < pending.size(); ++i)
+      channels[pending[i]].dirty = 0;
+    pending.clear();
+
+    TransferStatistics& statistics = transferStatistics[name];
+    statistics.latency.add((ros::WallTime::now()-startTime).toSec());
+    statistics.numTransfers += numTransfers;
+    numSent += numTransfers;
+
+    return result;
+  };
+
+  std::vector<Channel> channels;
+  std::vector<int> pending;
+
+  size_t numSent;
+  size_t numElided;
+
+private:
+  Channel& getChannel(int channel) {
+    if (channel >= channels.size())
+      channels.resize(channel+1);
+    if (!channels[channel].dirty)
+      pending.push_back(channel);
+
+    return channels[channel];
+  };
+
+  void elide(Channel& channel, unsigned char reg) {
+    if (channel.dirty & reg) {
+      channel.dirty &= ~reg;
+      ++numElided;
+    }
+  };
+};
+
+Batch batch;
+
 void getParameters(const ros::NodeHandle& node) {
   node.param<double>("connection/retry", connectionRetry, connectionRetry);
   node.param<std::string>("device/address", deviceAddress, deviceAddress);
@@ -166,6 +576,29 @@ void getParameters(const ros::NodeHandle& node) {
   ::servosTransmission = servosTransmission;
   node.param<std::string>("configuration/file", configurationFile,
     configurationFile);
+  node.param<double>("transfer/histogram/resolution",
+    transferHistogramResolution, transferHistogramResolution);
+  node.param<int>("transfer/histogram/bins", transferHistogramBins,
+    transferHistogramBins);
+  node.param<double>("acquisition/frequency", acquisitionFrequency,
+    acquisitionFrequency);
+  node.param<bool>("oversampling/enabled", oversamplingEnabled,
+    oversamplingEnabled);
+  node.param<int>("oversampling/channel", oversamplingChannel,
+    oversamplingChannel);
+  node.param<int>("oversampling/block_size", oversamplingBlockSize,
+    oversamplingBlockSize);
+  node.param<double>("oversampling/frequency", oversamplingFrequency,
+    oversamplingFrequency);
+  node.param<double>("oversampling/min_interval", oversamplingMinInterval,
+    oversamplingMinInterval);
+  node.param<bool>("shared_memory/enabled", sharedMemoryEnabled,
+    sharedMemoryEnabled);
+  node.param<double>("shared_memory/poll_frequency",
+    sharedMemoryPollFrequency, sharedMemoryPollFrequency);
+  node.param<bool>("trace/enabled", traceEnabled, traceEnabled);
+  node.param<int>("trace/capacity", traceCapacity, traceCapacity);
+  node.param<std::string>("trace/file", traceFile, traceFile);
 }
 
 void diagnoseContext(diagnostic_updater::DiagnosticStatusWrapper
@@ -244,6 +677,109 @@ void diagnoseTransfer(diagnostic_updater::DiagnosticStatusWrapper
       "Transfer to Pololu device failed: No connection.");
 }
 
+void diagnoseLatency(diagnostic_updater::DiagnosticStatusWrapper
+    &status) {
+  if (!transferStatistics.empty()) {
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "Transfer latencies recorded for %d request(s).",
+      (unsigned int)transferStatistics.size());
+
+    for (std::map<std::string, TransferStatistics>::const_iterator
+        it = transferStatistics.begin(); it != transferStatistics.end();
+        ++it) {
+      const Histogram& latency = it->second.latency;
+
+      status.addf(it->first+" calls", "%u", (unsigned int)latency.numSamples);
+      status.addf(it->first+" transfers per call", "%.2f",
+        latency.numSamples ? (double)it->second.numTransfers/
+        latency.numSamples : 0.0);
+      status.addf(it->first+" latency", "mean %.2f ms, 50%% < %.2f ms, "
+        "95%% < %.2f ms, 99%% < %.2f ms, max %.2f ms",
+        latency.getMean()*1e3, latency.getPercentile(0.5)*1e3,
+        latency.getPercentile(0.95)*1e3, latency.getPercentile(0.99)*1e3,
+        latency.maximum*1e3);
+    }
+  }
+  else
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "No transfer latencies recorded.");
+}
+
+void diagnoseAcquisition(diagnostic_updater::DiagnosticStatusWrapper
+    &status) {
+  if (acquisitionFrequency > 0.0) {
+    Snapshot snapshot = snapshots.read();
+
+    if (snapshot.valid) {
+      double age = (ros::Time::now()-snapshot.stamp).toSec();
+
+      if (age <= 2.0/acquisitionFrequency)
+        status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+          "Servo variables acquired at %.1f Hz.", acquisitionFrequency);
+      else
+        status.summaryf(diagnostic_msgs::DiagnosticStatus::WARN,
+          "Servo variables outdated.");
+      status.addf("Age", "%.1f ms", age*1e3);
+    }
+    else
+      status.summaryf(diagnostic_msgs::DiagnosticStatus::ERROR,
+        "No servo variables acquired.");
+  }
+  else
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "Servo variables acquired on request.");
+}
+
+void diagnoseOversampling(diagnostic_updater::DiagnosticStatusWrapper
+    &status) {
+  if (!oversamplingEnabled)
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "Input oversampling disabled.");
+  else if (samplingRate > 0.0)
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "Input channel %d sampled at %.1f Hz.", oversamplingChannel,
+      samplingRate);
+  else
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::WARN,
+      "Input channel %d not sampled.", oversamplingChannel);
+
+  if (oversamplingEnabled) {
+    status.addf("Block size", "%d", oversamplingBlockSize);
+    status.addf("Blocks", "%lu", numSamplingBlocks);
+    status.addf("Failures", "%lu", numSamplingFailures);
+  }
+}
+
+void diagnoseSharedMemory(diagnostic_updater::DiagnosticStatusWrapper
+    &status) {
+  if (!sharedMemoryEnabled)
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "Shared memory transport disabled.");
+  else if (!servoStateSegment.isOpen() || !profilesSegment.isOpen())
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::WARN,
+      "Not all shared memory segments created.");
+  else
+    status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+      "Shared memory segments created.");
+
+  if (sharedMemoryEnabled) {
+    status.addf("Servo state frames", "%u", servoStateSegment.getSequence());
+    status.addf("Profiles applied", "%u", sharedProfilesApplied);
+    status.addf("Profiles dropped", "%u", sharedProfilesDropped);
+  }
+}
+
+void diagnoseWrites(diagnostic_updater::DiagnosticStatusWrapper
+    &status) {
+  size_t numWrites = batch.numSent+batch.numElided;
+
+  status.summaryf(diagnostic_msgs::DiagnosticStatus::OK,
+    "%u write(s) sent, %u write(s) elided.", (unsigned int)batch.numSent,
+    (unsigned int)batch.numElided);
+  status.addf("Elided", "%.1f %%", numWrites ?
+    100.0*batch.numElided/numWrites : 0.0);
+}
+
 void syncSettings(const std::string& filename) {
   std::ifstream file(configurationFile.c_str());
 
@@ -296,6 +832,7 @@ bool connect() {
     updater->force_update();
 
     syncSettings(configurationFile);
+    batch.invalidate();
     updater->force_update();
 
     ROS_INFO("%s device connected at %s.", device->getName().c_str(),
@@ -331,38 +868,267 @@ void disconnect() {
 }
 
 bool transfer(Pololu::Usb::Request& request, const std::string& name) {
+  boost::recursive_mutex::scoped_lock lock(deviceMutex);
+
   if (!device.isNull() && device->isConnected()) {
     try {
       interface->transfer(request);
     }
     catch (const Pololu::Usb::Error& error) {
-      ROS_WARN("%s request failed: %s", name.c_str(), error.what());
+      ROS_WARN_THROTTLE(1.0, "%s request failed: %s", name.c_str(),
+        error.what());
 
+      /** The request never reached the device, even if reconnecting
+        * succeeds, such that its response and the batch shadows remain
+        * invalid
+        */
       if (error == Pololu::Usb::Error::device) {
         ROS_INFO("Retrying connection now.");
 
         disconnect();
         connect();
       }
+
+      return false;
     }
     catch (const Pololu::Exception& exception) {
-      ROS_WARN("%s request failed: %s", name.c_str(), exception.what());
+      ROS_WARN_THROTTLE(1.0, "%s request failed: %s", name.c_str(),
+        exception.what());
       return false;
     }
   }
   else {
-    ROS_WARN("%s request failed: Device not connected.", name.c_str());
+    ROS_WARN_THROTTLE(1.0, "%s request failed: Device not connected.",
+      name.c_str());
     return false;
   }
 
   return true;
 }
 
-bool getErrors(GetErrors::Request& request, GetErrors::Response& response) {
+/** Acquire a snapshot of the servo and device variables from the device
+  */
+bool acquire(Snapshot& snapshot) {
+  boost::recursive_mutex::scoped_lock lock(deviceMutex);
+
+  Pololu::Usc::Usb::Mini::GetServoVariables
+    getServoVariablesRequest(settings.channels.size());
   Pololu::Usc::Usb::Mini::GetVariables getVariablesRequest;
 
-  if (transfer(getVariablesRequest, "GetVariables"))
-    response.errors = getVariablesRequest.getResponse().errorOccurred;
+  if (!transfer(getServoVariablesRequest, "GetServoVariables") ||
+      !transfer(getVariablesRequest, "GetVariables"))
+    return false;
+
+  Pololu::Usc::Usb::Variables::Servos variables =
+    getServoVariablesRequest.getResponse();
+
+  snapshot.stamp = ros::Time::now();
+  snapshot.errors = getVariablesRequest.getResponse().errorOccurred;
+  snapshot.numChannels = std::min(variables.size(), Snapshot::maxChannels);
+
+  for (int i = 0; i < snapshot.numChannels; ++i) {
+    snapshot.servos[i].position = variables[i].position;
+    snapshot.servos[i].target = variables[i].target;
+    snapshot.servos[i].speed = variables[i].speed;
+    snapshot.servos[i].acceleration = variables[i].acceleration;
+  }
+  snapshot.valid = true;
+
+  return true;
+}
+
+/** Answer from the most recent snapshot of the acquisition thread, or
+  * acquire synchronously if the acquisition thread has been disabled
+  */
+bool getSnapshot(Snapshot& snapshot) {
+  if (acquisitionFrequency > 0.0)
+    snapshot = snapshots.read();
+  else
+    acquire(snapshot);
+
+  return snapshot.valid;
+}
+
+inline bool hasChannel(const Snapshot& snapshot, int channel) {
+  return (channel >= 0) && (channel < snapshot.numChannels);
+}
+
+/** Publish a snapshot as servo state message, with one entry per channel
+  */
+void publish(const Snapshot& snapshot) {
+  ServoState::Ptr servoState(new ServoState());
+  boost::recursive_mutex::scoped_lock lock(deviceMutex);
+
+  servoState->header.stamp = snapshot.stamp;
+  servoState->errors = snapshot.errors;
+
+  servoState->position.resize(snapshot.numChannels);
+  servoState->target.resize(snapshot.numChannels);
+  servoState->speed.resize(snapshot.numChannels);
+  servoState->acceleration.resize(snapshot.numChannels);
+  servoState->voltage.resize(snapshot.numChannels);
+
+  for (int i = 0; i < snapshot.numChannels; ++i) {
+    if (isServo(i)) {
+      servoState->position[i] = qusToAngle(i, snapshot.servos[i].position);
+      servoState->target[i] = qusToAngle(i, snapshot.servos[i].target);
+      servoState->speed[i] = qusToAngularSpeed(i, snapshot.servos[i].speed);
+      servoState->acceleration[i] = qusToAngularAcceleration(i,
+        snapshot.servos[i].acceleration);
+    }
+    else {
+      servoState->position[i] = std::numeric_limits<float>::quiet_NaN();
+      servoState->target[i] = std::numeric_limits<float>::quiet_NaN();
+      servoState->speed[i] = std::numeric_limits<float>::quiet_NaN();
+      servoState->acceleration[i] = std::numeric_limits<float>::quiet_NaN();
+    }
+
+    if (isInput(i))
+      servoState->voltage[i] = snapshot.servos[i].position/1023.0*5.0;
+    else
+      servoState->voltage[i] = std::numeric_limits<float>::quiet_NaN();
+  }
+
+  servoStatePublisher.publish(servoState);
+
+  if (servoStateSegment.isOpen()) {
+    static naro_shm::ServoState frame;
+
+    frame.stamp = snapshot.stamp.toNSec();
+    frame.errors = snapshot.errors;
+    frame.numChannels = std::min<size_t>(snapshot.numChannels,
+      naro_shm::maxChannels);
+
+    for (int i = 0; i < frame.numChannels; ++i) {
+      frame.position[i] = servoState->position[i];
+      frame.target[i] = servoState->target[i];
+      frame.speed[i] = servoState->speed[i];
+      frame.acceleration[i] = servoState->acceleration[i];
+      frame.voltage[i] = servoState->voltage[i];
+    }
+
+    servoStateSegment.write(frame);
+  }
+}
+
+void acquireSnapshots() {
+  ros::WallDuration period(1.0/acquisitionFrequency);
+  ros::WallTime nextTime = ros::WallTime::now();
+
+  while (running && ros::ok()) {
+    bool connected = false;
+    {
+      boost::recursive_mutex::scoped_lock lock(deviceMutex);
+      connected = !device.isNull() && device->isConnected();
+    }
+
+    Snapshot snapshot;
+    if (connected && acquire(snapshot)) {
+      snapshots.write(snapshot);
+      publish(snapshot);
+    }
+    else if (!connected)
+      snapshots.write(Snapshot());
+
+    nextTime = nextTime+period;
+    ros::WallTime now = ros::WallTime::now();
+    if (nextTime > now)
+      (nextTime-now).sleep();
+    else
+      nextTime = now;
+  }
+}
+
+/** Sample a single input channel as fast as the USB link sustains, or at
+  * the oversampling frequency if given, and publish the raw samples in
+  * blocks
+  *
+  * Each sample costs a single GetServoVariables transfer, which is the
+  * cheapest request yielding the input. The device mutex is not fair and
+  * therefore released for at least the minimum interval between samples,
+  * such that profiles are never held back by more than one transfer.
+  */
+void sampleInput() {
+  ros::WallDuration retry(connectionRetry);
+  ros::WallDuration period(oversamplingFrequency > 0.0 ?
+    1.0/oversamplingFrequency : 0.0);
+  ros::WallDuration minInterval(oversamplingMinInterval);
+  ros::WallTime nextTime = ros::WallTime::now();
+  ros::WallTime blockTime = nextTime;
+  InputSamples::Ptr block;
+  uint32_t sequence = 0;
+
+  while (running && ros::ok()) {
+    bool sampled = false;
+    unsigned short sample = 0;
+    {
+      boost::recursive_mutex::scoped_lock lock(deviceMutex);
+
+      if (!device.isNull() && device->isConnected() &&
+          isInput(oversamplingChannel)) {
+        Pololu::Usc::Usb::Mini::GetServoVariables
+          getServoVariablesRequest(settings.channels.size());
+
+        if (transfer(getServoVariablesRequest, "SampleInput")) {
+          Pololu::Usc::Usb::Variables::Servos variables =
+            getServoVariablesRequest.getResponse();
+
+          if (oversamplingChannel < variables.size()) {
+            sample = variables[oversamplingChannel].position;
+            sampled = true;
+          }
+        }
+      }
+    }
+
+    if (!sampled) {
+      ++numSamplingFailures;
+      samplingRate = 0.0;
+      block.reset();
+      retry.sleep();
+
+      nextTime = blockTime = ros::WallTime::now();
+      continue;
+    }
+
+    if (!block) {
+      block.reset(new InputSamples());
+      block->channel = oversamplingChannel;
+      block->samples.reserve(oversamplingBlockSize);
+    }
+    block->samples.push_back(sample);
+
+    if (block->samples.size() >= oversamplingBlockSize) {
+      ros::WallTime now = ros::WallTime::now();
+      double interval = (now-blockTime).toSec();
+
+      block->header.stamp = ros::Time::now();
+      block->sequence = ++sequence;
+      block->period = interval/block->samples.size();
+      inputSamplesPublisher.publish(block);
+      block.reset();
+
+      samplingRate = (interval > 0.0) ? oversamplingBlockSize/interval : 0.0;
+      blockTime = now;
+      ++numSamplingBlocks;
+    }
+
+    ros::WallTime now = ros::WallTime::now();
+    nextTime = nextTime+period;
+    if (nextTime < now+minInterval)
+      nextTime = now+minInterval;
+    (nextTime-now).sleep();
+  }
+}
+
+bool getErrors(GetErrors::Request& request, GetErrors::Response& response) {
+  Snapshot snapshot;
+
+  if (getSnapshot(snapshot)) {
+    response.stamp = snapshot.stamp;
+    response.age = (ros::Time::now()-snapshot.stamp).toSec();
+    response.errors = snapshot.errors;
+  }
   else
     return false;
 
@@ -371,6 +1137,8 @@ bool getErrors(GetErrors::Request& request, GetErrors::Response& response) {
 
 bool getChannels(GetChannels::Request& request, GetChannels::Response&
     response) {
+  boost::recursive_mutex::scoped_lock lock(deviceMutex);
+
   if (!settings.channels.empty()) {
     response.mode.resize(settings.channels.size());
 
@@ -393,21 +1161,21 @@ bool getChannels(GetChannels::Request& request, GetChannels::Response&
 
 bool getPositions(GetPositions::Request& request, GetPositions::Response&
     response) {
-  Pololu::Usc::Usb::Mini::GetServoVariables
-    getServoVariablesRequest(settings.channels.size());
+  Snapshot snapshot;
 
-  if (transfer(getServoVariablesRequest, "GetServoVariables")) {
-    Pololu::Usc::Usb::Variables::Servos variables =
-      getServoVariablesRequest.getResponse();
+  if (getSnapshot(snapshot)) {
+    response.stamp = snapshot.stamp;
+    response.age = (ros::Time::now()-snapshot.stamp).toSec();
     response.actual.resize(request.channels.size());
     response.target.resize(request.channels.size());
 
     for (int i = 0; i < request.channels.size(); ++i) {
-      if (isServo(request.channels[i])) {
+      if (isServo(request.channels[i]) &&
+          hasChannel(snapshot, request.channels[i])) {
         response.actual[i] = qusToAngle(request.channels[i],
-          variables[request.channels[i]].position);
+          snapshot.servos[request.channels[i]].position);
         response.target[i] = qusToAngle(request.channels[i],
-          variables[request.channels[i]].target);
+          snapshot.servos[request.channels[i]].target);
       }
       else {
         response.actual[i] = std::numeric_limits<float>::quiet_NaN();
@@ -422,18 +1190,18 @@ bool getPositions(GetPositions::Request& request, GetPositions::Response&
 }
 
 bool getSpeeds(GetSpeeds::Request& request, GetSpeeds::Response& response) {
-  Pololu::Usc::Usb::Mini::GetServoVariables
-    getServoVariablesRequest(settings.channels.size());
+  Snapshot snapshot;
 
-  if (transfer(getServoVariablesRequest, "GetServoVariables")) {
-    Pololu::Usc::Usb::Variables::Servos variables =
-      getServoVariablesRequest.getResponse();
+  if (getSnapshot(snapshot)) {
+    response.stamp = snapshot.stamp;
+    response.age = (ros::Time::now()-snapshot.stamp).toSec();
     response.speed.resize(request.channels.size());
 
     for (int i = 0; i < request.channels.size(); ++i) {
-      if (isServo(request.channels[i]))
+      if (isServo(request.channels[i]) &&
+          hasChannel(snapshot, request.channels[i]))
         response.speed[i] = qusToAngularSpeed(request.channels[i],
-          variables[request.channels[i]].speed);
+          snapshot.servos[request.channels[i]].speed);
       else
         response.speed[i] = std::numeric_limits<float>::quiet_NaN();
     }
@@ -446,19 +1214,19 @@ bool getSpeeds(GetSpeeds::Request& request, GetSpeeds::Response& response) {
 
 bool getAccelerations(GetAccelerations::Request& request,
     GetAccelerations::Response& response) {
-  Pololu::Usc::Usb::Mini::GetServoVariables
-    getServoVariablesRequest(settings.channels.size());
+  Snapshot snapshot;
 
-  if (transfer(getServoVariablesRequest, "GetServoVariables")) {
-    Pololu::Usc::Usb::Variables::Servos variables =
-      getServoVariablesRequest.getResponse();
+  if (getSnapshot(snapshot)) {
+    response.stamp = snapshot.stamp;
+    response.age = (ros::Time::now()-snapshot.stamp).toSec();
     response.acceleration.resize(request.channels.size());
 
     for (int i = 0; i < request.channels.size(); ++i) {
-      if (isServo(request.channels[i]))
+      if (isServo(request.channels[i]) &&
+          hasChannel(snapshot, request.channels[i]))
         response.acceleration[i] = qusToAngularAcceleration(
           request.channels[i],
-          variables[request.channels[i]].acceleration);
+          snapshot.servos[request.channels[i]].acceleration);
       else
         response.acceleration[i] = std::numeric_limits<float>::quiet_NaN();
     }
@@ -471,25 +1239,25 @@ bool getAccelerations(GetAccelerations::Request& request,
 
 bool getProfiles(GetProfiles::Request& request, GetProfiles::Response&
     response) {
-  Pololu::Usc::Usb::Mini::GetServoVariables
-    getServoVariablesRequest(settings.channels.size());
+  Snapshot snapshot;
 
-  if (transfer(getServoVariablesRequest, "GetServoVariables")) {
-    Pololu::Usc::Usb::Variables::Servos variables =
-      getServoVariablesRequest.getResponse();
+  if (getSnapshot(snapshot)) {
+    response.stamp = snapshot.stamp;
+    response.age = (ros::Time::now()-snapshot.stamp).toSec();
     response.position.resize(request.channels.size());
     response.speed.resize(request.channels.size());
     response.acceleration.resize(request.channels.size());
 
     for (int i = 0; i < request.channels.size(); ++i) {
-      if (isServo(request.channels[i])) {
+      if (isServo(request.channels[i]) &&
+          hasChannel(snapshot, request.channels[i])) {
         response.position[i] = qusToAngle(request.channels[i],
-          variables[request.channels[i]].position);
+          snapshot.servos[request.channels[i]].position);
         response.speed[i] = qusToAngularSpeed(request.channels[i],
-          variables[request.channels[i]].speed);
+          snapshot.servos[request.channels[i]].speed);
         response.acceleration[i] = qusToAngularAcceleration(
           request.channels[i],
-          variables[request.channels[i]].acceleration);
+          snapshot.servos[request.channels[i]].acceleration);
       }
       else {
         response.position[i] = std::numeric_limits<float>::quiet_NaN();
@@ -505,18 +1273,18 @@ bool getProfiles(GetProfiles::Request& request, GetProfiles::Response&
 }
 
 bool getInputs(GetInputs::Request& request, GetInputs::Response& response) {
-  Pololu::Usc::Usb::Mini::GetServoVariables
-    getServoVariablesRequest(settings.channels.size());
+  Snapshot snapshot;
 
-  if (transfer(getServoVariablesRequest, "GetServoVariables")) {
-    Pololu::Usc::Usb::Variables::Servos variables =
-      getServoVariablesRequest.getResponse();
+  if (getSnapshot(snapshot)) {
+    response.stamp = snapshot.stamp;
+    response.age = (ros::Time::now()-snapshot.stamp).toSec();
     response.voltage.resize(request.channels.size());
 
     for (int i = 0; i < request.channels.size(); ++i) {
-      if (isInput(request.channels[i]))
+      if (isInput(request.channels[i]) &&
+          hasChannel(snapshot, request.channels[i]))
         response.voltage[i] =
-          variables[request.channels[i]].position/1023.0*5.0;
+          snapshot.servos[request.channels[i]].position/1023.0*5.0;
       else
         response.voltage[i] = std::numeric_limits<float>::quiet_NaN();
     }
@@ -529,8 +1297,10 @@ bool getInputs(GetInputs::Request& request, GetInputs::Response& response) {
 
 bool initialize(Initialize::Request& request, Initialize::Response&
     response) {
+  boost::recursive_mutex::scoped_lock lock(deviceMutex);
   Pololu::Usc::Usb::Reinitialize reinitializeRequest;
 
+  batch.invalidate();
   if (!transfer(reinitializeRequest, "Reinitialize"))
     return false;
 
@@ -549,17 +1319,13 @@ bool clearErrors(ClearErrors::Request& request, ClearErrors::Response&
 
 bool setPositions(SetPositions::Request& request, SetPositions::Response&
     response) {
-  Pololu::Usc::Usb::SetTarget setTargetRequest(settings.channels.size());
+  boost::recursive_mutex::scoped_lock lock(deviceMutex);
   bool result = true;
 
   for (int i = 0; i < request.channels.size(); ++i) {
-    if (isServo(request.channels[i])) {
-      setTargetRequest.setServo(request.channels[i]);
-      setTargetRequest.setValue(angleToQus(request.channels[i],
+    if (isServo(request.channels[i]))
+      batch.setTarget(request.channels[i], angleToQus(request.channels[i],
         request.position[i]));
-
-      result &= transfer(setTargetRequest, "SetTarget");
-    }
     else {
       ROS_WARN("SetTarget request failed: Channel %d not in servo mode.",
         request.channels[i]);
@@ -567,21 +1333,19 @@ bool setPositions(SetPositions::Request& request, SetPositions::Response&
     }
   }
 
+  result &= batch.commit("SetPositions");
+
   return result;
 }
 
 bool setSpeeds(SetSpeeds::Request& request, SetSpeeds::Response& response) {
-  Pololu::Usc::Usb::SetSpeed setSpeedRequest(settings.channels.size());
+  boost::recursive_mutex::scoped_lock lock(deviceMutex);
   bool result = true;
 
   for (int i = 0; i < request.channels.size(); ++i) {
-    if (isServo(request.channels[i])) {
-      setSpeedRequest.setServo(request.channels[i]);
-      setSpeedRequest.setValue(angularSpeedToQus(request.channels[i],
-        request.speed[i]));
-
-      result &= transfer(setSpeedRequest, "SetSpeed");
-    }
+    if (isServo(request.channels[i]))
+      batch.setSpeed(request.channels[i], angularSpeedToQus(
+        request.channels[i], request.speed[i]));
     else {
       ROS_WARN("SetSpeed request failed: Channel %d not in servo mode.",
         request.channels[i]);
@@ -589,23 +1353,20 @@ bool setSpeeds(SetSpeeds::Request& request, SetSpeeds::Response& response) {
     }
   }
 
+  result &= batch.commit("SetSpeeds");
+
   return result;
 }
 
 bool setAccelerations(SetAccelerations::Request& request,
     SetAccelerations::Response& response) {
-  Pololu::Usc::Usb::SetAcceleration setAccelerationRequest(
-    settings.channels.size());
+  boost::recursive_mutex::scoped_lock lock(deviceMutex);
   bool result = true;
 
   for (int i = 0; i < request.channels.size(); ++i) {
-    if (isServo(request.channels[i])) {
-      setAccelerationRequest.setServo(request.channels[i]);
-      setAccelerationRequest.setValue(angularAccelerationToQus(
+    if (isServo(request.channels[i]))
+      batch.setAcceleration(request.channels[i], angularAccelerationToQus(
         request.channels[i], request.acceleration[i]));
-
-      result &= transfer(setAccelerationRequest, "SetAcceleration");
-    }
     else {
       ROS_WARN("SetAcceleration request failed: Channel %d not in servo mode.",
         request.channels[i]);
@@ -613,76 +1374,147 @@ bool setAccelerations(SetAccelerations::Request& request,
     }
   }
 
+  result &= batch.commit("SetAccelerations");
+
+  return result;
+}
+
+/** Apply servo profiles given by a SetProfiles request or Profiles frame,
+  * tracing them if they carry a trace identifier
+  *
+  * Callers hold the device lock across the batch.
+  */
+template <typename T> bool applyProfiles(const T& profiles, size_t
+    numChannels, const std::string& name, uint32_t trace = 0) {
+  naro_trace::Scope scope(tracer, naro_trace::stageUscProfiles, trace);
+  bool result = true;
+
+  for (int i = 0; i < numChannels; ++i) {
+    if (isServo(profiles.channels[i])) {
+      batch.setTarget(profiles.channels[i], angleToQus(profiles.channels[i],
+        profiles.position[i]));
+      batch.setSpeed(profiles.channels[i], angularSpeedToQus(
+        profiles.channels[i], profiles.speed[i]));
+      batch.setAcceleration(profiles.channels[i], angularAccelerationToQus(
+        profiles.channels[i], profiles.acceleration[i]));
+    }
+    else {
+      ROS_WARN("SetTarget/Speed/Acceleration request failed: "
+        "Channel %d not in servo mode.", profiles.channels[i]);
+      result = false;
+    }
+  }
+
+  result &= batch.commit(name, trace);
+
   return result;
 }
 
 bool setProfiles(SetProfiles::Request& request, SetProfiles::Response&
     response) {
-  Pololu::Usc::Usb::Mini::GetServoVariables
-    getServoVariablesRequest(settings.channels.size());
-  Pololu::Usc::Usb::Variables::Servos variables(settings.channels.size());
-  Pololu::Usc::Usb::SetTarget setTargetRequest(settings.channels.size());
-  Pololu::Usc::Usb::SetSpeed setSpeedRequest(settings.channels.size());
-  Pololu::Usc::Usb::SetAcceleration setAccelerationRequest(
-    settings.channels.size());
-  bool force = true, result = true;
+  boost::recursive_mutex::scoped_lock lock(deviceMutex);
+  setProfilesStamp = ros::Time::now();
+  return applyProfiles(request, request.channels.size(), "SetProfiles");
+}
 
-  if (transfer(getServoVariablesRequest, "GetServoVariables")) {
-    variables = getServoVariablesRequest.getResponse();
-    force = false;
+/** Apply the newest profiles frame and acknowledge it asynchronously
+  *
+  * Frames are received through a queue of length one which is serviced
+  * by its own spinner thread, such that superseded frames never wait
+  * behind service calls. Frames with a sequence number not beyond the
+  * last applied one are stale and dropped, gaps in the sequence count as
+  * frames dropped by the queue. A lower sequence number with a newer stamp
+  * indicates a restarted publisher. Frames stamped before the last service
+  * call setting profiles are dropped as well.
+  */
+void receiveProfiles(const Profiles::ConstPtr& profiles) {
+  if (profilesStatus.applied &&
+      (profiles->sequence <= profilesStatus.sequence)) {
+    if (profiles->header.stamp <= profilesStamp) {
+      ++profilesStatus.dropped;
+      return;
+    }
   }
+  else if (profilesStatus.applied)
+    profilesStatus.dropped += profiles->sequence-profilesStatus.sequence-1;
+
+  {
+    boost::recursive_mutex::scoped_lock lock(deviceMutex);
+    if (profiles->header.stamp < setProfilesStamp) {
+      profilesStatus.sequence = profiles->sequence;
+      ++profilesStatus.dropped;
+      return;
+    }
 
-  for (int i = 0; i < request.channels.size(); ++i) {
-    if (isServo(request.channels[i])) {
-      setTargetRequest.setServo(request.channels[i]);
-      setSpeedRequest.setServo(request.channels[i]);
-      setAccelerationRequest.setServo(request.channels[i]);
-
-      unsigned short target = angleToQus(request.channels[i],
-        request.position[i]);
-      unsigned short speed = angularSpeedToQus(request.channels[i],
-        request.speed[i]);
-      unsigned char acceleration = angularAccelerationToQus(
-        request.channels[i], request.acceleration[i]);
-
-      if (force || (target != variables[i].position)) {
-        setTargetRequest.setValue(target);
-        result &= transfer(setTargetRequest, "SetTarget");
-      }
+    profilesStatus.result = applyProfiles(*profiles,
+      profiles->channels.size(), "Profiles", profiles->trace);
+  }
+  profilesStatus.header.stamp = ros::Time::now();
+  profilesStatus.sequence = profiles->sequence;
+  ++profilesStatus.applied;
+  profilesStamp = profiles->header.stamp;
 
-      if (force || (speed != variables[i].speed)) {
-        setSpeedRequest.setValue(speed);
-        result &= transfer(setSpeedRequest, "SetSpeed");
-      }
+  profilesStatusPublisher.publish(ProfilesStatus::Ptr(
+    new ProfilesStatus(profilesStatus)));
+}
 
-      if (force || (acceleration != variables[i].acceleration)) {
-        setAccelerationRequest.setValue(acceleration);
-        result &= transfer(setAccelerationRequest, "SetAccelerationRequest");
+/** Poll the shared memory segment for profiles frames written by the fin
+  * controller and apply the newest one
+  *
+  * Frames are read without any system call, polling merely sleeps between
+  * checks of the sequence number. Frames overwritten before being polled
+  * or stamped before the last service call setting profiles count as
+  * dropped.
+  */
+void receiveSharedProfiles() {
+  ros::WallDuration period(1.0/sharedMemoryPollFrequency);
+  naro_shm::Profiles frame;
+  uint32_t lastSequence = 0;
+
+  while (running && ros::ok()) {
+    if (profilesSegment.getSequence() != lastSequence) {
+      uint32_t sequence = profilesSegment.read(frame);
+
+      if (sequence) {
+        if (lastSequence)
+          sharedProfilesDropped += sequence-lastSequence-1;
+        lastSequence = sequence;
+
+        boost::recursive_mutex::scoped_lock lock(deviceMutex);
+        if (frame.stamp < setProfilesStamp.toNSec())
+          ++sharedProfilesDropped;
+        else {
+          applyProfiles(frame, std::min<size_t>(frame.numChannels,
+            naro_shm::maxChannels), "SharedProfiles", frame.trace);
+          ++sharedProfilesApplied;
+        }
       }
     }
-    else {
-      ROS_WARN("SetTarget/Speed/Acceleration request failed: "
-        "Channel %d not in servo mode.", request.channels[i]);
-      result = false;
-    }
+
+    period.sleep();
   }
+}
 
-  return result;
+bool dumpTrace(naro_trace::DumpTrace::Request& request,
+    naro_trace::DumpTrace::Response& response) {
+  int numSpans = tracer.dump(request.file.empty() ? traceFile :
+    request.file);
+
+  if (numSpans < 0)
+    return false;
+  response.spans = numSpans;
+
+  return true;
 }
 
 bool setOutputs(SetOutputs::Request& request, SetOutputs::Response&
     response) {
-  Pololu::Usc::Usb::SetTarget setTargetRequest(settings.channels.size());
+  boost::recursive_mutex::scoped_lock lock(deviceMutex);
   bool result = true;
 
   for (int i = 0; i < request.channels.size(); ++i) {
-    if (isOutput(request.channels[i])) {
-      setTargetRequest.setServo(request.channels[i]);
-      setTargetRequest.setValue(request.high[i] ? 6000 : 0);
-
-      if (!transfer(setTargetRequest, "SetTarget"))
-        result = false;
-    }
+    if (isOutput(request.channels[i]))
+      batch.setTarget(request.channels[i], request.high[i] ? 6000 : 0);
     else {
       ROS_WARN("SetTarget request failed: Channel %d not in output mode.",
         request.channels[i]);
@@ -690,25 +1522,31 @@ bool setOutputs(SetOutputs::Request& request, SetOutputs::Response&
     }
   }
 
+  result &= batch.commit("SetOutputs");
+
   return result;
 }
 
 void updateDiagnostics(const ros::TimerEvent& event) {
+  boost::recursive_mutex::scoped_lock lock(deviceMutex);
   updater->update();
 }
 
 void tryConnect(const ros::TimerEvent& event) {
+  boost::recursive_mutex::scoped_lock lock(deviceMutex);
+
   if (device.isNull() || !device->isConnected()) {
     if (!connect())
       ROS_INFO("Retrying in %.2f second(s).", connectionRetry);
   }
 }
 
-int main(int argc, char **argv) {
-  ros::init(argc, argv, "usc_server");
-  ros::NodeHandle node("~");
-
-  updater.reset(new diagnostic_updater::Updater());
+/** Advertise the services and start the timers of the USB servo controller
+  * server under the given private node handle
+  */
+void startNode(ros::NodeHandle& node) {
+  updater.reset(new diagnostic_updater::Updater(ros::NodeHandle(), node,
+    node.getNamespace()));
   updater->setHardwareID("none");
 
   updater->add("Context", diagnoseContext);
@@ -717,9 +1555,15 @@ int main(int argc, char **argv) {
   updater->add("Connection", diagnoseConnection);
   updater->add("Configuration", diagnoseConfiguration);
   updater->add("Transfer", diagnoseTransfer);
+  updater->add("Latency", diagnoseLatency);
+  updater->add("Writes", diagnoseWrites);
+  updater->add("Acquisition", diagnoseAcquisition);
+  updater->add("Oversampling", diagnoseOversampling);
+  updater->add("Shared Memory", diagnoseSharedMemory);
   updater->force_update();
 
   getParameters(node);
+  tracer.enable(traceEnabled ? traceCapacity : 0);
 
   connect();
 
@@ -739,15 +1583,101 @@ int main(int argc, char **argv) {
     setAccelerations);
   setProfilesService = node.advertiseService("set_profiles", setProfiles);
   setOutputsService = node.advertiseService("set_outputs", setOutputs);
-
-  ros::Timer diagnosticsTimer = node.createTimer(
+  dumpTraceService = node.advertiseService("dump_trace", dumpTrace);
+
+  servoStatePublisher = node.advertise<ServoState>("servo_state", 1);
+  profilesStatusPublisher = node.advertise<ProfilesStatus>(
+    "profiles_status", 1);
+  if (oversamplingEnabled)
+    inputSamplesPublisher = node.advertise<InputSamples>("input_samples",
+      10);
+
+  ros::NodeHandle profilesNode(node);
+  profilesNode.setCallbackQueue(&profilesQueue);
+  profilesSubscriber = profilesNode.subscribe("profiles", 1,
+    receiveProfiles, ros::TransportHints().tcpNoDelay());
+  profilesSpinner.reset(new ros::AsyncSpinner(1, &profilesQueue));
+
+  diagnosticsTimer = node.createTimer(
     ros::Duration(1.0), updateDiagnostics);
-  ros::Timer connectionTimer = node.createTimer(
+  connectionTimer = node.createTimer(
     ros::Duration(connectionRetry), tryConnect);
 
-  ros::spin();
+  running = true;
+
+  if (sharedMemoryEnabled) {
+    std::string nodeName = node.getNamespace();
+
+    if (!servoStateSegment.create(naro_shm::getSegmentName(nodeName,
+        "servo_state")) || !profilesSegment.create(
+        naro_shm::getSegmentName(nodeName, "profiles")))
+      ROS_WARN("Failed to create shared memory segments: %s",
+        strerror(errno));
+    if (profilesSegment.isOpen())
+      sharedProfilesThread = boost::thread(receiveSharedProfiles);
+  }
+
+  if (acquisitionFrequency > 0.0)
+    acquisitionThread = boost::thread(acquireSnapshots);
+  if (oversamplingEnabled && (oversamplingBlockSize > 0))
+    samplingThread = boost::thread(sampleInput);
+  profilesSpinner->start();
+}
+
+void stopNode() {
+  diagnosticsTimer.stop();
+  connectionTimer.stop();
+
+  profilesSpinner->stop();
+  running = false;
+
+  if (acquisitionThread.joinable())
+    acquisitionThread.join();
+  if (samplingThread.joinable())
+    samplingThread.join();
+  if (sharedProfilesThread.joinable())
+    sharedProfilesThread.join();
+
+  servoStateSegment.close();
+  profilesSegment.close();
 
   disconnect();
 
+  if (tracer.isEnabled() && !traceFile.empty())
+    tracer.dump(traceFile);
+}
+
+};
+
+#ifdef NARO_NODELET
+namespace naro_usc_srvs {
+  /** Nodelet running the USB servo controller server in the process of a
+    * nodelet manager
+    */
+  class UscServerNodelet :
+    public nodelet::Nodelet {
+  public:
+    ~UscServerNodelet() {
+      stopNode();
+    };
+
+    virtual void onInit() {
+      startNode(getPrivateNodeHandle());
+    };
+  };
+};
+
+PLUGINLIB_DECLARE_CLASS(naro_usc_srvs, usc_server,
+  naro_usc_srvs::UscServerNodelet, nodelet::Nodelet)
+#else
+int main(int argc, char **argv) {
+  ros::init(argc, argv, "usc_server");
+  ros::NodeHandle node("~");
+
+  startNode(node);
+  ros::spin();
+  stopNode();
+
   return 0;
 }
+#endif